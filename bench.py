@@ -0,0 +1,394 @@
+#!/usr/bin/env python3
+"""Loopback benchmark for sender/receiver.
+
+Builds both binaries, then runs a transfer for every combination of file size, record size,
+blast size (M) and impairment profile, and writes the results as JSON. Each run checks the
+received file byte for byte and reports goodput, retransmit ratio, CPU seconds per GB on each
+side and blast completion times taken from the sender's binary trace.
+
+    ./bench.py                                  # default matrix, results to bench.json
+    ./bench.py --sizes 4M,64M --profiles clean,ge_burst --repeat 3 --out new.json
+    ./bench.py --baseline old.json              # flag regressions against an earlier run
+    ./bench.py --sessions 1,10,100,300 --sizes 1M   # N concurrent senders into one --daemon receiver
+
+With --sessions, every combination runs N senders at once against a single receiver in daemon mode
+instead of the impairment profiles, and reports the aggregate goodput over all of them; a run is ok
+only if every session's output file matches. Hundreds of senders overrun a single receive socket's
+buffer; spread them over several with --receiver-args "--threads 4".
+"""
+
+import argparse
+import json
+import os
+import platform
+import re
+import resource
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO = os.path.dirname(os.path.abspath(__file__))
+
+# Receiver impairment flags per profile; the seed is added per run
+PROFILES = {
+    "clean":        [],
+    "bernoulli_1":  ["--loss", "bernoulli:1"],
+    "ge_burst":     ["--loss", "ge:0.5:20:50"],
+    "delay_jitter": ["--delay", "5", "--jitter", "2"],
+    "reorder":      ["--reorder", "2"],
+    "duplicate":    ["--duplicate", "2"],
+    "corrupt":      ["--corrupt", "1"],
+    "mixed":        ["--loss", "bernoulli:0.5", "--delay", "2", "--jitter", "1", "--reorder", "1", "--duplicate", "1"],
+}
+
+TRACE_HEADER = struct.Struct("<IHHQ")
+TRACE_ENTRY = struct.Struct("<QHH5I")
+TR_PACKET_SENT, TR_PARITY_SENT, TR_BLAST_COMPLETE = 1, 2, 5
+
+
+def parse_size(s):
+    m = re.fullmatch(r"(\d+)([KMG]?)", s.strip().upper())
+    if not m:
+        raise argparse.ArgumentTypeError("bad size: " + s)
+    return int(m.group(1)) * {"": 1, "K": 1 << 10, "M": 1 << 20, "G": 1 << 30}[m.group(2)]
+
+
+def build(build_dir):
+    os.makedirs(build_dir, exist_ok=True)
+    for name in ("sender", "receiver", "tracedump"):
+        cmd = ["g++", "-O2", "-std=c++17", "-pthread", "-I", REPO, os.path.join(REPO, name + ".cpp"),
+               "-o", os.path.join(build_dir, name)]
+        subprocess.run(cmd, check=True)
+
+
+def fields(log, prefix):
+    """key=value pairs of the first log line starting with prefix"""
+    for line in log.splitlines():
+        if line.startswith(prefix):
+            return {k: v for k, v in re.findall(r"(\w+)=([^,\s]+)", line)}
+    return {}
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def blast_times(trace_path):
+    """Completion time of every blast, from its first datagram to the REC_MISS that closed it"""
+    first_sent, done = {}, {}
+    try:
+        with open(trace_path, "rb") as f:
+            data = f.read()
+    except OSError:
+        return [], 0
+    off = TRACE_HEADER.size
+    while off + TRACE_ENTRY.size <= len(data):
+        ns, event, _thread, a0, a1, a2, _a3, _a4 = TRACE_ENTRY.unpack_from(data, off)
+        off += TRACE_ENTRY.size
+        if event in (TR_PACKET_SENT, TR_PARITY_SENT):
+            first_sent.setdefault(a2, ns)
+        elif event == TR_BLAST_COMPLETE and a0 in first_sent:
+            done[a0] = (ns - first_sent[a0]) / 1e6
+    return list(done.values()), len(first_sent) - len(done)
+
+
+def run_one(bin_dir, work, size, record_size, blast_records, profile, seed, args):
+    for f in os.listdir(work):
+        if f != "input.bin":
+            os.unlink(os.path.join(work, f))
+    input_path = os.path.join(work, "input.bin")
+
+    receiver_cmd = [os.path.join(bin_dir, "receiver"), str(args.record_loss), "--seed", str(seed)] + PROFILES[profile] + args.receiver_args
+    sender_cmd = [os.path.join(bin_dir, "sender"), input_path, "127.0.0.1",
+                  "--record-size", str(record_size), "--blast-records", str(blast_records)] + args.sender_args
+
+    receiver = subprocess.Popen(receiver_cmd, cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    time.sleep(0.2)
+    start = time.monotonic()
+    sender = subprocess.Popen(sender_cmd, cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+
+    timed_out = False
+    usage = {}
+    for name, proc in (("sender", sender), ("receiver", receiver)):
+        deadline = start + args.timeout
+        while True:
+            pid, status, ru = os.wait4(proc.pid, os.WNOHANG)
+            if pid:
+                proc.returncode = os.waitstatus_to_exitcode(status)
+                usage[name] = ru.ru_utime + ru.ru_stime
+                break
+            if time.monotonic() > deadline:
+                timed_out = True
+                proc.kill()
+                _, status, ru = os.wait4(proc.pid, 0)
+                proc.returncode = os.waitstatus_to_exitcode(status)
+                usage[name] = ru.ru_utime + ru.ru_stime
+                break
+            time.sleep(0.01)
+        if name == "sender" and timed_out:
+            receiver.kill()
+    wall = time.monotonic() - start
+
+    def read(name):
+        try:
+            with open(os.path.join(work, name)) as f:
+                return f.read()
+        except OSError:
+            return ""
+
+    sender_log, receiver_log = read("sender.log"), read("receiver.log")
+    summary = fields(sender_log, "[Sender] Summary:")
+    duration = fields(sender_log, "[Sender] Duration=")
+    recv_impair = fields(receiver_log, "[Receiver] Impairment: dropped=")
+
+    identical = False
+    out_path = os.path.join(work, "recv_testfile.bin")
+    if os.path.exists(out_path) and os.path.getsize(out_path) == size:
+        with open(input_path, "rb") as a, open(out_path, "rb") as b:
+            identical = a.read() == b.read()
+
+    secs = float(duration.get("Duration", "0").rstrip("s") or 0) or wall
+    total_records = (size + record_size - 1) // record_size
+    missing = int(summary.get("missing_records_reported", 0))
+    times, unfinished = blast_times(os.path.join(work, "sender.trace"))
+    gb = size / 1e9
+
+    return {
+        "file_size": size,
+        "record_size": record_size,
+        "blast_records": blast_records,
+        "profile": profile,
+        "seed": seed,
+        "ok": not timed_out and sender.returncode == 0 and receiver.returncode == 0 and identical,
+        "identical": identical,
+        "timed_out": timed_out,
+        "duration_s": secs,
+        "goodput_mbps": size * 8 / secs / 1e6 if secs > 0 else None,
+        "retransmit_ratio": missing / total_records if total_records else 0.0,
+        "bytes_sent": int(summary.get("bytes_sent", 0)),
+        "overhead_ratio": int(summary.get("bytes_sent", 0)) / size - 1 if size else 0.0,
+        "rec_miss_timeouts": sender_log.count("No REC_MISS received (timeout)"),
+        "rto_probes": int(summary.get("rto_probes", 0)),
+        "cpu_s_per_gb": {k: v / gb for k, v in usage.items()},
+        "blast_completion_ms": {
+            "p50": percentile(times, 50),
+            "p95": percentile(times, 95),
+            "p99": percentile(times, 99),
+            "max": max(times) if times else None,
+            "unfinished": unfinished,
+        },
+        "impairment": {k: int(v) for k, v in recv_impair.items()},
+    }
+
+
+def run_sessions(bin_dir, work, size, record_size, blast_records, sessions, args):
+    """N senders at once into one daemon receiver, each from a directory of its own"""
+    for f in os.listdir(work):
+        if f != "input.bin":
+            path = os.path.join(work, f)
+            shutil.rmtree(path) if os.path.isdir(path) else os.unlink(path)
+    input_path = os.path.join(work, "input.bin")
+    out_dir = os.path.join(work, "out")
+    os.mkdir(out_dir)
+
+    receiver_cmd = [os.path.join(bin_dir, "receiver"), str(args.record_loss), "--daemon", "--output-dir", out_dir,
+                    "--max-sessions", str(max(sessions, 1))] + args.receiver_args
+    # Every sender sends the same file, so resume is off to give each session a file of its own
+    sender_cmd = [os.path.join(bin_dir, "sender"), input_path, "127.0.0.1", "--no-resume",
+                  "--record-size", str(record_size), "--blast-records", str(blast_records)] + args.sender_args
+
+    receiver = subprocess.Popen(receiver_cmd, cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.2)
+    start = time.monotonic()
+    senders = []
+    for i in range(sessions):
+        cwd = os.path.join(work, "s%d" % i)
+        os.mkdir(cwd)
+        senders.append(subprocess.Popen(sender_cmd, cwd=cwd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+
+    timed_out = False
+    failed = 0
+    for proc in senders:
+        try:
+            proc.wait(timeout=max(0.0, start + args.timeout - time.monotonic()))
+        except subprocess.TimeoutExpired:
+            timed_out = True
+            proc.kill()
+            proc.wait()
+        failed += proc.returncode != 0
+    wall = time.monotonic() - start
+
+    # The daemon runs until it is told to stop
+    receiver.send_signal(signal.SIGINT)
+    deadline = time.monotonic() + 10
+    while True:
+        pid, status, ru = os.wait4(receiver.pid, os.WNOHANG)
+        if pid:
+            break
+        if time.monotonic() > deadline:
+            receiver.kill()
+            _, status, ru = os.wait4(receiver.pid, 0)
+            break
+        time.sleep(0.01)
+    receiver.returncode = os.waitstatus_to_exitcode(status)
+
+    with open(input_path, "rb") as f:
+        data = f.read()
+    outputs = os.listdir(out_dir)
+    identical = 0
+    for name in outputs:
+        with open(os.path.join(out_dir, name), "rb") as f:
+            identical += f.read() == data
+    receiver_log = ""
+    try:
+        with open(os.path.join(work, "receiver.log")) as f:
+            receiver_log = f.read()
+    except OSError:
+        pass
+    counts = fields(receiver_log, "[Receiver] Sessions:")
+
+    return {
+        "file_size": size,
+        "record_size": record_size,
+        "blast_records": blast_records,
+        "profile": "sessions",
+        "sessions": sessions,
+        "seed": 0,
+        "ok": not timed_out and not failed and receiver.returncode == 0 and identical == sessions,
+        "identical": identical,
+        "senders_failed": failed,
+        "timed_out": timed_out,
+        "duration_s": wall,
+        "goodput_mbps": sessions * size * 8 / wall / 1e6 if wall > 0 else None,
+        "cpu_s_per_gb": {"receiver": (ru.ru_utime + ru.ru_stime) / (sessions * size / 1e9)},
+        "sessions_evicted": int(counts.get("evicted", 0)),
+        "sessions_refused": int(counts.get("refused", 0)),
+        "blast_completion_ms": {"p50": None, "p95": None, "p99": None, "max": None, "unfinished": 0},
+    }
+
+
+def key(r):
+    return (r["file_size"], r["record_size"], r["blast_records"], r["profile"], r.get("sessions", 1))
+
+
+def compare(results, baseline_path, tolerance):
+    """Runs that got slower, costlier or started failing compared with a baseline file"""
+    with open(baseline_path) as f:
+        baseline = json.load(f)
+    base = {}
+    for r in baseline["runs"]:
+        base.setdefault(key(r), []).append(r)
+    regressions = []
+    for r in results:
+        old = base.get(key(r))
+        if not old:
+            continue
+        if any(o["ok"] for o in old) and not r["ok"]:
+            regressions.append((key(r), "now fails"))
+            continue
+        best = max((o["goodput_mbps"] or 0) for o in old)
+        if r["goodput_mbps"] and best and r["goodput_mbps"] < best * (1 - tolerance):
+            regressions.append((key(r), "goodput %.1f -> %.1f Mbps" % (best, r["goodput_mbps"])))
+        old_tail = [o["blast_completion_ms"]["p99"] for o in old if o["blast_completion_ms"]["p99"] is not None]
+        new_tail = r["blast_completion_ms"]["p99"]
+        if old_tail and new_tail is not None and new_tail > min(old_tail) * (1 + tolerance) + 1.0:
+            regressions.append((key(r), "p99 blast completion %.2f -> %.2f ms" % (min(old_tail), new_tail)))
+    return regressions
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--sizes", default="1M,16M", help="file sizes, e.g. 1M,16M,256M")
+    p.add_argument("--record-sizes", default="512,1024", help="record sizes in bytes")
+    p.add_argument("--blast-records", default="250,1000", help="records per blast (M)")
+    p.add_argument("--profiles", default=",".join(PROFILES), help="impairment profiles: " + ", ".join(PROFILES))
+    p.add_argument("--repeat", type=int, default=1, help="runs per combination, with seeds seed..seed+repeat-1")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--record-loss", type=float, default=0.0, help="receiver's per-record loss percentage")
+    p.add_argument("--sender-args", default="--window 4", help="extra sender flags")
+    p.add_argument("--receiver-args", default="", help="extra receiver flags")
+    p.add_argument("--timeout", type=float, default=120.0, help="seconds before a run is killed")
+    p.add_argument("--build-dir", default=os.path.join(REPO, "bench_build"))
+    p.add_argument("--no-build", action="store_true", help="use the binaries already in --build-dir")
+    p.add_argument("--out", default="bench.json")
+    p.add_argument("--baseline", help="earlier results to check for regressions")
+    p.add_argument("--tolerance", type=float, default=10.0, help="allowed regression in percent")
+    p.add_argument("--sessions", help="concurrent sender counts, e.g. 1,10,100,300 (daemon receiver, no profiles)")
+    args = p.parse_args()
+    args.sender_args = args.sender_args.split()
+    args.receiver_args = args.receiver_args.split()
+
+    profiles = args.profiles.split(",")
+    for name in profiles:
+        if name not in PROFILES:
+            p.error("unknown profile " + name)
+
+    if not args.no_build:
+        build(args.build_dir)
+
+    try:
+        commit = subprocess.run(["git", "-C", REPO, "rev-parse", "--short", "HEAD"], capture_output=True, text=True).stdout.strip()
+    except OSError:
+        commit = ""
+
+    work = tempfile.mkdtemp(prefix="blast-bench-")
+    results = []
+    try:
+        for size in [parse_size(s) for s in args.sizes.split(",")]:
+            with open(os.path.join(work, "input.bin"), "wb") as f:
+                f.write(os.urandom(size))
+            for record_size in [int(x) for x in args.record_sizes.split(",")]:
+                for blast_records in [int(x) for x in args.blast_records.split(",")]:
+                    if args.sessions:
+                        for n in [int(x) for x in args.sessions.split(",")]:
+                            r = run_sessions(args.build_dir, work, size, record_size, blast_records, n, args)
+                            results.append(r)
+                            print("%-8s rec=%-5d M=%-5d sessions=%-4d %s  %8.1f Mbps aggregate  identical=%d/%d  rx_cpu=%.2f s/GB" % (
+                                  "%dK" % (size >> 10), record_size, blast_records, n, "ok  " if r["ok"] else "FAIL",
+                                  r["goodput_mbps"] or 0, r["identical"], n, r["cpu_s_per_gb"]["receiver"]), flush=True)
+                        continue
+                    for profile in profiles:
+                        for i in range(args.repeat):
+                            r = run_one(args.build_dir, work, size, record_size, blast_records, profile, args.seed + i, args)
+                            results.append(r)
+                            print("%-8s rec=%-5d M=%-5d %-13s seed=%-3d %s  %8.1f Mbps  retx=%.3f  p99=%s ms" % (
+                                  "%dK" % (size >> 10), record_size, blast_records, profile, r["seed"],
+                                  "ok  " if r["ok"] else "FAIL", r["goodput_mbps"] or 0, r["retransmit_ratio"],
+                                  "%.2f" % r["blast_completion_ms"]["p99"] if r["blast_completion_ms"]["p99"] is not None else "-"),
+                                  flush=True)
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+    report = {
+        "commit": commit,
+        "host": platform.node(),
+        "kernel": platform.release(),
+        "cpus": os.cpu_count(),
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "sender_args": args.sender_args,
+        "receiver_args": args.receiver_args,
+        "runs": results,
+    }
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2)
+    print("wrote %d runs to %s" % (len(results), args.out))
+
+    failed = sum(not r["ok"] for r in results)
+    if args.baseline:
+        regressions = compare(results, args.baseline, args.tolerance / 100.0)
+        for k, what in regressions:
+            print("REGRESSION %s: %s" % (k, what))
+        if regressions:
+            return 1
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
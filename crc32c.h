@@ -0,0 +1,121 @@
+// crc32c.h
+// CRC32C (Castagnoli), the checksum behind the per-record and per-datagram integrity checks
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+// Reflected polynomial 0x1EDC6F41, with the usual pre- and post-inversion, so crc32c(0, ...) gives
+// the standard check value and a running CRC can be extended by passing it back in.
+const uint32_t CRC32C_POLY = 0x82f63b78;
+
+// a * b modulo the polynomial, both in the reflected bit order (bit 31 is x^0)
+inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m; m >>= 1) {
+        if (a & m) p ^= b;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^n modulo the polynomial
+inline uint32_t crc32c_xpow(uint64_t n) {
+    uint32_t p = 1u << 31, sq = 1u << 30;   // x^0, x^1
+    for (; n; n >>= 1) {
+        if (n & 1) p = crc32c_multmodp(sq, p);
+        sq = crc32c_multmodp(sq, sq);
+    }
+    return p;
+}
+
+// Slicing-by-8 tables for CPUs without the SSE4.2 crc32 instruction
+struct Crc32cTables {
+    uint32_t t[8][256];
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int s = 1; s < 8; ++s) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+    }
+};
+
+inline uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+    static const Crc32cTables tab;
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= c;
+        c = tab.t[7][w & 0xff] ^ tab.t[6][(w >> 8) & 0xff] ^ tab.t[5][(w >> 16) & 0xff] ^ tab.t[4][(w >> 24) & 0xff]
+          ^ tab.t[3][(w >> 32) & 0xff] ^ tab.t[2][(w >> 40) & 0xff] ^ tab.t[1][(w >> 48) & 0xff] ^ tab.t[0][w >> 56];
+    }
+    while (len--) c = (c >> 8) ^ tab.t[0][(c ^ *p++) & 0xff];
+    return ~c;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// The crc32 instruction takes three cycles but can start one per cycle, so long buffers are cut
+// into three interleaved lanes of CRC32C_LANE bytes. The lanes are then merged by carry-less
+// multiplication: shifting a CRC over n zero bytes is a product with x^(8n) mod P, and crc32 on
+// the 64-bit product does the reduction (it also multiplies by x^33, which the constants undo).
+const size_t CRC32C_LANE = 128;
+
+struct Crc32cLaneShifts {
+    uint64_t one, two;      // x^(8 * lane - 33), x^(16 * lane - 33)
+    Crc32cLaneShifts() : one(crc32c_xpow(8 * CRC32C_LANE - 33)), two(crc32c_xpow(16 * CRC32C_LANE - 33)) {}
+};
+
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t crc32c_shift_hw(uint32_t crc, uint64_t k) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi64_si128((long long)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(prod));
+}
+
+// Eight bytes per crc32 instruction, three lanes at a time where the buffer is long enough
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len) {
+    static const Crc32cLaneShifts shifts;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t c = ~crc;
+    for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE, len -= 3 * CRC32C_LANE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC32C_LANE + i, 8);
+            memcpy(&w2, p + 2 * CRC32C_LANE + i, 8);
+            c = _mm_crc32_u64(c, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c = crc32c_shift_hw((uint32_t)c, shifts.two) ^ crc32c_shift_hw((uint32_t)c1, shifts.one) ^ c2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--) c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+#endif
+
+// CRC32C of len bytes, continuing from crc (0 to start a new one)
+inline uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const bool hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    if (hw) return crc32c_hw(crc, data, len);
+#endif
+    return crc32c_sw(crc, data, len);
+}
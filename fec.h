@@ -0,0 +1,61 @@
+// fec.h
+// XOR parity for forward error correction over the record slots of a datagram group
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Parity j of a group covers the data datagrams i of that group with i % K == j. Its payload slot s
+// is the XOR of slot s (the s-th record) of every covered datagram, so any single record missing
+// from a slot, whether its datagram was dropped or just that record was, can be rebuilt.
+
+// dst ^= src over len bytes. Written with 32-byte vector types so it compiles to SIMD, and cloned
+// for AVX2 where the CPU has it.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void xor_into(char *dst, const char *src, size_t len) {
+    typedef uint8_t vec32 __attribute__((vector_size(32)));
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        vec32 a[4], b[4];
+        memcpy(a, dst + i, sizeof(a));
+        memcpy(b, src + i, sizeof(b));
+        a[0] ^= b[0]; a[1] ^= b[1]; a[2] ^= b[2]; a[3] ^= b[3];
+        memcpy(dst + i, a, sizeof(a));
+    }
+    for (; i + 32 <= len; i += 32) {
+        vec32 a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; ++i) dst[i] ^= src[i];
+}
+
+// Parity index within a round for parity j of group g
+inline uint32_t fec_parity_index(uint32_t group, uint32_t j, uint32_t k) { return group * k + j; }
+
+// Per covered datagram, a parity packet lists the datagram's chunk number and segment count,
+// followed by its segment table, so a datagram lost outright can still be placed
+struct FecCoverEntry {
+    uint32_t chunk_no;
+    uint32_t num_segments;
+};
+
+// Adapts the parity count of an n-datagram group to the loss left over after FEC: any residual
+// loss in a round adds a parity datagram, eight clean rounds in a row take one away
+inline uint32_t fec_adapt_k(uint32_t n, uint32_t k, uint64_t residual_missing, uint32_t &clean_rounds) {
+    uint32_t max_k = n / 2 ? n / 2 : 1;
+    if (residual_missing) {
+        clean_rounds = 0;
+        return k < max_k ? k + 1 : max_k;
+    }
+    if (++clean_rounds >= 8 && k > 1) {
+        clean_rounds = 0;
+        return k - 1;
+    }
+    return k;
+}
@@ -0,0 +1,134 @@
+// impairment.h
+// In-process network impairment for loopback testing. The receiver runs every incoming blast
+// datagram through it before processing: it may be dropped, corrupted, duplicated, delayed (with
+// jitter) or held back so later datagrams overtake it. All decisions come from one seeded generator, so the
+// same seed and the same traffic give the same impairments.
+#pragma once
+
+#include <netinet/in.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+class Impairment {
+public:
+    // Datagram loss in percent: Bernoulli, or a two-state Gilbert-Elliott burst model
+    double loss_pct = 0;
+    bool gilbert_elliott = false;
+    double p_good_bad = 0, p_bad_good = 0, loss_good = 0, loss_bad = 0;
+    // Delay and jitter in milliseconds; reordering and duplication in percent of datagrams
+    double delay_ms = 0, jitter_ms = 0, reorder_pct = 0, duplicate_pct = 0;
+    // Datagrams with one bit flipped, in percent
+    double corrupt_pct = 0;
+
+    uint64_t dropped = 0, duplicated = 0, delayed = 0, reordered = 0, corrupted = 0;
+
+    struct Delivery {
+        std::chrono::steady_clock::time_point due;
+        uint64_t seq;
+        std::vector<char> data;
+        sockaddr_in addr;
+        socklen_t addrlen;
+    };
+
+    // "bernoulli:P" or "ge:P_GB:P_BG:LOSS_BAD[:LOSS_GOOD]", all in percent
+    bool parse_loss(const std::string &spec) {
+        double a = 0, b = 0, c = 0, d = 0;
+        if (sscanf(spec.c_str(), "bernoulli:%lf", &a) == 1) {
+            gilbert_elliott = false;
+            loss_pct = a;
+            return true;
+        }
+        int n = sscanf(spec.c_str(), "ge:%lf:%lf:%lf:%lf", &a, &b, &c, &d);
+        if (n >= 3) {
+            gilbert_elliott = true;
+            p_good_bad = a; p_bad_good = b; loss_bad = c; loss_good = n == 4 ? d : 0;
+            return true;
+        }
+        return false;
+    }
+
+    void seed(uint64_t s) { rng.seed(s); }
+
+    bool active() const {
+        return loss_pct > 0 || gilbert_elliott || delay_ms > 0 || jitter_ms > 0 || reorder_pct > 0 || duplicate_pct > 0 || corrupt_pct > 0;
+    }
+    bool delays() const { return delay_ms > 0 || jitter_ms > 0 || reorder_pct > 0; }
+
+    // Runs one arriving datagram through the model. Returns how many copies are to be processed
+    // right away; delayed copies are queued and come back out of pop_due().
+    int admit(const char *buf, size_t n, const sockaddr_in &addr, socklen_t addrlen) {
+        if (lost()) { dropped++; return 0; }
+        if (chance(corrupt_pct)) {
+            // The caller's buffer is read-only, so the damaged copy comes back out of pop_due()
+            Delivery d;
+            d.due = std::chrono::steady_clock::now();
+            d.seq = next_seq++;
+            d.data.assign(buf, buf + n);
+            size_t bit = std::uniform_int_distribution<size_t>(0, n * 8 - 1)(rng);
+            d.data[bit / 8] ^= (char)(1 << (bit % 8));
+            d.addr = addr;
+            d.addrlen = addrlen;
+            queue.push(std::move(d));
+            corrupted++;
+            return 0;
+        }
+        int copies = chance(duplicate_pct) ? 2 : 1;
+        if (copies == 2) duplicated++;
+        int now = 0;
+        for (int i = 0; i < copies; ++i) {
+            double ms = delay_ms;
+            if (jitter_ms > 0) ms += std::uniform_real_distribution<double>(-jitter_ms, jitter_ms)(rng);
+            if (chance(reorder_pct)) {
+                // Held back long enough for the datagrams behind it to get ahead
+                ms += std::max(1.0, 2 * jitter_ms);
+                reordered++;
+            }
+            if (ms <= 0) { now++; continue; }
+            Delivery d;
+            d.due = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                            std::chrono::duration<double, std::milli>(ms));
+            d.seq = next_seq++;
+            d.data.assign(buf, buf + n);
+            d.addr = addr;
+            d.addrlen = addrlen;
+            queue.push(std::move(d));
+            delayed++;
+        }
+        return now;
+    }
+
+    // Next queued datagram whose time has come, if any
+    bool pop_due(Delivery &out) {
+        if (queue.empty() || queue.top().due > std::chrono::steady_clock::now()) return false;
+        out = std::move(const_cast<Delivery &>(queue.top()));
+        queue.pop();
+        return true;
+    }
+
+    bool pending() const { return !queue.empty(); }
+
+private:
+    bool chance(double pct) { return pct > 0 && std::uniform_real_distribution<double>(0.0, 100.0)(rng) < pct; }
+
+    bool lost() {
+        if (!gilbert_elliott) return chance(loss_pct);
+        if (bad ? chance(p_bad_good) : chance(p_good_bad)) bad = !bad;
+        return chance(bad ? loss_bad : loss_good);
+    }
+
+    struct Later {
+        bool operator()(const Delivery &a, const Delivery &b) const { return a.due != b.due ? a.due > b.due : a.seq > b.seq; }
+    };
+
+    std::mt19937_64 rng{1};
+    bool bad = false;
+    uint64_t next_seq = 0;
+    std::priority_queue<Delivery, std::vector<Delivery>, Later> queue;
+};
@@ -0,0 +1,278 @@
+// log.h
+// Logging for sender.cpp and receiver.cpp: a levelled text log for setup, errors and summaries,
+// and a binary trace for per-packet events. Trace entries go into a lock-free ring and are written
+// out by a background thread, so the datapath never formats text or makes a syscall to log.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <time.h>
+
+enum class LogLevel { Error, Warn, Info, Debug };
+
+inline bool parse_log_level(const std::string &s, LogLevel &level) {
+    if (s == "error") level = LogLevel::Error;
+    else if (s == "warn") level = LogLevel::Warn;
+    else if (s == "info") level = LogLevel::Info;
+    else if (s == "debug") level = LogLevel::Debug;
+    else return false;
+    return true;
+}
+
+class SharedLog;
+
+// One log statement: text is gathered locally and written in one piece when the statement ends,
+// so lines from different threads never interleave. Statements below the log level cost nothing
+// beyond the level check.
+class LogLine {
+public:
+    LogLine(SharedLog &log, bool active) : log(log), active(active) {}
+    LogLine(LogLine &&other) : log(other.log), ss(std::move(other.ss)), active(other.active), urgent(other.urgent) { other.active = false; }
+    ~LogLine();
+
+    template <typename T> LogLine &operator<<(const T &v) { if (active) ss << v; return *this; }
+    LogLine &operator<<(std::ostream &(*manip)(std::ostream &)) {
+        // endl only ends the line; the file is flushed by level, not per statement
+        if (active) ss << '\n';
+        (void)manip;
+        return *this;
+    }
+
+private:
+    friend class SharedLog;
+    SharedLog &log;
+    std::ostringstream ss;
+    bool active;
+    bool urgent = false;
+};
+
+// Text log shared by every thread of a process. Output is buffered; only warnings and errors are
+// flushed straight away so they survive a crash.
+class SharedLog {
+public:
+    bool open(const std::string &path) {
+        std::lock_guard<std::mutex> g(m);
+        file.open(path, std::ios::out | std::ios::trunc);
+        return file.is_open();
+    }
+    bool is_open() const { return file.is_open(); }
+    void flush() { std::lock_guard<std::mutex> g(m); file.flush(); }
+    void close() { std::lock_guard<std::mutex> g(m); file.close(); }
+
+    void set_level(LogLevel l) { level = l; }
+    bool enabled(LogLevel l) const { return l <= level; }
+
+    void write(const std::string &s, bool urgent) {
+        std::lock_guard<std::mutex> g(m);
+        if (!file.is_open()) return;
+        file << s;
+        if (urgent) file.flush();
+    }
+
+    // log(LogLevel::Debug) << ...; plain log << ... is Info
+    LogLine operator()(LogLevel l) {
+        LogLine line(*this, enabled(l));
+        line.urgent = l <= LogLevel::Warn;
+        return line;
+    }
+    template <typename T> LogLine operator<<(const T &v) {
+        LogLine line(*this, enabled(LogLevel::Info));
+        line << v;
+        return line;
+    }
+
+private:
+    std::mutex m;
+    std::ofstream file;
+    LogLevel level = LogLevel::Info;
+};
+
+inline LogLine::~LogLine() {
+    if (active) log.write(ss.str(), urgent);
+}
+
+// Binary trace events. Each entry carries up to five integer arguments; trace_event_info() gives
+// the name and printf format the decoder (tracedump.cpp) renders them with, in argument order.
+enum TraceEvent : uint16_t {
+    TR_PACKET_SENT = 1,      // packet, total_packets, blast, size
+    TR_PARITY_SENT,          // packet, total_packets, blast, size
+    TR_BLAST_SENT,           // blast, first record, last record
+    TR_RETRANSMIT,           // first record, last record, blast
+    TR_BLAST_COMPLETE,       // blast, retransmit rounds
+    TR_REC_MISS_PART,        // part, parts, blast, ranges
+    TR_REC_MISS_TIMEOUT,     // blast
+    TR_PACKET_RECEIVED,      // packet, total_packets, blast, first record, last record
+    TR_RECORD_REWRITTEN,     // record
+    TR_PACKET_REBUILT,       // packet, blast
+    TR_BLAST_OVER,           // blast
+    TR_NACK_SENT,            // blast, datagrams, complete
+    TR_PROBE_SENT,           // blast, round, probes
+    TR_PROBE_RECEIVED,       // blast, round
+    TR_NACK_EARLY,           // blast, round, lost datagrams, datagrams
+    TR_EVENT_COUNT
+};
+
+struct TraceEventInfo {
+    const char *name;
+    const char *format;
+};
+
+inline const TraceEventInfo *trace_event_info(uint16_t event) {
+    static const TraceEventInfo info[TR_EVENT_COUNT] = {
+        {nullptr, nullptr},
+        {"packet_sent",      "Sent packet %u of %u for blast %u (size=%u)"},
+        {"parity_sent",      "Sent parity packet %u of %u for blast %u (size=%u)"},
+        {"blast_sent",       "Blast %u sent with records (%u-%u)"},
+        {"retransmit",       "Retransmitting records (%u-%u) for blast %u"},
+        {"blast_complete",   "Blast %u complete after %u retransmit round(s)"},
+        {"rec_miss_part",    "REC_MISS part %u/%u for blast %u: %u range(s)"},
+        {"rec_miss_timeout", "No REC_MISS received (timeout) for blast %u"},
+        {"packet_received",  "Received Packet %u of %u for Blast %u with records (%u-%u)"},
+        {"record_rewritten", "Retransmitted record %u written"},
+        {"packet_rebuilt",   "Rebuilt Packet %u of Blast %u from parity"},
+        {"blast_over",       "is_blast_over: Blast %u"},
+        {"nack_sent",        "Sent REC_MISS for blast %u in %u datagram(s), complete=%u"},
+        {"probe_sent",       "RTO: probed blast %u round %u (probe %u)"},
+        {"probe_received",   "Probe for blast %u round %u"},
+        {"nack_early",       "Closing blast %u round %u early: %u of %u datagram(s) lost"},
+    };
+    return event > 0 && event < TR_EVENT_COUNT ? &info[event] : nullptr;
+}
+
+struct TraceEntry {
+    uint64_t ns;        // steady clock, relative to TraceFileHeader::start_ns
+    uint16_t event;
+    uint16_t thread;
+    uint32_t arg[5];
+};
+
+const uint32_t TRACE_MAGIC = 0x52544c42; // "BLTR" on disk
+const uint16_t TRACE_VERSION = 1;
+
+struct TraceFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint64_t start_ns;  // wall clock at open, for correlating traces of both ends
+};
+
+// Multi-producer ring of trace entries (a bounded queue with per-slot sequence numbers) drained to
+// disk by one background thread. Producers never block: when the ring is full the entry is dropped
+// and counted.
+class TraceLog {
+public:
+    static const size_t CAPACITY = 1 << 16;
+
+    bool open(const std::string &path) {
+        file.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!file.is_open()) return false;
+        slots.reset(new Slot[CAPACITY]);
+        for (size_t i = 0; i < CAPACITY; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+        start = std::chrono::steady_clock::now();
+        TraceFileHeader h = {TRACE_MAGIC, TRACE_VERSION, (uint16_t)sizeof(TraceEntry),
+                             (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::system_clock::now().time_since_epoch()).count()};
+        file.write((const char *)&h, sizeof(h));
+        running.store(true, std::memory_order_release);
+        drainer = std::thread([this] { drain_loop(); });
+        return true;
+    }
+
+    bool is_open() const { return running.load(std::memory_order_acquire); }
+
+    // Small id of the calling thread, stamped on its entries (stream or receive thread number)
+    static void set_thread(uint16_t id) { thread_id() = id; }
+
+    void record(uint16_t event, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, uint32_t d = 0, uint32_t e = 0) {
+        if (!is_open()) return;
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        Slot *s;
+        for (;;) {
+            s = &slots[pos & (CAPACITY - 1)];
+            uint64_t seq = s->seq.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)seq - (int64_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        s->entry.ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        s->entry.event = event;
+        s->entry.thread = thread_id();
+        s->entry.arg[0] = a; s->entry.arg[1] = b; s->entry.arg[2] = c; s->entry.arg[3] = d; s->entry.arg[4] = e;
+        s->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    uint64_t dropped_entries() const { return dropped.load(std::memory_order_relaxed); }
+    uint64_t written_entries() const { return written; }
+
+    // Stops the drain thread after everything recorded so far is on disk
+    void close() {
+        if (!running.exchange(false)) return;
+        drainer.join();
+        drain();
+        file.close();
+    }
+
+    ~TraceLog() { close(); }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        TraceEntry entry;
+    };
+
+    static uint16_t &thread_id() {
+        static thread_local uint16_t id = 0;
+        return id;
+    }
+
+    // Single consumer: moves every published entry to the file
+    size_t drain() {
+        TraceEntry batch[256];
+        size_t n = 0, total = 0;
+        for (;;) {
+            Slot &s = slots[tail & (CAPACITY - 1)];
+            if (s.seq.load(std::memory_order_acquire) != tail + 1) break;
+            batch[n++] = s.entry;
+            s.seq.store(tail + CAPACITY, std::memory_order_release);
+            tail++;
+            if (n == 256) { file.write((const char *)batch, sizeof(batch)); total += n; n = 0; }
+        }
+        if (n) file.write((const char *)batch, n * sizeof(TraceEntry));
+        total += n;
+        written += total;
+        return total;
+    }
+
+    void drain_loop() {
+        while (running.load(std::memory_order_acquire)) {
+            if (drain() == 0) {
+                timespec ts = {0, 1000000};
+                nanosleep(&ts, nullptr);
+            }
+        }
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) uint64_t tail = 0;
+    std::atomic<uint64_t> dropped{0};
+    uint64_t written = 0;
+    std::atomic<bool> running{false};
+    std::thread drainer;
+    std::ofstream file;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,144 @@
+// lz.h
+// Small LZ77 block codec (LZ4 block format) for compressing datagram payloads in flight
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// A block is a run of sequences: a token (literal count in the high nibble, match length - 4 in the
+// low one, 15 meaning more length bytes follow, each adding up to 255), the literals, then a 16-bit
+// little-endian offset back into the output. The last sequence has literals only. Blocks are
+// independent, so every datagram decodes on its own whatever else was lost.
+
+const uint32_t LZ_MIN_MATCH = 4;
+const uint32_t LZ_HASH_BITS = 12;
+const size_t LZ_MAX_OFFSET = 65535;
+const size_t LZ_MAX_INPUT = 65536;     // positions are kept in 16 bits
+// As in LZ4, the last match ends 5 bytes before the end and starts 12 before it, which leaves the
+// decoder room to copy in words
+const size_t LZ_LAST_LITERALS = 5, LZ_MF_LIMIT = 12;
+
+inline uint32_t lz_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+inline uint32_t lz_hash(uint32_t seq) { return (seq * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+// Length field continuation: 255s, then the remainder
+inline uint8_t *lz_put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Worst-case size of one sequence with `literals` literals
+inline size_t lz_sequence_bound(size_t literals, size_t match) {
+    return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+}
+
+// Compresses n <= LZ_MAX_INPUT bytes into at most cap bytes. Returns the compressed size, or 0 if it
+// does not fit, in which case the data is best sent as it is.
+inline size_t lz_compress(const char *src, size_t n, char *dst, size_t cap) {
+    if (n > LZ_MAX_INPUT) return 0;
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+    uint16_t table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0, ip = 0;
+    size_t mf_limit = n > LZ_MF_LIMIT ? n - LZ_MF_LIMIT : 0;
+    size_t match_limit = n > LZ_LAST_LITERALS ? n - LZ_LAST_LITERALS : 0;
+    while (ip < mf_limit) {
+        uint32_t seq = lz_read32(in + ip);
+        uint32_t h = lz_hash(seq);
+        size_t ref = table[h];
+        table[h] = (uint16_t)ip;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != seq) {
+            // Step further the longer nothing has matched, so incompressible data goes by quickly
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len + 8 <= match_limit) {
+            uint64_t a, b;
+            memcpy(&a, in + ref + len, 8);
+            memcpy(&b, in + ip + len, 8);
+            if (a != b) { len += (size_t)__builtin_ctzll(a ^ b) / 8; break; }
+            len += 8;
+        }
+        while (ip + len < match_limit && in[ref + len] == in[ip + len]) len++;
+        size_t literals = ip - anchor;
+        if ((size_t)(oend - op) < lz_sequence_bound(literals, len)) return 0;
+        uint8_t *token = op++;
+        *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15) op = lz_put_length(op, literals - 15);
+        memcpy(op, in + anchor, literals);
+        op += literals;
+        size_t offset = ip - ref;
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        size_t m = len - LZ_MIN_MATCH;
+        *token |= (uint8_t)(m >= 15 ? 15 : m);
+        if (m >= 15) op = lz_put_length(op, m - 15);
+
+        ip += len;
+        anchor = ip;
+        if (ip - 2 < mf_limit) table[lz_hash(lz_read32(in + ip - 2))] = (uint16_t)(ip - 2);
+    }
+
+    size_t literals = n - anchor;
+    if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals) return 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) op = lz_put_length(op, literals - 15);
+    memcpy(op, in + anchor, literals);
+    op += literals;
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+// Copies len bytes eight at a time while both ends have the slack, bytewise for the rest. With
+// dst - src >= 8 this is also right for overlapping match copies.
+inline void lz_copy(uint8_t *dst, const uint8_t *src, size_t len, size_t dst_slack, size_t src_slack) {
+    size_t i = 0;
+    if (len + 8 <= dst_slack && len + 8 <= src_slack)
+        for (; i < len; i += 8) memcpy(dst + i, src + i, 8);
+    for (; i < len; ++i) dst[i] = src[i];
+}
+
+// Decompresses a block that must come out at exactly out_len bytes. False for anything malformed;
+// no read or write ever leaves the buffers, whatever the input.
+inline bool lz_decompress(const char *src, size_t n, char *dst, size_t out_len) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    size_t ip = 0, op = 0;
+    auto length = [&](size_t &len) {
+        uint8_t b;
+        do {
+            if (ip >= n) return false;
+            b = in[ip++];
+            len += b;
+        } while (b == 255);
+        return true;
+    };
+    while (ip < n) {
+        uint8_t token = in[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !length(literals)) return false;
+        if (literals > n - ip || literals > out_len - op) return false;
+        lz_copy(out + op, in + ip, literals, out_len - op, n - ip);
+        ip += literals;
+        op += literals;
+        if (ip == n) break;     // the last sequence has no match
+
+        if (n - ip < 2) return false;
+        size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && !length(len)) return false;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || len > out_len - op) return false;
+        if (offset >= 8) lz_copy(out + op, out + op - offset, len, out_len - op, out_len - op + offset);
+        else for (size_t i = 0; i < len; ++i) out[op + i] = out[op + i - offset];
+        op += len;
+    }
+    return op == out_len;
+}
@@ -0,0 +1,166 @@
+// metrics.h
+// Live metrics for sender.cpp and receiver.cpp. Every stream or receive thread owns its counters,
+// gauges and histograms and is their only writer, so updates are plain relaxed stores with no lock
+// or read-modify-write on the datapath. A background thread renders them as Prometheus text and
+// rewrites a stats file periodically, so long transfers can be watched while they run.
+#pragma once
+
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Monotonic count with a single writer; anyone may read it at any time
+class Counter {
+public:
+    void add(uint64_t n) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    Counter &operator+=(uint64_t n) { add(n); return *this; }
+    Counter &operator++() { add(1); return *this; }
+    void operator++(int) { add(1); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+    operator uint64_t() const { return get(); }
+
+private:
+    std::atomic<uint64_t> v{0};
+};
+
+// Point-in-time value (queue depth, rate, window)
+class Gauge {
+public:
+    void set(double x) { v.store(x, std::memory_order_relaxed); }
+    double get() const { return v.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> v{0};
+};
+
+// Upper bounds of histogram buckets: latencies in seconds, from 10 us to 10 s
+const double LATENCY_BOUNDS[] = {1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+                                 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+// Retransmit rounds a blast needed
+const double ROUND_BOUNDS[] = {0, 1, 2, 3, 4, 6, 8, 16, 32};
+
+// Fixed-bucket histogram with a single writer. Buckets hold plain counts; the Prometheus
+// cumulative form is built when rendering.
+class Histogram {
+public:
+    template <size_t N> explicit Histogram(const double (&b)[N]) : bounds(b), nbounds(N), counts(new Counter[N + 1]) {}
+    Histogram() : Histogram(LATENCY_BOUNDS) {}
+
+    void observe(double x) {
+        counts[std::lower_bound(bounds, bounds + nbounds, x) - bounds]++;
+        sum.store(sum.load(std::memory_order_relaxed) + x, std::memory_order_relaxed);
+        n++;
+    }
+    void observe(std::chrono::steady_clock::duration d) { observe(std::chrono::duration<double>(d).count()); }
+
+    uint64_t count() const { return n; }
+    double total() const { return sum.load(std::memory_order_relaxed); }
+    size_t buckets() const { return nbounds; }
+    double bound(size_t i) const { return bounds[i]; }
+    uint64_t bucket(size_t i) const { return counts[i]; }   // i == buckets() is the overflow bucket
+
+private:
+    const double *bounds;
+    size_t nbounds;
+    std::unique_ptr<Counter[]> counts;
+    std::atomic<double> sum{0};
+    Counter n;
+};
+
+// Builds a Prometheus text exposition. Call family() once per metric name, then add one sample
+// (or histogram) per label set.
+class PromText {
+public:
+    PromText() { out.precision(10); }
+
+    void family(const std::string &name, const char *type, const char *help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    }
+    void sample(const std::string &name, const std::string &labels, double v) {
+        out << name << braces(labels) << " " << v << "\n";
+    }
+    void sample(const std::string &name, const std::string &labels, uint64_t v) {
+        out << name << braces(labels) << " " << v << "\n";
+    }
+    void histogram(const std::string &name, const std::string &labels, const Histogram &h) {
+        uint64_t cum = 0;
+        std::string sep = labels.empty() ? "" : labels + ",";
+        for (size_t i = 0; i <= h.buckets(); ++i) {
+            cum += h.bucket(i);
+            std::ostringstream le;
+            if (i < h.buckets()) le << h.bound(i); else le << "+Inf";
+            out << name << "_bucket{" << sep << "le=\"" << le.str() << "\"} " << cum << "\n";
+        }
+        out << name << "_sum" << braces(labels) << " " << h.total() << "\n";
+        out << name << "_count" << braces(labels) << " " << h.count() << "\n";
+    }
+    std::string str() const { return out.str(); }
+
+private:
+    static std::string braces(const std::string &labels) { return labels.empty() ? "" : "{" + labels + "}"; }
+    std::ostringstream out;
+};
+
+// Rewrites a stats file every interval with whatever render() returns. The file is replaced by
+// rename, so a reader never sees a half-written one. stop() writes it a last time with final values.
+class StatsFile {
+public:
+    bool start(const std::string &file_path, std::chrono::milliseconds every, std::function<std::string()> render_fn) {
+        path = file_path;
+        interval = every;
+        render = std::move(render_fn);
+        if (!write()) return false;
+        running = true;
+        writer = std::thread([this] {
+            std::unique_lock<std::mutex> lock(m);
+            while (!cv.wait_for(lock, interval, [this] { return !running; })) write();
+        });
+        return true;
+    }
+
+    bool is_open() const { return writer.joinable(); }
+
+    void stop() {
+        if (!writer.joinable()) return;
+        {
+            std::lock_guard<std::mutex> g(m);
+            running = false;
+        }
+        cv.notify_one();
+        writer.join();
+        write();
+    }
+
+    ~StatsFile() { stop(); }
+
+private:
+    bool write() {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::out | std::ios::trunc);
+            if (!f) return false;
+            f << render();
+            if (!f) return false;
+        }
+        return ::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    std::string path;
+    std::chrono::milliseconds interval{1000};
+    std::function<std::string()> render;
+    std::mutex m;
+    std::condition_variable cv;
+    bool running = false;
+    std::thread writer;
+};
@@ -0,0 +1,133 @@
+// pacing.h
+// Sender-side rate pacing (token bucket) and loss/RTT driven AIMD congestion control
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <time.h>
+
+// Token bucket in front of every send syscall. rate is in bytes per second; 0 leaves the
+// datapath unpaced. Waits are done with a coarse nanosleep followed by a short spin, since
+// nanosleep alone overshoots by tens of microseconds.
+class Pacer {
+public:
+    void set_rate(double bytes_per_sec) {
+        rate = bytes_per_sec;
+        // Allow roughly 2 ms of line rate in one go, but never less than one GSO super-packet
+        burst = std::max(65536.0, rate * 0.002);
+        tokens = std::min(tokens, burst);
+    }
+
+    double get_rate() const { return rate; }
+
+    void wait(size_t bytes) {
+        if (rate <= 0) return;
+        refill();
+        if (tokens < (double)bytes) {
+            double need = ((double)bytes - tokens) / rate;
+            auto until = last + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(need));
+            double coarse = need - 50e-6;
+            if (coarse > 0) {
+                timespec ts;
+                ts.tv_sec = (time_t)coarse;
+                ts.tv_nsec = (long)((coarse - (double)ts.tv_sec) * 1e9);
+                nanosleep(&ts, nullptr);
+            }
+            while (std::chrono::steady_clock::now() < until) {}
+            refill();
+        }
+        tokens -= (double)bytes;
+    }
+
+    // Gives back what a wait() charged for bytes that did not go out after all
+    void refund(size_t bytes) {
+        if (rate > 0) tokens = std::min(burst, tokens + (double)bytes);
+    }
+
+private:
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        if (started) tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+        else { tokens = burst; started = true; }
+        last = now;
+    }
+
+    double rate = 0, tokens = 0, burst = 0;
+    bool started = false;
+    std::chrono::steady_clock::time_point last;
+};
+
+// AIMD window in datagrams, fed by the per-round loss fraction carried in each REC_MISS and by the
+// RTT from the end of a round to its REC_MISS. The pacing rate follows from cwnd / srtt, and the
+// retransmission timeout from srtt and rttvar as in TCP (RFC 6298).
+class CongestionControl {
+public:
+    double cwnd = 32;           // datagrams
+    double ssthresh = 1e9;
+    double srtt = 0, rttvar = 0, min_rtt = 0; // seconds
+    double loss_estimate = 0;   // EWMA of the per-round loss fraction
+    double loss_tolerance = 0.01;
+    uint64_t decreases = 0;
+    // RTO bounds in seconds. The floor stays above the receiver's early REC_MISS delay, so a probe
+    // is normally only needed when that REC_MISS was lost.
+    static constexpr double INITIAL_RTO = 0.25, MIN_RTO = 0.01, MAX_RTO = 2, RTO_GRANULARITY = 0.001;
+
+    void on_rtt_sample(double rtt) {
+        if (rtt <= 0) return;
+        if (srtt == 0) { srtt = rtt; rttvar = rtt / 2; min_rtt = rtt; return; }
+        rttvar = 0.75 * rttvar + 0.25 * std::abs(srtt - rtt);
+        srtt = 0.875 * srtt + 0.125 * rtt;
+        min_rtt = std::min(min_rtt, rtt);
+    }
+
+    // One REC_MISS answered a round of `datagrams` datagrams carrying `records`, of which `missing` were lost
+    void on_round_feedback(uint32_t datagrams, uint32_t records, uint32_t missing) {
+        if (records == 0) return;
+        double f = (double)missing / records;
+        loss_estimate = 0.875 * loss_estimate + 0.125 * f;
+        auto now = std::chrono::steady_clock::now();
+
+        if (f > loss_tolerance) {
+            // Multiplicative decrease, at most once per RTT so one bad burst is not punished repeatedly
+            if (std::chrono::duration<double>(now - last_decrease).count() >= srtt) {
+                ssthresh = cwnd = std::max(MIN_CWND, cwnd * (1 - BETA));
+                last_decrease = now;
+                decreases++;
+            }
+            return;
+        }
+        double delivered = datagrams * (1 - f);
+        if (cwnd < ssthresh) cwnd += delivered;              // slow start
+        else cwnd += delivered / cwnd;                        // additive increase, ~1 datagram per RTT
+        cwnd = std::min(cwnd, MAX_CWND);
+    }
+
+    // No REC_MISS came back at all: treat it like a TCP retransmission timeout
+    void on_timeout() {
+        ssthresh = std::max(MIN_CWND, cwnd / 2);
+        cwnd = MIN_CWND;
+        last_decrease = std::chrono::steady_clock::now();
+        decreases++;
+    }
+
+    // How long to wait for a REC_MISS before probing for it: srtt + 4 rttvar, bounded, and
+    // INITIAL_RTO until there is a sample. Callers double it for every probe that goes unanswered.
+    double rto() const {
+        if (srtt <= 0) return INITIAL_RTO;
+        return std::min(MAX_RTO, std::max(MIN_RTO, srtt + std::max(RTO_GRANULARITY, 4 * rttvar)));
+    }
+
+    // Bytes per second for the pacer; 0 until there is an RTT sample to derive it from
+    double pacing_rate(double datagram_bytes) const {
+        if (srtt <= 0) return 0;
+        double gain = cwnd < ssthresh ? 2.0 : 1.25;
+        return gain * cwnd * datagram_bytes / srtt;
+    }
+
+private:
+    static constexpr double MIN_CWND = 4, MAX_CWND = 1 << 20, BETA = 0.3;
+    std::chrono::steady_clock::time_point last_decrease;
+};
@@ -0,0 +1,380 @@
+// protocol.h
+// Wire structures and codecs shared by sender.cpp and receiver.cpp
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+struct Segment {
+    uint32_t start;
+    uint32_t end;
+};
+
+// FILE_HDR, the sender's proposal for the transfer layout. The receiver answers with
+// FILE_HDR_ACK_TAG followed by the header as it accepted it: it may lower M and
+// records_per_packet to fit its buffers, and the sender adopts whatever comes back. The receiver
+// also fills in session_id, which the sender then stamps on every datagram of the transfer, and
+// records_held, the records it kept from an earlier attempt at the same file (see RESUME below),
+// or with HDR_DELTA delta_blocks, how much of the file it can sign (see SIGNATURE below).
+// Record numbers are 32-bit, so a file can have up to 2^32 - 1 records; sizes and offsets are 64-bit.
+struct FileHeader {
+    uint32_t magic;               // FILE_HDR_MAGIC
+    uint32_t session_id;          // 0 in the proposal; assigned by the receiver (1..65535)
+    uint64_t file_size;
+    uint64_t file_id;             // fingerprint of the file's identity and version (with HDR_DELTA, of its
+                                  // path only); 0: do not resume
+    uint32_t record_size;
+    uint32_t M;                   // records per blast
+    uint32_t records_per_packet;  // records per data datagram
+    uint32_t max_datagram;        // largest UDP payload the sender will send, parity included
+    uint32_t flags;
+    uint32_t records_held;        // 0 in the proposal
+    uint32_t delta_blocks;        // 0 in the proposal
+    uint32_t reserved;
+};
+
+const uint32_t FILE_HDR_MAGIC = 0x52444846; // "FHDR" on the wire
+const uint32_t HDR_FRAGMENTATION = 1 << 0; // datagrams may exceed the path MTU and be IP-fragmented
+const uint32_t HDR_CHECKSUMS = 1 << 1;     // datagrams carry CRC32Cs (see PacketHeader::crc)
+const uint32_t HDR_COMPRESSION = 1 << 2;   // data datagrams may be PKT_COMPRESSED
+const uint32_t HDR_DELTA = 1 << 3;         // send only what differs from the receiver's copy
+const char FILE_HDR_ACK_TAG[] = "FILE_HDR_ACK";
+const size_t FILE_HDR_ACK_TAG_LEN = sizeof(FILE_HDR_ACK_TAG) - 1;
+
+// Header in front of every data and parity datagram. A data datagram continues with its segment
+// table, then, with HDR_CHECKSUMS, the CRC32C of each record it carries, then the records.
+//
+// With HDR_CHECKSUMS, crc is the CRC32C of the datagram with crc itself zeroed: of everything up to
+// the records for data, of the whole datagram for parity. A datagram failing it is dropped. A
+// record failing its own CRC is treated like a lost one, so REC_MISS asks for it again.
+//
+// With HDR_COMPRESSION, a data datagram flagged PKT_COMPRESSED carries its records as one LZ block
+// (lz.h) instead; the record CRCs are of the records as they decompress.
+struct PacketHeader {
+    uint32_t blast_id;
+    uint32_t chunk_no;       // data: index among the round's data datagrams; parity: parity index
+    uint32_t total_chunks;   // data datagrams in this round
+    uint32_t num_segments;   // data: segments carried; parity: datagrams covered
+    uint16_t flags;
+    uint8_t fec_n;           // FEC group size for this round, 0 when the round has no parity
+    uint8_t fec_k;           // parity datagrams per group
+    uint16_t round;          // 0 for the original blast, then one per retransmission round
+    uint16_t session;        // session id from FILE_HDR_ACK
+    uint32_t crc;
+};
+
+const uint16_t PKT_PARITY = 1 << 0;
+const uint16_t PKT_COMPRESSED = 1 << 1;
+// Retransmission timeout probe: a bare header (no segments) for the round the sender is waiting on,
+// with total_chunks as sent. It follows the round's data on the same socket, so by the time it is
+// read everything of the round that is going to arrive has; the receiver answers with the round's
+// REC_MISS, sending it again if it already has.
+const uint16_t PKT_PROBE = 1 << 2;
+
+// Records listed in a segment table as it sits in a datagram
+inline uint64_t segment_records(const char *table, uint32_t num_segments) {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < num_segments; ++i) {
+        Segment seg;
+        memcpy(&seg, table + (size_t)i * sizeof(Segment), sizeof(seg));
+        if (seg.end >= seg.start) n += (uint64_t)seg.end - seg.start + 1;
+    }
+    return n;
+}
+
+// Records per datagram are bounded by the 64-bit slot masks the receiver keeps per datagram
+const uint32_t MAX_RECORDS_PER_PACKET = 64;
+
+// UDP payload of a data datagram carrying `records` records
+inline size_t data_datagram_size(uint32_t records, uint32_t record_size, bool checksums) {
+    return sizeof(PacketHeader) + (size_t)records * (sizeof(Segment) + (checksums ? sizeof(uint32_t) : 0) + record_size);
+}
+
+// Whole-file digest, checked at DISCONNECT: the wrapping sum of record_digest() over every record
+// sent, where crc is the CRC32C of the record as sent (rec_size bytes, the last one zero-padded).
+// A sum does not care in which order, on which stream or in which round records arrive, and the
+// record number in the mix pins each record to its place. Records the receiver held from an
+// earlier attempt are not resent and count on neither side.
+inline uint64_t record_digest(uint32_t r, uint32_t crc) {
+    uint64_t z = ((uint64_t)r << 32 | crc) + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Dense one-bit-per-record set, used for loss tracking without per-record allocations. Bits are
+// updated atomically so threads owning different records can share one bitmap; resize is not
+// thread-safe and must happen before any of them start.
+struct RecordBitmap {
+    std::vector<uint64_t> words;
+
+    void resize(uint32_t nbits) { words.assign(((uint64_t)nbits + 63) / 64, 0); }
+    uint64_t word(uint32_t i) const { return __atomic_load_n(&words[i], __ATOMIC_RELAXED); }
+    bool test(uint32_t r) const { return (word(r >> 6) >> (r & 63)) & 1; }
+    void set(uint32_t r) { __atomic_fetch_or(&words[r >> 6], 1ull << (r & 63), __ATOMIC_RELAXED); }
+    void clear(uint32_t r) { __atomic_fetch_and(&words[r >> 6], ~(1ull << (r & 63)), __ATOMIC_RELAXED); }
+    // Sets bit r and returns whether it was set already
+    bool test_and_set(uint32_t r) {
+        uint64_t bit = 1ull << (r & 63);
+        return __atomic_fetch_or(&words[r >> 6], bit, __ATOMIC_RELAXED) & bit;
+    }
+
+    // First set bit in [from, to], or to + 1 if there is none
+    uint32_t next_set(uint32_t from, uint32_t to) const {
+        while (from <= to) {
+            uint64_t w = word(from >> 6) >> (from & 63);
+            if (w) {
+                uint32_t r = from + (uint32_t)__builtin_ctzll(w);
+                return r <= to ? r : to + 1;
+            }
+            from = (from | 63) + 1;
+            if (from == 0) break; // wrapped past UINT32_MAX
+        }
+        return to + 1;
+    }
+
+    // First clear bit in [from, to], or to + 1 if there is none
+    uint32_t next_clear(uint32_t from, uint32_t to) const {
+        while (from <= to) {
+            uint64_t w = ~word(from >> 6) >> (from & 63);
+            if (w) {
+                uint32_t r = from + (uint32_t)__builtin_ctzll(w);
+                return r <= to ? r : to + 1;
+            }
+            from = (from | 63) + 1;
+            if (from == 0) break;
+        }
+        return to + 1;
+    }
+
+    bool any(uint32_t from, uint32_t to) const { return next_set(from, to) <= to; }
+
+    // Sets a run of bits, a word at a time
+    void set_range(uint32_t first, uint32_t count) {
+        uint64_t r = first, end = (uint64_t)first + count;
+        while (r < end) {
+            uint32_t bit = (uint32_t)(r & 63);
+            uint64_t n = std::min<uint64_t>(64 - bit, end - r);
+            uint64_t mask = n == 64 ? ~0ull : ((1ull << n) - 1) << bit;
+            __atomic_fetch_or(&words[r >> 6], mask, __ATOMIC_RELAXED);
+            r += n;
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (size_t i = 0; i < words.size(); ++i) n += (uint64_t)__builtin_popcountll(word((uint32_t)i));
+        return n;
+    }
+};
+
+// Binary REC_MISS ("NACK"). A reply may span several datagrams; each part is self-contained and
+// carries either a list of [start, end] record ranges or a raw bitmap starting at `base`,
+// whichever is smaller for the records it covers. A reply that closes a round early also lists the
+// round's data datagrams that never arrived (NACK_CHUNKS, a bitmap of chunk numbers): the receiver
+// cannot know which records those carried, the sender can.
+const uint32_t NACK_MAGIC = 0x4b43414e; // "NACK" on the wire
+const uint8_t NACK_VERSION = 2;
+const uint8_t NACK_RANGES = 1;
+const uint8_t NACK_BITMAP = 2;
+const uint8_t NACK_CHUNKS = 3;
+// Payload budget per datagram, small enough to never be IP-fragmented
+const size_t NACK_MAX_PAYLOAD = 1200;
+
+struct NackHeader {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t encoding;
+    uint16_t part;      // index of this datagram within the reply
+    uint16_t parts;     // number of datagrams in the reply
+    uint16_t seq;       // per-blast reply counter, so parts of different replies are never mixed
+    uint32_t blast_id;
+    uint32_t base;      // bitmap: record (chunks: datagram) of bit 0; ranges: unused
+    uint32_t count;     // bitmap: number of bits; ranges: number of ranges
+    uint16_t round;     // round the reply answers; the sender drops replies to rounds it has moved past
+    uint16_t reserved;
+};
+
+// Encodes the missing records of one blast, i.e. the set bits of `missing` in [lo, hi], and the
+// data datagrams of `round` in lost_chunks (sorted)
+inline std::vector<std::vector<char>> encode_nack(uint32_t blast_id, uint16_t seq, uint16_t round, const RecordBitmap &missing,
+                                                  uint32_t lo, uint32_t hi, const std::vector<uint32_t> &lost_chunks = {})
+{
+    const uint32_t WINDOW_BITS = NACK_MAX_PAYLOAD * 8;
+    const size_t MAX_RANGES = NACK_MAX_PAYLOAD / (2 * sizeof(uint32_t));
+    std::vector<std::vector<char>> parts;
+
+    auto emit = [&](uint8_t encoding, uint32_t base, uint32_t count, const void *payload, size_t len) {
+        NackHeader h = {NACK_MAGIC, NACK_VERSION, encoding, 0, 0, seq, blast_id, base, count, round, 0};
+        std::vector<char> d(sizeof(h) + len);
+        memcpy(d.data(), &h, sizeof(h));
+        if (len) memcpy(d.data() + sizeof(h), payload, len);
+        parts.push_back(std::move(d));
+    };
+
+    // Walk the blast in bitmap-sized windows and pick the cheaper encoding for each
+    for (uint64_t w_lo = lo; w_lo <= hi; w_lo += WINDOW_BITS) {
+        uint32_t w_hi = (uint32_t)std::min<uint64_t>(hi, w_lo + WINDOW_BITS - 1);
+        std::vector<uint32_t> ranges;
+        for (uint32_t r = missing.next_set((uint32_t)w_lo, w_hi); r <= w_hi;) {
+            uint32_t e = r;
+            while (e < w_hi && missing.test(e + 1)) e++;
+            ranges.push_back(r);
+            ranges.push_back(e);
+            if (e == w_hi) break;
+            r = missing.next_set(e + 1, w_hi);
+        }
+        if (ranges.empty()) continue;
+
+        uint32_t nbits = w_hi - (uint32_t)w_lo + 1;
+        size_t bitmap_bytes = (nbits + 7) / 8;
+        if (ranges.size() / 2 <= MAX_RANGES && ranges.size() * sizeof(uint32_t) <= bitmap_bytes) {
+            emit(NACK_RANGES, 0, (uint32_t)(ranges.size() / 2), ranges.data(), ranges.size() * sizeof(uint32_t));
+        } else {
+            std::vector<uint8_t> bits(bitmap_bytes, 0);
+            for (uint32_t i = 0; i < ranges.size(); i += 2)
+                for (uint32_t r = ranges[i]; r <= ranges[i + 1]; ++r) bits[(r - w_lo) >> 3] |= 1u << ((r - w_lo) & 7);
+            emit(NACK_BITMAP, (uint32_t)w_lo, nbits, bits.data(), bits.size());
+        }
+    }
+
+    for (size_t i = 0; i < lost_chunks.size();) {
+        uint32_t base = lost_chunks[i];
+        std::vector<uint8_t> bits(NACK_MAX_PAYLOAD, 0);
+        uint32_t nbits = 0;
+        for (; i < lost_chunks.size() && lost_chunks[i] - base < WINDOW_BITS; ++i) {
+            uint32_t b = lost_chunks[i] - base;
+            bits[b >> 3] |= 1u << (b & 7);
+            nbits = b + 1;
+        }
+        emit(NACK_CHUNKS, base, nbits, bits.data(), (nbits + 7) / 8);
+    }
+
+    // Nothing missing is still a (one-part) reply: it tells the sender the blast is done
+    if (parts.empty()) emit(NACK_RANGES, 0, 0, nullptr, 0);
+
+    for (size_t i = 0; i < parts.size(); ++i) {
+        NackHeader *h = (NackHeader *)parts[i].data();
+        h->part = (uint16_t)i;
+        h->parts = (uint16_t)parts.size();
+    }
+    return parts;
+}
+
+// Decodes one NACK datagram, appending the missing record ranges it carries, or for NACK_CHUNKS the
+// lost datagrams to `chunks`. Returns false if it is not a well-formed NACK of a version this build
+// understands.
+inline bool decode_nack(const char *buf, size_t len, NackHeader &h, std::vector<std::pair<uint32_t, uint32_t>> &ranges,
+                        std::vector<uint32_t> &chunks) {
+    if (len < sizeof(NackHeader)) return false;
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != NACK_MAGIC || h.version != NACK_VERSION || h.part >= h.parts) return false;
+    const char *payload = buf + sizeof(h);
+    size_t payload_len = len - sizeof(h);
+
+    if (h.encoding == NACK_RANGES) {
+        if (payload_len < (size_t)h.count * 2 * sizeof(uint32_t)) return false;
+        for (uint32_t i = 0; i < h.count; ++i) {
+            uint32_t se[2];
+            memcpy(se, payload + i * sizeof(se), sizeof(se));
+            if (se[0] > se[1]) return false;
+            ranges.emplace_back(se[0], se[1]);
+        }
+        return true;
+    }
+    if (h.encoding == NACK_CHUNKS) {
+        if (payload_len < ((size_t)h.count + 7) / 8) return false;
+        const uint8_t *bits = (const uint8_t *)payload;
+        for (uint32_t i = 0; i < h.count; ++i)
+            if ((bits[i >> 3] >> (i & 7)) & 1) chunks.push_back(h.base + i);
+        return true;
+    }
+    if (h.encoding == NACK_BITMAP) {
+        if (payload_len < ((size_t)h.count + 7) / 8) return false;
+        const uint8_t *bits = (const uint8_t *)payload;
+        for (uint32_t i = 0; i < h.count; ++i) {
+            if (!((bits[i >> 3] >> (i & 7)) & 1)) continue;
+            uint32_t j = i;
+            while (j + 1 < h.count && ((bits[(j + 1) >> 3] >> ((j + 1) & 7)) & 1)) j++;
+            ranges.emplace_back(h.base + i, h.base + j);
+            i = j;
+        }
+        return true;
+    }
+    return false;
+}
+
+// RESUME. A receiver that kept part of the file from an interrupted transfer says how many records
+// it holds in FILE_HDR_ACK. The sender then walks the file with RESUME requests (a bare header
+// with `from` set); each reply lists the held ranges in [from, to] as [start, end] pairs, and the
+// next request starts at to + 1. The sender skips every held record.
+const uint32_t RESUME_MAGIC = 0x4d534552; // "RESM" on the wire
+
+struct ResumeHeader {
+    uint32_t magic;
+    uint16_t session;
+    uint16_t count;     // reply: ranges that follow; request: 0
+    uint32_t from;
+    uint32_t to;        // reply: last record the reply covers; request: unused
+};
+
+// Reply to a RESUME request for records [from, last]: as many held ranges as fit in one
+// NACK-sized datagram
+inline std::vector<char> encode_resume(uint16_t session, const RecordBitmap &held, uint32_t from, uint32_t last,
+                                       uint32_t magic = RESUME_MAGIC) {
+    const size_t MAX_RANGES = NACK_MAX_PAYLOAD / (2 * sizeof(uint32_t));
+    std::vector<uint32_t> ranges;
+    uint32_t to = last;
+    for (uint32_t r = held.next_set(from, last); r <= last;) {
+        if (ranges.size() / 2 == MAX_RANGES) { to = r - 1; break; }
+        uint32_t e = held.next_clear(r, last) - 1;
+        ranges.push_back(r);
+        ranges.push_back(e);
+        if (e >= last) break;
+        r = held.next_set(e + 1, last);
+    }
+    ResumeHeader h = {magic, session, (uint16_t)(ranges.size() / 2), from, to};
+    std::vector<char> d(sizeof(h) + ranges.size() * sizeof(uint32_t));
+    memcpy(d.data(), &h, sizeof(h));
+    if (!ranges.empty()) memcpy(d.data() + sizeof(h), ranges.data(), ranges.size() * sizeof(uint32_t));
+    return d;
+}
+
+// Decodes a RESUME reply, appending its held ranges. False if it is not a well-formed reply.
+inline bool decode_resume(const char *buf, size_t len, ResumeHeader &h, std::vector<std::pair<uint32_t, uint32_t>> &ranges,
+                          uint32_t magic = RESUME_MAGIC) {
+    if (len < sizeof(h)) return false;
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != magic || h.to < h.from || len < sizeof(h) + (size_t)h.count * 2 * sizeof(uint32_t)) return false;
+    for (uint32_t i = 0; i < h.count; ++i) {
+        uint32_t se[2];
+        memcpy(se, buf + sizeof(h) + i * sizeof(se), sizeof(se));
+        if (se[0] > se[1] || se[0] < h.from || se[1] > h.to) return false;
+        ranges.emplace_back(se[0], se[1]);
+    }
+    return true;
+}
+
+// SIGNATURE (HDR_DELTA). A receiver that already has a copy of the file signs it: one xxh64() per
+// block of records_per_packet records, over the bytes of the block that lie within the new
+// file_size, for the delta_blocks leading blocks its copy covers. The sender pulls the signature
+// with SIGNATURE requests (a bare ResumeHeader with `from` the first block, several outstanding at a
+// time); a reply carries the hashes of blocks [from, to]. A block that is still being hashed is not
+// answered yet. The sender then sends only the blocks whose hash differs from its own, and tells the
+// receiver which records it kept with DELTA_HELD datagrams, laid out as RESUME replies; the receiver
+// acknowledges each by echoing its header.
+const uint32_t SIGNATURE_MAGIC = 0x47495344;  // "DSIG" on the wire
+const uint32_t DELTA_HELD_MAGIC = 0x444c4844; // "DHLD" on the wire
+const uint32_t SIGNATURE_PER_REPLY = NACK_MAX_PAYLOAD / sizeof(uint64_t);
+
+// Blocks of a file of `records` records, and the bytes of block b within a file_size-byte file
+inline uint32_t delta_block_count(uint32_t records, uint32_t records_per_block) {
+    return (uint32_t)(((uint64_t)records + records_per_block - 1) / records_per_block);
+}
+inline std::pair<uint64_t, uint64_t> delta_block_bytes(uint32_t b, uint32_t records_per_block, uint32_t record_size, uint64_t file_size) {
+    uint64_t block = (uint64_t)records_per_block * record_size, start = b * block;
+    return {start, std::min(file_size, start + block)};
+}
@@ -2,230 +2,2077 @@
 #include <bits/stdc++.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/udp.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <thread>
 #include <mutex>
 #include <chrono>
 #include <random>
+#include <atomic>
+#include "protocol.h"
+#include "fec.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "xxh64.h"
+#include "log.h"
+#include "metrics.h"
+#include "impairment.h"
+#include "uring.h"
+#include "spsc_ring.h"
 
 using namespace std;
 
-struct Segment { uint32_t start, end; };
-struct BlastPacket { uint32_t num_segments; vector<Segment> segments; vector<char> data; };
-struct FileHeader { uint32_t file_size, record_size, M; };
+// FEC state of one parity class (group g, parity j) of a round: the XOR of the records that did
+// arrive in each slot, and which slots arrived per data datagram
+struct FecClass {
+    vector<char> acc;
+    vector<uint32_t> present;
+    unordered_map<uint32_t, uint64_t> seen;   // data chunk -> slots that arrived
+    bool have_parity = false;
+    vector<char> parity;
+    vector<pair<FecCoverEntry, vector<Segment>>> cover;
+};
 
-int sockfd;
+// Per-blast reassembly state: which fragments of the current round have arrived. Record payloads
+// are written to the output file as soon as their fragment lands, so nothing is buffered here.
+struct BlastReassembly {
+    uint16_t round = 0;
+    bool done = false;        // round answered; late datagrams of it are ignored
+    uint32_t total_chunks = 0;
+    uint32_t chunks_received = 0;
+    vector<bool> chunk_seen;
+    uint8_t fec_n = 0, fec_k = 0;
+    unordered_map<uint32_t, FecClass> fec;    // keyed by parity index
+    uint32_t known_sent = 0;  // data chunks below this were sent before something that has arrived
+    chrono::steady_clock::time_point started;  // first datagram of the round
+    // Early REC_MISS: when the round's datagrams came in, and once there is a sign that the sender
+    // is past the round (its last datagram, or the next blast on the same socket), when to give up
+    // on the rest. Closing a round early keeps its lost datagrams, so a probe can be answered again.
+    int64_t first_arrival = 0, last_arrival = 0;
+    uint32_t arrivals = 0;
+    int64_t nack_due = 0;
+    sockaddr_in peer{};
+    socklen_t peer_len = 0;
+    vector<uint32_t> lost_chunks;
+};
+
+// Missing records across retransmissions, one bit per record of the file, plus the record span
+// of each blast that still has records outstanding
+struct BlastLoss {
+    uint32_t lo, hi;
+    uint16_t nack_seq;
+};
+
+// One transfer from one sender. The receiver assigns the id in FILE_HDR_ACK and the sender stamps
+// it on every datagram, so any number of senders can share the receive sockets. Everything the
+// receive threads share about a transfer lives here; per-blast state stays with the thread that
+// owns the blast's stream, keyed by session and blast id.
+struct Session : enable_shared_from_this<Session> {
+    uint16_t id = 0;
+    sockaddr_in peer{};           // where FILE_HDR came from; datagrams must come from this host
+    FileHeader proposal{};        // FILE_HDR as sent, to recognise a repeat
+    FileHeader header{};          // FILE_HDR as accepted
+    uint32_t total_records = 0;
+    RecordBitmap missing;
+    RecordBitmap received;        // records known to be in the output file, for checkpoints and resume
+    // Integrity (HDR_CHECKSUMS): records that arrived intact, and the record_digest() sum over them
+    bool checksums = false;
+    RecordBitmap digested;
+    atomic<uint64_t> digest{0};
+    // Records a writer thread (--writers) failed to write; a receive thread moves them back into
+    // `missing` before it answers a round
+    RecordBitmap write_failed;
+    atomic<bool> write_failures{false};
+    int out_fd = -1;
+    int direct_fd = -1;           // the output opened O_DIRECT (--direct-io), for aligned runs
+    string path;
+    string checkpoint_path;       // empty when the session cannot be resumed
+    mutex checkpoint_mtx;         // one checkpoint write at a time; none once the session is closed
+    bool checkpoint_final = false;
+    chrono::steady_clock::time_point started;
+    atomic<int64_t> last_active{0};   // steady_clock nanoseconds of the latest datagram
+    atomic<bool> closed{false};       // finished or evicted; receive threads drop their state for it
+    const char *end = nullptr;        // how it was closed
+    chrono::steady_clock::time_point ended;
+
+    // Completion tracker: the transfer is over once every sender stream has sent its DISCONNECT.
+    // Each DISCONNECT carries its stream's share of the file digest.
+    mutex disconnect_mtx;
+    set<uint32_t> disconnected_streams;
+    uint32_t streams = 0, digests_reported = 0;
+    uint64_t sender_digest = 0;
+
+    // Delta (HDR_DELTA): the signature of the copy that was in place, header.delta_blocks hashes,
+    // filled in by `signers` a chunk of SIGNATURE_PER_REPLY at a time. A chunk's state is 0 while it
+    // is being hashed, 1 once its hashes are in, 2 if the copy could not be read there.
+    vector<uint64_t> signature;
+    unique_ptr<atomic<uint8_t>[]> chunk_state;
+    atomic<uint32_t> next_chunk{0}, chunks_signed{0};
+    atomic<bool> stop_signing{false};
+    vector<thread> signers;
+
+    ~Session();
+};
+
+// Live sessions by id, and by sender address so a repeated FILE_HDR gets the same session back.
+// Receive threads look sessions up here once and keep their own reference in session_cache.
+mutex sessions_mtx;
+unordered_map<uint16_t, shared_ptr<Session>> sessions;
+unordered_map<uint64_t, uint16_t> session_by_peer;
+set<string> open_paths;         // output files of every session not yet destroyed
+uint16_t next_session_id = 1;
+thread_local unordered_map<uint16_t, shared_ptr<Session>> session_cache;
+atomic<uint64_t> sessions_finished(0), sessions_evicted(0), sessions_refused(0), sessions_corrupt(0);
+
+// Single mode (the default) takes one transfer into recv_testfile.bin and exits when it is done.
+// --daemon serves concurrent senders until SIGINT/SIGTERM, one output file per session in
+// output_dir, and evicts sessions that have been silent for idle_timeout.
+bool daemon_mode = false;
+string output_dir = ".";
+uint32_t max_sessions = 0;      // 0: 1 in single mode, 1024 as a daemon
+chrono::seconds idle_timeout(30);
+
+// Resume: every checkpoint_interval the received-record bitmap of each session is saved next to its
+// output file (<file>.resume), after the data it covers has been flushed. A sender coming back with
+// the same file (FileHeader::file_id) continues from there. 0 turns checkpoints and resume off.
+chrono::seconds checkpoint_interval(5);
+
+// Delta: threads per session hashing the copy already in place (0: one per CPU, up to 4)
+uint32_t sign_threads = 0;
+const uint32_t CHECKPOINT_MAGIC = 0x504b4352; // "RCKP"
+
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t file_size;
+    uint64_t file_id;
+    uint32_t total_records;
+    uint32_t reserved;
+};
+
+// Each receive thread owns one socket; everything keyed by blast lives with the thread whose
+// socket the blast's stream hashes to, so only the session (file, header, loss bitmap) is shared
+thread_local int sockfd;
 double packet_loss_percent = 0.0;
-mt19937 rng(random_device{}());
-static ofstream receiver_log;
-FileHeader negotiated_header;
-bool done_receiving = false;
-
-// Track missing records per blast across retransmissions
-unordered_map<uint32_t, set<uint32_t>> missing_records_per_blast;
-
-bool safe_open_recvfile(fstream &f, const string &name) {
-    ofstream create(name, ios::binary | ios::trunc);
-    if (!create) return false;
-    create.close();
-    f.open(name, ios::in | ios::out | ios::binary);
-    return f.is_open();
-}
-
-void process_blast(BlastPacket &pkt, fstream &fout, uint64_t &total_records_written,
-                   uint64_t &total_records_lost_sim, double &packet_loss_percent,
-                   const sockaddr_in &sender_addr, socklen_t addrlen,
-                   uint32_t blast_id)
-{
+thread_local mt19937 rng(random_device{}());
+// Network impairment applied to incoming blast datagrams: configured once, then one seeded copy
+// per receive thread. With a seed the per-record loss coin is seeded too, so runs repeat.
+Impairment impairment_config;
+thread_local Impairment impairment;
+bool seeded = false;
+uint64_t seed = 0;
+static SharedLog receiver_log;
+static TraceLog receiver_trace;
+bool trace_enabled = true;
+atomic<bool> done_receiving(false);
+
+// Multi-stream receive: one thread and socket per sender stream, all on port 9000 through
+// SO_REUSEPORT, or on ports 9000 + i with separate_ports
+uint32_t num_threads = 1;
+bool separate_ports = false;
+bool pin_cpus = false;
+
+// Record span of each blast that still has records outstanding, keyed by blast_key()
+thread_local unordered_map<uint64_t, BlastLoss> missing_records_per_blast;
+
+// Send REC_MISS as the old JSON text instead of binary NACKs (debugging aid)
+bool json_nack = false;
+
+// Early REC_MISS. Datagrams of a round leave the sender in order and rounds do not interleave on a
+// socket, so the round's last datagram, or one of the next blast from the same sender socket, means
+// the rest of the round is not coming: the round is answered nack_delay later (slack for
+// reordering) with the datagrams that never arrived. A round that goes quiet altogether is
+// answered once nothing has come for 8 of its mean datagram gaps, and at least 4 nack_delays.
+// Reassembly state of rounds answered long ago is dropped after reassembly_ttl.
+int64_t nack_delay_ns = 2000000;
+const int64_t reassembly_ttl_ns = 10000000000;
+
+// Receive-side state shared by the datagram handler and the receive loop of one thread
+thread_local unordered_map<uint64_t, BlastReassembly> reassembly;
+// Rounds still being received, and the blast each sender socket sent last
+thread_local unordered_set<uint64_t> open_rounds;
+thread_local unordered_map<uint64_t, uint64_t> flow_blast;
+
+// Time of the current receive loop iteration, used to stamp session activity
+thread_local int64_t loop_now;
+
+int64_t steady_ns() { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(); }
+
+uint64_t blast_key(const Session &ss, uint32_t blast_id) { return (uint64_t)ss.id << 32 | blast_id; }
+
+// Counters of one receive thread. The thread is their only writer; the stats writer reads them while
+// it runs, and the summary rolls them up once it has exited. Round time is from a round's first
+// datagram to its REC_MISS; write latency is per pwrite.
+struct ThreadStats {
+    uint32_t thread_no = 0;
+    Counter blasts, bytes, written, lost, nack_datagrams, parity_received, fec_recovered, datagrams, recv_calls;
+    Counter corrupt_datagrams, corrupt_records, decompressed;
+    Counter early_nacks, lost_datagrams, probes, reassembly_expired;
+    Counter write_queue_stalls;
+    Gauge incomplete_blasts, write_queue_peak;
+    Histogram round_time, write_latency;
+    uint64_t impair_dropped = 0, impair_duplicated = 0, impair_delayed = 0, impair_reordered = 0, impair_corrupted = 0;
+    chrono::steady_clock::time_point start, end;
+};
+vector<unique_ptr<ThreadStats>> thread_stats;   // one per receive thread, created before they start
+thread_local ThreadStats *stats;
+
+// Live metrics in Prometheus text, rewritten every stats_interval while receiving (--stats)
+string stats_path;
+chrono::milliseconds stats_interval(1000);
+StatsFile stats_file;
+
+// Receive buffer requested per socket, and what the kernel actually granted
+int rcvbuf_request = 8 << 20;
+int rcvbuf_bytes = 0;
+
+// Batched receive: datagrams per recvmmsg call (1 = plain recvfrom) and UDP GRO coalescing
+uint32_t recv_batch = 1;
+bool use_gro = false;
+
+// io_uring receive path (--io-uring): each thread keeps uring_depth receive buffers posted as
+// RECVMSG requests, and records are written out as WRITE_FIXED requests straight from the buffer
+// their datagram landed in, with the socket registered as a fixed file. Receives and disk writes thus
+// overlap on one thread, one io_uring_enter per loop. A buffer is posted again once it has been
+// handled and every write from it has completed; until then it holds on to the session it wrote to.
+bool use_uring = false;
+uint32_t uring_depth = 64;
+const size_t URING_SLOT_SIZE = 65536;
+enum : uint32_t { URING_RECV = 1, URING_WRITE = 2 };
+
+struct UringSlot {
+    msghdr msg;
+    iovec iov;
+    sockaddr_in addr;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    uint32_t pending_writes = 0;
+    uint64_t write_seq = 0;         // uring_writes_queued at the first of them
+    shared_ptr<Session> session;    // keeps the output file open while writes are in flight
+    vector<pair<uint32_t, uint32_t>> records;   // (first, count) written from this buffer
+    bool write_failed = false;
+    bool idle = false;          // handled, waiting for its writes before being posted again
+    chrono::steady_clock::time_point received;
+};
+// Pipelined writes (--writers N): each receive thread hands the records it places to a writer
+// thread through its own SPSC ring instead of writing them itself, so a slow disk fills the ring
+// rather than the socket buffer. Writer w drains the rings of receive threads w, w + N, ..., in
+// order, and coalesces runs that continue one another in the same file into one pwritev. With
+// --direct-io, runs that are block-aligned in memory, offset and length go through an O_DIRECT
+// descriptor; with --fdatasync, each writer syncs the files it has written whenever it runs dry.
+uint32_t num_writers = 0;
+size_t write_queue_bytes = 16 << 20;
+bool direct_io = false, sync_writes = false;
+const size_t DIRECT_ALIGN = 4096;
+const size_t MAX_WRITE_BATCH = 4 << 20;
+
+// Metadata of one ring entry; the payload is the records' bytes
+struct WriteEntry {
+    shared_ptr<Session> session;    // keeps the output file open until the write is done
+    uint32_t first, count;
+    uint64_t off;
+};
+
+struct WriterStats {
+    uint32_t writer_no = 0;
+    Counter calls, entries, bytes, direct_bytes, syncs;
+    Histogram write_latency;
+};
+vector<unique_ptr<SpscRing>> write_rings;       // one per receive thread when writers are on
+vector<unique_ptr<WriterStats>> writer_stats;
+atomic<bool> writers_stop(false);
+thread_local SpscRing *write_ring;
+
+thread_local IoUring *ring;             // set while the thread runs the io_uring path
+thread_local vector<UringSlot> *uring_slots;
+thread_local char *uring_mem;
+thread_local bool uring_fixed_buffers;
+thread_local uint64_t uring_pending_writes;
+thread_local uint64_t uring_writes_queued;  // io_uring writes ever queued; numbers them
+
+// A round answered complete is not asked about again, so while writes are in flight (writer
+// threads, io_uring) that answer waits until everything queued before it is written: a write that
+// fails puts its records back first. Marks only grow, so the front is always the first to be ready.
+struct WriteMark {
+    uint64_t ring_pos, uring_seq;
+};
+struct DeferredAnswer {
+    shared_ptr<Session> session;
+    uint32_t blast_id;
+    uint16_t round;
+    WriteMark mark;
+    sockaddr_in peer;
+    socklen_t peer_len;
+};
+thread_local deque<DeferredAnswer> deferred_answers;
+
+WriteMark write_mark() {
+    return {write_ring ? write_ring->write_pos() : 0, uring_writes_queued};
+}
+
+// Whether every write this thread queued before `m` is done, failed ones accounted for
+bool writes_done(const WriteMark &m) {
+    if (write_ring && !write_ring->released(m.ring_pos)) return false;
+    if (ring && uring_pending_writes)
+        for (const UringSlot &s : *uring_slots)
+            if (s.pending_writes && s.write_seq <= m.uring_seq) return false;
+    return true;
+}
+
+int safe_open_recvfile(const string &name) {
+    return open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+uint64_t peer_key(const sockaddr_in &a) { return (uint64_t)a.sin_addr.s_addr << 16 | a.sin_port; }
+
+string peer_str(const sockaddr_in &a) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &a.sin_addr, ip, sizeof(ip));
+    return string(ip) + ":" + to_string(ntohs(a.sin_port));
+}
+
+// Queues a write from a posted receive buffer on the io_uring path. Data from anywhere else (parity
+// rebuilds, delayed copies) is written synchronously; every copy of a record is the same bytes, so
+// the order in which the two kinds land does not matter.
+bool queue_write(Session &ss, uint32_t first, uint32_t count, const char *data, size_t len, off_t off) {
+    size_t pos = (size_t)(data - uring_mem);
+    if (data < uring_mem || pos >= uring_slots->size() * URING_SLOT_SIZE) return false;
+    uint32_t slot = (uint32_t)(pos / URING_SLOT_SIZE);
+    if (pos + len > (size_t)(slot + 1) * URING_SLOT_SIZE) return false;
+    io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe) { ring->submit(); sqe = ring->get_sqe(); }
+    if (!sqe) return false;
+    sqe->opcode = uring_fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = ss.out_fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)off;
+    if (uring_fixed_buffers) sqe->buf_index = (uint16_t)slot;
+    sqe->user_data = (uint64_t)URING_WRITE << 32 | slot;
+    UringSlot &s = (*uring_slots)[slot];
+    if (!s.session) s.session = ss.shared_from_this();
+    s.records.emplace_back(first, count);
+    uring_writes_queued++;
+    if (!s.pending_writes++) s.write_seq = uring_writes_queued;
+    uring_pending_writes++;
+    return true;
+}
+
+// Copies a run of records into this thread's write ring, waiting for room if the writer is behind
+void enqueue_write(Session &ss, uint32_t first, uint32_t count, const char *data, size_t len, off_t off) {
+    char *meta, *payload;
+    if (!write_ring->claim(sizeof(WriteEntry), len, meta, payload)) {
+        stats->write_queue_stalls++;
+        while (!write_ring->claim(sizeof(WriteEntry), len, meta, payload)) this_thread::sleep_for(chrono::microseconds(50));
+    }
+    new (meta) WriteEntry{ss.shared_from_this(), first, count, (uint64_t)off};
+    memcpy(payload, data, len);
+    write_ring->publish();
+    double used = (double)write_ring->used();
+    if (used > stats->write_queue_peak.get()) stats->write_queue_peak.set(used);
+}
+
+// Writes a run of consecutive records straight from the datagram to their file offset,
+// clipping the final record to the real file size
+void write_records(Session &ss, uint32_t first, uint32_t count, const char *data) {
+    uint32_t rec_size = ss.header.record_size;
+    off_t off = (off_t)first * rec_size;
+    size_t len = (size_t)count * rec_size;
+    if ((uint64_t)off >= ss.header.file_size) return;
+    len = min<size_t>(len, ss.header.file_size - off);
+    if (ring && queue_write(ss, first, count, data, len, off)) return;
+    if (write_ring) {
+        enqueue_write(ss, first, count, data, len, off);
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    ssize_t written = pwrite(ss.out_fd, data, len, off);
+    stats->write_latency.observe(chrono::steady_clock::now() - start);
+    if (written == (ssize_t)len) {
+        ss.received.set_range(first, count);
+        return;
+    }
+    // The records were taken off `missing` when they arrived; putting them back makes the round's
+    // REC_MISS ask for them again
+    receiver_log(LogLevel::Error) << "[Receiver] Session " << ss.id << ": pwrite failed at record " << first << ": "
+                                  << (written < 0 ? strerror(errno) : "short write") << endl;
+    ss.missing.set_range(first, count);
+}
+
+bool direct_aligned(const Session &ss, const char *payload, size_t len, uint64_t off) {
+    return ss.direct_fd >= 0 && (uintptr_t)payload % DIRECT_ALIGN == 0 && len % DIRECT_ALIGN == 0 && off % DIRECT_ALIGN == 0;
+}
+
+// Writes out everything queued in one ring, a coalesced run per pwritev. Entries are released only
+// once written, so the receive thread cannot reuse their space before then. Returns whether there
+// was anything to write.
+bool drain_write_ring(SpscRing &r, WriterStats &ws, unordered_map<Session *, shared_ptr<Session>> &dirty) {
+    uint64_t pos = r.read_pos(), end = r.write_pos();
+    if (pos == end) return false;
+    vector<iovec> iov;
+    vector<WriteEntry *> batch;
+    while (pos < end) {
+        char *meta, *payload;
+        size_t len;
+        uint64_t next = r.entry(pos, meta, payload, len);
+        WriteEntry *e = (WriteEntry *)meta;
+        Session &ss = *e->session;
+        bool direct = direct_aligned(ss, payload, len, e->off);
+        uint64_t off = e->off, run_end = e->off + len;
+        iov.assign(1, {payload, len});
+        batch.assign(1, e);
+        pos = next;
+        while (pos < end && iov.size() < IOV_MAX && run_end - off < MAX_WRITE_BATCH) {
+            next = r.entry(pos, meta, payload, len);
+            WriteEntry *n = (WriteEntry *)meta;
+            if (n->session.get() != &ss || n->off != run_end || direct_aligned(ss, payload, len, n->off) != direct) break;
+            iov.push_back({payload, len});
+            batch.push_back(n);
+            run_end += len;
+            pos = next;
+        }
+
+        auto start = chrono::steady_clock::now();
+        ssize_t written = pwritev(direct ? ss.direct_fd : ss.out_fd, iov.data(), (int)iov.size(), (off_t)off);
+        ws.write_latency.observe(chrono::steady_clock::now() - start);
+        ws.calls++;
+        ws.entries += batch.size();
+        if (written == (ssize_t)(run_end - off)) {
+            ws.bytes += (uint64_t)written;
+            if (direct) ws.direct_bytes += (uint64_t)written;
+            for (WriteEntry *w : batch) ss.received.set_range(w->first, w->count);
+        } else {
+            receiver_log(LogLevel::Error) << "[Receiver] Session " << ss.id << ": pwritev failed at record " << batch.front()->first
+                                          << ": " << (written < 0 ? strerror(errno) : "short write") << endl;
+            for (WriteEntry *w : batch) ss.write_failed.set_range(w->first, w->count);
+            ss.write_failures.store(true, memory_order_release);
+        }
+        if (sync_writes && !dirty.count(&ss)) dirty[&ss] = batch.front()->session;
+        for (WriteEntry *w : batch) w->~WriteEntry();
+        r.release(pos);
+    }
+    return true;
+}
+
+// Writer thread: drains its share of the rings until the receive threads are gone and the rings empty
+void writer_thread(uint32_t writer_no) {
+    WriterStats &ws = *writer_stats[writer_no];
+    unordered_map<Session *, shared_ptr<Session>> dirty;
+    int64_t last_busy = 0;
+    for (;;) {
+        // Read the flag first: whatever was queued before it was raised is seen by the drain below
+        bool stopping = writers_stop.load(memory_order_acquire);
+        bool busy = false;
+        for (size_t i = writer_no; i < write_rings.size(); i += num_writers) busy |= drain_write_ring(*write_rings[i], ws, dirty);
+        if (busy) {
+            last_busy = steady_ns();
+            continue;
+        }
+        for (auto &d : dirty) {
+            if (fdatasync(d.first->out_fd) == 0) ws.syncs++;
+            else receiver_log(LogLevel::Warn) << "[Receiver] Session " << d.first->id << ": fdatasync failed: " << strerror(errno) << endl;
+        }
+        dirty.clear();
+        if (stopping) break;
+        // While a transfer is streaming in, a receive thread may be holding a blast's answer back
+        // until its writes are done, so the writer looks again sooner
+        this_thread::sleep_for(chrono::microseconds(steady_ns() - last_busy < 1000000 ? 20 : 200));
+    }
+}
+
+BlastLoss &blast_span(Session &ss, uint32_t blast_id) {
+    uint64_t key = blast_key(ss, blast_id);
+    auto span_it = missing_records_per_blast.find(key);
+    if (span_it == missing_records_per_blast.end())
+        span_it = missing_records_per_blast.emplace(key, BlastLoss{UINT32_MAX, 0, 0}).first;
+    return span_it->second;
+}
+
+// Places every record of one fragment at r * record_size, applying the simulated loss. With
+// checksums, `crcs` is the fragment's table of record CRC32Cs; a record that does not match it is
+// dropped like a lost one. Returns the mask of record slots that survived.
+uint64_t place_fragment(Session &ss, const Segment *segs, uint32_t num_segments, const char *data, size_t data_len,
+                        const char *crcs, uint32_t blast_id) {
     uniform_real_distribution<double> dist(0.0, 100.0);
-    uint32_t rec_size = negotiated_header.record_size;
+    uint32_t rec_size = ss.header.record_size;
     size_t offset = 0;
+    uint32_t slot = 0;
+    uint64_t survived = 0;
+    uint64_t digest = 0;
+
+    // Track missing cumulatively over the blast's record span
+    BlastLoss &span = blast_span(ss, blast_id);
 
-    auto &missing_set = missing_records_per_blast[blast_id]; // track missing cumulatively
+    // Consecutive surviving records are flushed together with one pwrite
+    uint32_t run_start = 0, run_len = 0;
+    const char *run_data = nullptr;
+    auto flush_run = [&]() {
+        if (run_len) write_records(ss, run_start, run_len, run_data);
+        run_len = 0;
+    };
 
-    for (auto &seg : pkt.segments) {
-        for (uint32_t r = seg.start; r <= seg.end; ++r) {
+    for (uint32_t i = 0; i < num_segments; ++i) {
+        for (uint32_t r = segs[i].start; r <= segs[i].end; ++r) {
+            if (offset + rec_size > data_len || r >= ss.total_records) {
+                flush_run();
+                ss.digest.fetch_add(digest, memory_order_relaxed);
+                return survived;
+            }
+            span.lo = min(span.lo, r);
+            span.hi = max(span.hi, r);
+            uint32_t crc = 0;
+            if (crcs) {
+                uint32_t expected;
+                memcpy(&expected, crcs + (size_t)slot * sizeof(uint32_t), sizeof(expected));
+                crc = crc32c(0, data + offset, rec_size);
+                if (crc != expected) {
+                    // Damaged on the way: missing, unless an intact copy got here first
+                    flush_run();
+                    if (!ss.digested.test(r)) ss.missing.set(r);
+                    stats->corrupt_records++;
+                    offset += rec_size;
+                    slot++;
+                    continue;
+                }
+            }
             double p = dist(rng);
-            bool first_receive = missing_set.find(r) == missing_set.end();
+            bool first_receive = !ss.missing.test(r);
 
             if (first_receive && p < packet_loss_percent) {
                 // record is lost in simulation
-                missing_set.insert(r);
-                total_records_lost_sim++;
+                flush_run();
+                ss.missing.set(r);
+                stats->lost++;
             } else {
-                fout.seekp((streampos)r * rec_size);
-                fout.write(pkt.data.data() + offset, rec_size);
-                total_records_written++;
-                missing_set.erase(r); // mark as received
-                if (!first_receive) {
-                    receiver_log << "[Receiver] Retransmitted record " << r << " written\n";
-                }
+                if (run_len && r == run_start + run_len) run_len++;
+                else { flush_run(); run_start = r; run_len = 1; run_data = data + offset; }
+                stats->written++;
+                ss.missing.clear(r); // mark as received
+                if (crcs && !ss.digested.test_and_set(r)) digest += record_digest(r, crc);
+                if (slot < 64) survived |= 1ull << slot;
+                if (!first_receive) receiver_trace.record(TR_RECORD_REWRITTEN, r);
             }
             offset += rec_size;
+            slot++;
         }
     }
+    flush_run();
+    ss.digest.fetch_add(digest, memory_order_relaxed);
+    return survived;
+}
 
-    // Generate REC_MISS JSON from missing_set
-    string rec_miss = "[]";
-    if (!missing_set.empty()) {
-        vector<uint32_t> sorted_missing(missing_set.begin(), missing_set.end());
-        sort(sorted_missing.begin(), sorted_missing.end());
-        vector<pair<uint32_t,uint32_t>> ranges;
-        uint32_t start = sorted_missing[0], end = start;
-        for (size_t i = 1; i < sorted_missing.size(); ++i) {
-            if (sorted_missing[i] == end + 1) end = sorted_missing[i];
-            else { ranges.emplace_back(start,end); start = end = sorted_missing[i]; }
+// A data datagram whose records cannot be recovered from it: they are missing, unless a good copy
+// is already in
+void drop_fragment(Session &ss, const Segment *segs, uint32_t num_segments, uint32_t blast_id) {
+    BlastLoss &span = blast_span(ss, blast_id);
+    for (uint32_t i = 0; i < num_segments; ++i) {
+        for (uint32_t r = segs[i].start; r <= segs[i].end && r < ss.total_records; ++r) {
+            span.lo = min(span.lo, r);
+            span.hi = max(span.hi, r);
+            if (ss.checksums ? !ss.digested.test(r) : !ss.received.test(r)) ss.missing.set(r);
+            stats->corrupt_records++;
         }
-        ranges.emplace_back(start,end);
+    }
+}
 
-        stringstream ss;
-        ss << "[";
-        for (size_t i = 0; i < ranges.size(); ++i) {
-            if (i) ss << ",";
-            ss << "[" << ranges[i].first << "," << ranges[i].second << "]";
+// Folds the surviving records of a data datagram into its parity class
+void fec_account_data(const Session &ss, BlastReassembly &entry, uint32_t chunk_no, uint32_t num_segments, const char *data, uint64_t survived) {
+    uint32_t rec_size = ss.header.record_size, records_per_packet = ss.header.records_per_packet;
+    uint32_t group = chunk_no / entry.fec_n, j = (chunk_no % entry.fec_n) % entry.fec_k;
+    FecClass &c = entry.fec[fec_parity_index(group, j, entry.fec_k)];
+    if (c.acc.empty()) {
+        c.acc.assign((size_t)records_per_packet * rec_size, 0);
+        c.present.assign(records_per_packet, 0);
+    }
+    // A datagram overtaken in the network may already have had slots rebuilt; those are in acc already
+    uint64_t &seen = c.seen[chunk_no];
+    survived &= ~seen;
+    uint32_t slots = min(num_segments, records_per_packet);
+    for (uint32_t slot = 0; slot < slots; ++slot) {
+        if (!((survived >> slot) & 1)) continue;
+        xor_into(c.acc.data() + (size_t)slot * rec_size, data + (size_t)slot * rec_size, rec_size);
+        c.present[slot]++;
+    }
+    seen |= survived;
+}
+
+// Rebuilds every slot of a parity class that is missing exactly one record. Datagrams that have not
+// arrived are only rebuilt once something sent after them has arrived, so data merely still in
+// flight is not reconstructed needlessly. A datagram whose slots all come back counts as received.
+void fec_recover(Session &ss, BlastReassembly &entry, FecClass &c, uint32_t blast_id) {
+    if (!c.have_parity) return;
+    uint32_t rec_size = ss.header.record_size, records_per_packet = ss.header.records_per_packet;
+    vector<char> rec(rec_size);
+    BlastLoss &span = blast_span(ss, blast_id);
+
+    for (uint32_t slot = 0; slot < records_per_packet; ++slot) {
+        uint32_t expected = 0;
+        for (auto &cv : c.cover) if (cv.first.num_segments > slot) expected++;
+        if (expected == 0 || expected - c.present[slot] != 1) continue;
+
+        for (auto &cv : c.cover) {
+            uint32_t chunk = cv.first.chunk_no;
+            if (chunk >= entry.total_chunks) continue;
+            auto seen_it = c.seen.find(chunk);
+            bool arrived = entry.chunk_seen[chunk];
+            if (cv.first.num_segments <= slot || (seen_it != c.seen.end() && ((seen_it->second >> slot) & 1))) continue;
+            if (!arrived && chunk >= entry.known_sent) break;
+
+            // parity ^ (XOR of everything else present) is the missing record
+            memcpy(rec.data(), c.parity.data() + (size_t)slot * rec_size, rec_size);
+            xor_into(rec.data(), c.acc.data() + (size_t)slot * rec_size, rec_size);
+            uint32_t r = cv.second[slot].start;
+            if (r < ss.total_records) {
+                write_records(ss, r, 1, rec.data());
+                ss.missing.clear(r);
+                // Rebuilt from datagrams that all passed their checks, so this is the record as sent
+                if (ss.checksums && !ss.digested.test_and_set(r))
+                    ss.digest.fetch_add(record_digest(r, crc32c(0, rec.data(), rec_size)), memory_order_relaxed);
+                span.lo = min(span.lo, r);
+                span.hi = max(span.hi, r);
+                stats->written++;
+                stats->fec_recovered++;
+            }
+            xor_into(c.acc.data() + (size_t)slot * rec_size, rec.data(), rec_size);
+            c.present[slot]++;
+            uint64_t &mask = c.seen[chunk];
+            mask |= 1ull << slot;
+
+            uint64_t full = cv.first.num_segments >= 64 ? ~0ull : (1ull << cv.first.num_segments) - 1;
+            if (!arrived && mask == full) {
+                entry.chunk_seen[chunk] = true;
+                entry.chunks_received++;
+                receiver_trace.record(TR_PACKET_REBUILT, chunk, blast_id);
+            }
+            break;
         }
-        ss << "]";
-        rec_miss = ss.str();
     }
+}
 
-    receiver_log << "[Receiver] is_blast_over: Blast " << blast_id << endl;
-    sendto(sockfd, rec_miss.c_str(), rec_miss.size(), 0, (sockaddr*)&sender_addr, addrlen);
-    receiver_log << "[Receiver] Sent REC_MISS: " << rec_miss << endl;
+uint32_t fec_class_of(const BlastReassembly &entry, uint32_t chunk_no) {
+    return fec_parity_index(chunk_no / entry.fec_n, (chunk_no % entry.fec_n) % entry.fec_k, entry.fec_k);
 }
 
-void network_receiver_thread() {
-    fstream fout;
-    if (!safe_open_recvfile(fout, "recv_testfile.bin")) {
-        cerr << "Cannot create/open recv_testfile.bin\n";
-        receiver_log << "[Receiver] Cannot create/open recv_testfile.bin\n";
+// Datagrams are sent in order, so an arrival proves everything sent before it has left. Chunks that
+// become known-lost this way may now be rebuildable from their class.
+void fec_advance_known_sent(Session &ss, BlastReassembly &entry, uint32_t known_sent, uint32_t blast_id) {
+    known_sent = min(known_sent, entry.total_chunks);
+    uint32_t from = entry.known_sent;
+    if (known_sent <= from) return;
+    entry.known_sent = known_sent;
+    for (uint32_t chunk = from; chunk < known_sent; ++chunk) {
+        if (entry.chunk_seen[chunk]) continue;
+        auto it = entry.fec.find(fec_class_of(entry, chunk));
+        if (it != entry.fec.end()) fec_recover(ss, entry, it->second, blast_id);
+    }
+}
+
+// Puts the records writer threads failed to write back into `missing`, so REC_MISS asks for them
+// again
+void reclaim_failed_writes(Session &ss) {
+    if (!ss.write_failures.exchange(false, memory_order_acquire)) return;
+    for (size_t i = 0; i < ss.write_failed.words.size(); ++i)
+        if (uint64_t w = __atomic_exchange_n(&ss.write_failed.words[i], 0, __ATOMIC_RELAXED))
+            __atomic_fetch_or(&ss.missing.words[i], w, __ATOMIC_RELAXED);
+}
+
+// Answers a round that is over: its records are already on disk, so all that is left is reporting
+// what is still missing, along with the round's datagrams that never arrived. Also answers a probe
+// for a round answered before.
+void finish_blast(Session &ss, uint32_t blast_id, uint16_t round, const vector<uint32_t> &lost_chunks,
+                  const sockaddr_in &sender_addr, socklen_t addrlen, bool written = false) {
+    reclaim_failed_writes(ss);
+    auto span_it = missing_records_per_blast.find(blast_key(ss, blast_id));
+    // No span: nothing of the blast is outstanding, or nothing of it ever arrived
+    BlastLoss none = {1, 0, 0};
+    BlastLoss &span = span_it != missing_records_per_blast.end() ? span_it->second : none;
+    RecordBitmap &missing_records = ss.missing;
+    bool records_done = span.lo > span.hi || !missing_records.any(span.lo, span.hi);
+    bool complete = records_done && lost_chunks.empty();
+    if (complete && !written && !writes_done(write_mark())) {
+        for (auto &d : deferred_answers)
+            if (d.session.get() == &ss && d.blast_id == blast_id && d.round == round) return;  // a probe for it
+        deferred_answers.push_back({ss.shared_from_this(), blast_id, round, write_mark(), sender_addr, addrlen});
         return;
     }
 
-    unordered_map<uint32_t, tuple<uint32_t, vector<vector<Segment>>, vector<vector<char>>>> reassembly;
+    receiver_trace.record(TR_BLAST_OVER, blast_id);
+    if (json_nack) {
+        // Generate REC_MISS JSON, tagged with the blast id and round so the sender
+        // can match it while several blasts are in flight
+        stringstream ss;
+        ss << "{\"blast_id\":" << blast_id << ",\"round\":" << round << ",\"missing\":[";
+        bool first = true;
+        for (uint32_t r = records_done ? span.hi + 1 : missing_records.next_set(span.lo, span.hi); r <= span.hi;) {
+            uint32_t e = r;
+            while (e < span.hi && missing_records.test(e + 1)) e++;
+            ss << (first ? "" : ",") << "[" << r << "," << e << "]";
+            first = false;
+            if (e == span.hi) break;
+            r = missing_records.next_set(e + 1, span.hi);
+        }
+        ss << "],\"lost_chunks\":[";
+        for (size_t i = 0; i < lost_chunks.size(); ++i) ss << (i ? "," : "") << lost_chunks[i];
+        ss << "]}";
+        string rec_miss = ss.str();
+        sendto(sockfd, rec_miss.c_str(), rec_miss.size(), 0, (sockaddr*)&sender_addr, addrlen);
+        stats->nack_datagrams++;
+        receiver_log(LogLevel::Debug) << "[Receiver] Sent REC_MISS: " << rec_miss << endl;
+    } else {
+        vector<vector<char>> parts = records_done ? encode_nack(blast_id, span.nack_seq, round, missing_records, 1, 0, lost_chunks)
+                                                  : encode_nack(blast_id, span.nack_seq, round, missing_records, span.lo, span.hi, lost_chunks);
+        for (auto &d : parts) sendto(sockfd, d.data(), d.size(), 0, (sockaddr*)&sender_addr, addrlen);
+        stats->nack_datagrams += parts.size();
+        receiver_trace.record(TR_NACK_SENT, blast_id, (uint32_t)parts.size(), complete);
+    }
+    span.nack_seq++;
+
+    if (complete && span_it != missing_records_per_blast.end()) missing_records_per_blast.erase(span_it); // blast fully delivered
+    stats->incomplete_blasts.set(missing_records_per_blast.size());
+}
+
+// Ends the current round of a blast and answers it, listing `lost_chunks` as never arrived. Only
+// the round number and what is needed to answer it again are kept, so stragglers are recognised.
+void close_round(Session &ss, BlastReassembly &entry, uint32_t blast_id, vector<uint32_t> lost_chunks) {
+    stats->round_time.observe(chrono::steady_clock::now() - entry.started);
+    BlastReassembly closed;
+    closed.round = entry.round;
+    closed.done = true;
+    closed.total_chunks = entry.total_chunks;
+    closed.last_arrival = entry.last_arrival;
+    closed.peer = entry.peer;
+    closed.peer_len = entry.peer_len;
+    closed.lost_chunks = std::move(lost_chunks);
+    entry = std::move(closed);
+    open_rounds.erase(blast_key(ss, blast_id));
+    finish_blast(ss, blast_id, entry.round, entry.lost_chunks, entry.peer, entry.peer_len);
+    stats->blasts++;
+    stats->end = chrono::steady_clock::now();
+}
 
-    uint64_t total_blasts_received = 0, total_records_written = 0, total_records_lost_sim = 0, total_bytes_received = 0;
-    chrono::steady_clock::time_point recv_start_time, recv_end_time;
+// Closes a round before all of it arrived: whatever FEC can still rebuild is rebuilt (everything
+// has been sent by now), and the datagrams still missing go into the REC_MISS
+void close_round_early(Session &ss, BlastReassembly &entry, uint32_t blast_id) {
+    if (entry.fec_n && entry.fec_k) fec_advance_known_sent(ss, entry, entry.total_chunks, blast_id);
+    vector<uint32_t> lost;
+    for (uint32_t c = 0; c < entry.total_chunks; ++c)
+        if (!entry.chunk_seen[c]) lost.push_back(c);
+    if (!lost.empty()) {
+        stats->early_nacks++;
+        stats->lost_datagrams += lost.size();
+        receiver_trace.record(TR_NACK_EARLY, blast_id, entry.round, (uint32_t)lost.size(), entry.total_chunks);
+    }
+    close_round(ss, entry, blast_id, std::move(lost));
+}
+
+// A datagram of `key` from this sender socket: if the socket was on another blast before, that
+// blast's round is over as far as the sender is concerned
+void note_flow(const sockaddr_in &from, uint64_t key, int64_t now) {
+    uint64_t flow = (uint64_t)from.sin_addr.s_addr << 16 | from.sin_port;
+    uint64_t &last = flow_blast[flow];
+    if (last == key) return;
+    auto prev = open_rounds.count(last) ? reassembly.find(last) : reassembly.end();
+    if (prev != reassembly.end() && !prev->second.nack_due) prev->second.nack_due = now + nack_delay_ns;
+    last = key;
+}
+
+// Parity datagram: coverage tables, then one XOR slot per record position
+void handle_parity(Session &ss, BlastReassembly &entry, const PacketHeader &ph, const char *buf, size_t n, uint32_t blast_id) {
     uniform_real_distribution<double> dist(0.0, 100.0);
+    if (dist(rng) < packet_loss_percent) return; // parity is subject to the same simulated loss
 
-    while (!done_receiving) {
-        char buf[65536];
-        sockaddr_in sender_addr{};
-        socklen_t addrlen = sizeof(sender_addr);
-        int n = recvfrom(sockfd, buf, sizeof(buf), 0, (sockaddr*)&sender_addr, &addrlen);
-        if (n <= 0) continue;
-
-        if (total_blasts_received == 0) recv_start_time = chrono::steady_clock::now();
-
-        // Handle file header
-        if ((size_t)n == sizeof(FileHeader)) {
-            memcpy(&negotiated_header, buf, sizeof(FileHeader));
-            receiver_log << "[Receiver] Received FILE_HDR, sending FILE_HDR_ACK" << endl;
-            string ack = "FILE_HDR_ACK";
-            sendto(sockfd, ack.c_str(), ack.size(), 0, (sockaddr*)&sender_addr, addrlen);
-            continue;
+    uint32_t rec_size = ss.header.record_size, records_per_packet = ss.header.records_per_packet;
+    FecClass &c = entry.fec[ph.chunk_no];
+    if (c.have_parity) return;
+    if (c.acc.empty()) {
+        c.acc.assign((size_t)records_per_packet * rec_size, 0);
+        c.present.assign(records_per_packet, 0);
+    }
+
+    size_t off = sizeof(PacketHeader);
+    uint32_t max_slots = 0;
+    for (uint32_t i = 0; i < ph.num_segments; ++i) {
+        FecCoverEntry ce;
+        if (off + sizeof(ce) > n) return;
+        memcpy(&ce, buf + off, sizeof(ce));
+        off += sizeof(ce);
+        if (ce.num_segments > records_per_packet || off + ce.num_segments * sizeof(Segment) > n) return;
+        vector<Segment> segs(ce.num_segments);
+        memcpy(segs.data(), buf + off, ce.num_segments * sizeof(Segment));
+        off += ce.num_segments * sizeof(Segment);
+        max_slots = max(max_slots, ce.num_segments);
+        c.cover.emplace_back(ce, std::move(segs));
+    }
+    if (off + (size_t)max_slots * rec_size > n) { c.cover.clear(); return; }
+    c.parity.assign(records_per_packet * rec_size, 0);
+    memcpy(c.parity.data(), buf + off, (size_t)max_slots * rec_size);
+    c.have_parity = true;
+    stats->parity_received++;
+    fec_recover(ss, entry, c, blast_id);
+    // Parity of group g is sent right after all data of group g - 1
+    fec_advance_known_sent(ss, entry, ph.chunk_no / entry.fec_k * entry.fec_n, blast_id);
+}
+
+void handle_fragment(Session &ss, const PacketHeader &ph, const char *buf, size_t n, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    uint32_t blast_id = ph.blast_id, chunk_no = ph.chunk_no, total_chunks = ph.total_chunks, num_segments = ph.num_segments;
+    stats->bytes += n;
+
+    uint64_t key = blast_key(ss, blast_id);
+    auto &entry = reassembly[key];
+    if (entry.total_chunks == 0 || (int16_t)(ph.round - entry.round) > 0) {
+        // First datagram of a new round
+        entry = BlastReassembly();
+        entry.round = ph.round;
+        entry.total_chunks = total_chunks;
+        entry.chunk_seen.assign(total_chunks, false);
+        entry.fec_n = ph.fec_n;
+        entry.fec_k = ph.fec_k;
+        entry.started = chrono::steady_clock::now();
+        open_rounds.insert(key);
+    }
+    if (ph.round != entry.round || entry.done) return; // late datagram of a round already answered
+    int64_t now = steady_ns();
+    if (!entry.arrivals++) entry.first_arrival = now;
+    entry.last_arrival = now;
+    entry.peer = sender_addr;
+    entry.peer_len = addrlen;
+    note_flow(sender_addr, key, now);
+
+    if (ph.flags & PKT_PARITY) {
+        if (entry.fec_n && entry.fec_k) handle_parity(ss, entry, ph, buf, n, blast_id);
+    } else {
+        size_t segs_offset = sizeof(PacketHeader);
+        if (n < segs_offset + num_segments * sizeof(Segment)) {
+            receiver_log(LogLevel::Warn) << "[Receiver] malformed fragment packet: too small for segments\n";
+            return;
+        }
+        if (chunk_no >= entry.total_chunks || entry.chunk_seen[chunk_no]) return; // stray or duplicate
+        vector<Segment> segs(num_segments);
+        memcpy(segs.data(), buf + segs_offset, num_segments * sizeof(Segment));
+        size_t data_offset = segs_offset + num_segments * sizeof(Segment);
+        uint64_t records = segment_records(buf + segs_offset, num_segments);
+        // The CRC table has one entry per record, ahead of the records themselves
+        const char *crcs = nullptr;
+        if (ss.checksums) {
+            crcs = buf + data_offset;
+            data_offset += records * sizeof(uint32_t);
+        }
+        if (data_offset > n) {
+            receiver_log(LogLevel::Warn) << "[Receiver] malformed fragment packet: too small for its CRC table\n";
+            return;
         }
 
-        // Handle small ASCII messages
-        if (n <= 4096) {
-            bool is_ascii = all_of(buf, buf + n, [](unsigned char c){ return (c >= 9 && (c <= 13 || c >= 32)); });
-            if (is_ascii) {
-                string s(buf, n);
-                if (s == "DISCONNECT") {
-                    receiver_log << "[Receiver] Sender disconnected" << endl;
-                    done_receiving = true;
-                    break;
-                }
-                receiver_log << "[Receiver] Received small ASCII message: " << s << endl;
-                continue;
+        entry.chunk_seen[chunk_no] = true;
+        entry.chunks_received++;
+        receiver_trace.record(TR_PACKET_RECEIVED, chunk_no, total_chunks, blast_id, segs.front().start, segs.back().end);
+        const char *data = buf + data_offset;
+        size_t data_len = n - data_offset;
+        if (ph.flags & PKT_COMPRESSED) {
+            // One LZ block holding all the datagram's records. The segment table is not trusted yet
+            // (without checksums nothing has checked it), so it is bounded before anything is sized.
+            thread_local vector<char> inflated;
+            size_t raw = (size_t)records * ss.header.record_size;
+            bool fits = records <= ss.header.records_per_packet;
+            if (fits) inflated.resize(raw);
+            if (!fits || !lz_decompress(data, data_len, inflated.data(), raw)) {
+                drop_fragment(ss, segs.data(), num_segments, blast_id);
+                data_len = 0;
+            } else {
+                stats->decompressed++;
+                data = inflated.data();
+                data_len = raw;
             }
         }
+        uint64_t survived = data_len ? place_fragment(ss, segs.data(), num_segments, data, data_len, crcs, blast_id) : 0;
 
-        // Handle fragmented packet
-        if ((size_t)n >= 16) {
-            uint32_t hdr[4]; memcpy(hdr, buf, sizeof(hdr));
-            uint32_t blast_id = hdr[0], chunk_no = hdr[1], total_chunks = hdr[2], num_segments = hdr[3];
-
-            if (blast_id && total_chunks && num_segments) {
-                size_t segs_offset = 16;
-                if ((size_t)n < segs_offset + num_segments * sizeof(Segment)) {
-                    receiver_log << "[Receiver] malformed fragment packet: too small for segments\n";
-                } else {
-                    vector<Segment> segs(num_segments);
-                    memcpy(segs.data(), buf + segs_offset, num_segments * sizeof(Segment));
-                    size_t data_offset = segs_offset + num_segments * sizeof(Segment);
-                    size_t data_len = (size_t)n - data_offset;
-                    vector<char> data_chunk(data_len);
-                    memcpy(data_chunk.data(), buf + data_offset, data_len);
-
-                    auto &entry = reassembly[blast_id];
-                    if (get<0>(entry) == 0) {
-                        get<0>(entry) = total_chunks;
-                        get<1>(entry).resize(total_chunks);
-                        get<2>(entry).resize(total_chunks);
-                    }
-                    if (chunk_no < get<0>(entry)) {
-                        get<1>(entry)[chunk_no] = move(segs);
-                        get<2>(entry)[chunk_no] = move(data_chunk);
-                        if (!get<1>(entry)[chunk_no].empty()) {
-                            uint32_t srec = get<1>(entry)[chunk_no].front().start;
-                            uint32_t erec = get<1>(entry)[chunk_no].back().end;
-                            receiver_log << "[Receiver] Received Packet " << chunk_no << " of " << total_chunks
-                                         << " for Blast " << blast_id << " with records (" << srec << "-" << erec << ")" << endl;
-                        }
-                    }
-
-                    bool complete = all_of(get<1>(entry).begin(), get<1>(entry).end(), [](auto &v){ return !v.empty(); });
-                    if (!complete) { total_bytes_received += n; continue; }
-
-                    // Reassemble full blast
-                    BlastPacket pkt; pkt.num_segments = 0;
-                    for (auto &v : get<1>(entry)) pkt.num_segments += v.size();
-                    for (auto &v : get<1>(entry)) pkt.segments.insert(pkt.segments.end(), v.begin(), v.end());
-                    size_t total_data_len = 0;
-                    for (auto &v : get<2>(entry)) total_data_len += v.size();
-                    pkt.data.reserve(total_data_len);
-                    for (auto &v : get<2>(entry)) pkt.data.insert(pkt.data.end(), v.begin(), v.end());
-                    reassembly.erase(blast_id);
-
-                    process_blast(pkt, fout, total_records_written, total_records_lost_sim, packet_loss_percent, sender_addr, addrlen, blast_id);
-
-                    total_blasts_received++;
-                    total_bytes_received += n;
-                    continue;
+        if (entry.fec_n && entry.fec_k && num_segments <= ss.header.records_per_packet && data_len >= (size_t)num_segments * ss.header.record_size) {
+            fec_account_data(ss, entry, chunk_no, num_segments, data, survived);
+            fec_recover(ss, entry, entry.fec[fec_class_of(entry, chunk_no)], blast_id);
+            fec_advance_known_sent(ss, entry, chunk_no, blast_id);
+        }
+    }
+
+    if (entry.chunks_received < entry.total_chunks) {
+        // The round's last datagram is in, so whatever is still missing was lost or overtaken
+        if (!(ph.flags & PKT_PARITY) && chunk_no + 1 == entry.total_chunks && !entry.nack_due) entry.nack_due = now + nack_delay_ns;
+        return;
+    }
+    close_round(ss, entry, blast_id, {});
+}
+
+// RTO probe: the round it names has been sent in full. Closes it now if it is still open, or
+// answers it again if it was answered before; a round none of which arrived has lost everything.
+void handle_probe(Session &ss, const PacketHeader &ph, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    stats->probes++;
+    receiver_trace.record(TR_PROBE_RECEIVED, ph.blast_id, ph.round);
+    uint64_t key = blast_key(ss, ph.blast_id);
+    auto &entry = reassembly[key];
+    if (entry.total_chunks == 0 || (int16_t)(ph.round - entry.round) > 0) {
+        entry = BlastReassembly();
+        entry.round = ph.round;
+        entry.total_chunks = ph.total_chunks;
+        entry.chunk_seen.assign(ph.total_chunks, false);
+        entry.started = chrono::steady_clock::now();
+        entry.last_arrival = steady_ns();
+        open_rounds.insert(key);
+    }
+    if (ph.round != entry.round) return;    // a round since superseded
+    entry.peer = sender_addr;
+    entry.peer_len = addrlen;
+    if (!entry.done) close_round_early(ss, entry, ph.blast_id);
+    else finish_blast(ss, ph.blast_id, entry.round, entry.lost_chunks, sender_addr, addrlen);
+}
+
+// Answers the open rounds whose time is up. With `quiet` (the socket had nothing) a round that has
+// gone silent counts as over too; otherwise datagrams may just be waiting in the socket.
+void nack_timers(bool quiet) {
+    thread_local int64_t next_check = 0;
+    if (open_rounds.empty() || loop_now < next_check) return;
+    next_check = loop_now + min<int64_t>(nack_delay_ns, 1000000);
+    vector<uint64_t> keys(open_rounds.begin(), open_rounds.end());
+    for (uint64_t key : keys) {
+        auto it = reassembly.find(key);
+        if (it == reassembly.end()) { open_rounds.erase(key); continue; }
+        BlastReassembly &entry = it->second;
+        int64_t due = entry.nack_due ? entry.nack_due : INT64_MAX;
+        if (quiet && entry.arrivals) {
+            int64_t gap = entry.arrivals > 1 ? (entry.last_arrival - entry.first_arrival) / (entry.arrivals - 1) : 0;
+            due = min(due, entry.last_arrival + max(4 * nack_delay_ns, 8 * gap));
+        }
+        if (loop_now < due) continue;
+        auto ss = session_cache.find((uint16_t)(key >> 32));
+        if (ss == session_cache.end() || ss->second->closed.load(memory_order_acquire)) { open_rounds.erase(key); continue; }
+        close_round_early(*ss->second, entry, (uint32_t)key);
+    }
+}
+
+// Sends the complete answers whose records the writers have now dealt with; finish_blast looks
+// again, so a round whose writes failed is answered with those records missing instead. While
+// answers wait the receives do not block, so on a quiet socket this is where the thread waits.
+void answer_deferred(bool quiet) {
+    while (!deferred_answers.empty() && writes_done(deferred_answers.front().mark)) {
+        DeferredAnswer d = std::move(deferred_answers.front());
+        deferred_answers.pop_front();
+        if (!d.session->closed.load(memory_order_acquire))
+            finish_blast(*d.session, d.blast_id, d.round, {}, d.peer, d.peer_len, true);
+    }
+    if (quiet && !deferred_answers.empty()) this_thread::sleep_for(chrono::microseconds(20));
+}
+
+// Drops reassembly state nothing has happened to for reassembly_ttl: rounds answered long ago, and
+// blasts whose sender gave up on them. Their records stay marked missing in the session.
+void expire_reassembly() {
+    thread_local int64_t next_expiry = 0;
+    if (loop_now < next_expiry) return;
+    next_expiry = loop_now + 1000000000;
+    int64_t cutoff = loop_now - reassembly_ttl_ns;
+    for (auto it = reassembly.begin(); it != reassembly.end();) {
+        if (it->second.last_arrival >= cutoff) { ++it; continue; }
+        open_rounds.erase(it->first);
+        missing_records_per_blast.erase(it->first);
+        stats->reassembly_expired++;
+        it = reassembly.erase(it);
+    }
+    for (auto it = flow_blast.begin(); it != flow_blast.end();)
+        it = reassembly.count(it->second) ? next(it) : flow_blast.erase(it);
+    stats->incomplete_blasts.set(missing_records_per_blast.size());
+}
+
+// Clamps the sender's proposed layout to what this receiver can take: records per datagram to the
+// slot mask width, and the blast to what half the socket receive buffer can queue. Concurrent
+// sessions share the buffer, so each gets its share of it as of when it starts.
+void accept_file_header(FileHeader &h, size_t concurrent) {
+    h.flags &= HDR_FRAGMENTATION | HDR_CHECKSUMS | HDR_COMPRESSION | HDR_DELTA;
+    h.delta_blocks = 0;
+    h.records_per_packet = max(1u, min(h.records_per_packet, MAX_RECORDS_PER_PACKET));
+    size_t dgram = max<size_t>(h.max_datagram, data_datagram_size(h.records_per_packet, h.record_size, h.flags & HDR_CHECKSUMS));
+    uint32_t fit = (uint32_t)max<size_t>(1, (size_t)rcvbuf_bytes / 2 / dgram / max<size_t>(1, concurrent)) * h.records_per_packet;
+    h.M = max(1u, min(h.M, fit));
+}
+
+// Drops this thread's reassembly and loss state of a session that is over
+void forget_session(uint16_t id) {
+    for (auto it = reassembly.begin(); it != reassembly.end();)
+        it = it->first >> 32 == id ? reassembly.erase(it) : next(it);
+    for (auto it = open_rounds.begin(); it != open_rounds.end();)
+        it = *it >> 32 == id ? open_rounds.erase(it) : next(it);
+    for (auto it = missing_records_per_blast.begin(); it != missing_records_per_blast.end();)
+        it = it->first >> 32 == id ? missing_records_per_blast.erase(it) : next(it);
+    stats->incomplete_blasts.set(missing_records_per_blast.size());
+}
+
+// The live session `id`, as long as `from` is its sender's host. Sessions are found through this
+// thread's cache; the shared table is only consulted the first time a thread sees a session.
+Session *find_session(uint16_t id, const sockaddr_in &from) {
+    auto it = session_cache.find(id);
+    if (it == session_cache.end() || it->second->closed.load(memory_order_acquire)) {
+        shared_ptr<Session> found;
+        {
+            lock_guard<mutex> g(sessions_mtx);
+            auto f = sessions.find(id);
+            if (f != sessions.end()) found = f->second;
+        }
+        if (!found) return nullptr;
+        if (it != session_cache.end()) {
+            // The id has been handed out again since this thread last saw it
+            forget_session(id);
+            it->second = std::move(found);
+        } else {
+            it = session_cache.emplace(id, std::move(found)).first;
+        }
+    }
+    Session &ss = *it->second;
+    if (ss.peer.sin_addr.s_addr != from.sin_addr.s_addr) return nullptr;
+    return &ss;
+}
+
+// Saves which records of a session are in its output file. The bitmap is snapshotted before the
+// file is flushed, so everything it vouches for is on disk by the time it replaces the last one.
+bool write_checkpoint(Session &ss) {
+    vector<uint64_t> snapshot(ss.received.words.size());
+    for (size_t i = 0; i < snapshot.size(); ++i) snapshot[i] = ss.received.word((uint32_t)i);
+    if (fdatasync(ss.out_fd) < 0) return false;
+
+    CheckpointHeader h = {CHECKPOINT_MAGIC, ss.header.record_size, ss.header.file_size, ss.header.file_id, ss.total_records, 0};
+    string tmp = ss.checkpoint_path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h)
+           && write(fd, snapshot.data(), snapshot.size() * sizeof(uint64_t)) == (ssize_t)(snapshot.size() * sizeof(uint64_t))
+           && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), ss.checkpoint_path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Checkpoints a live session, unless it has been closed in the meantime
+void checkpoint_session(Session &ss) {
+    lock_guard<mutex> g(ss.checkpoint_mtx);
+    if (ss.checkpoint_path.empty() || ss.checkpoint_final) return;
+    if (!write_checkpoint(ss))
+        receiver_log(LogLevel::Warn) << "[Receiver] Session " << ss.id << ": cannot write " << ss.checkpoint_path << ": " << strerror(errno) << endl;
+}
+
+// Loads the checkpoint of an earlier attempt at the same file into ss.received. False if there is
+// none, or it belongs to a different file or layout.
+bool load_checkpoint(Session &ss) {
+    int fd = open(ss.checkpoint_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    CheckpointHeader h;
+    size_t bytes = ss.received.words.size() * sizeof(uint64_t);
+    bool ok = read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && h.magic == CHECKPOINT_MAGIC
+           && h.record_size == ss.header.record_size && h.file_size == ss.header.file_size
+           && h.file_id == ss.header.file_id && h.total_records == ss.total_records
+           && read(fd, ss.received.words.data(), bytes) == (ssize_t)bytes;
+    close(fd);
+    if (!ok) ss.received.resize(ss.total_records);
+    return ok;
+}
+
+// Last word on a session's checkpoint: a complete file needs none, anything else keeps one so
+// the sender can resume
+void finalize_checkpoint(Session &ss, bool complete) {
+    lock_guard<mutex> g(ss.checkpoint_mtx);
+    if (ss.checkpoint_path.empty() || ss.checkpoint_final) return;
+    ss.checkpoint_final = true;
+    if (complete) unlink(ss.checkpoint_path.c_str());
+    else if (!write_checkpoint(ss))
+        receiver_log(LogLevel::Warn) << "[Receiver] Session " << ss.id << ": cannot write " << ss.checkpoint_path << ": " << strerror(errno) << endl;
+}
+
+// Takes a session out of the table, once: `how` says whether it finished or was evicted. The
+// receive threads let go of it from there; the last one to do so ends it in ~Session.
+void close_session(Session &ss, const char *how) {
+    shared_ptr<Session> keep = ss.shared_from_this();
+    lock_guard<mutex> g(sessions_mtx);
+    if (ss.closed.exchange(true, memory_order_acq_rel)) return;
+    ss.end = how;
+    ss.ended = chrono::steady_clock::now();
+    sessions.erase(ss.id);
+    auto p = session_by_peer.find(peer_key(ss.peer));
+    if (p != session_by_peer.end() && p->second == ss.id) session_by_peer.erase(p);
+}
+
+// Final accounting of a closed session: its last checkpoint, the digest check of a complete file
+// whose sender reported one, and the completion log line
+void session_over(Session &ss) {
+    const char *how = ss.end;
+    uint64_t held = ss.received.count();
+    bool complete = held == ss.total_records;
+    finalize_checkpoint(ss, complete);
+
+    string integrity;
+    if (ss.checksums && complete && ss.streams && ss.digests_reported == ss.streams) {
+        char expected[17], got[17];
+        snprintf(expected, sizeof(expected), "%016llx", (unsigned long long)ss.sender_digest);
+        snprintf(got, sizeof(got), "%016llx", (unsigned long long)ss.digest.load());
+        if (ss.sender_digest == ss.digest.load()) integrity = string(", digest ") + got + " ok";
+        else {
+            sessions_corrupt++;
+            receiver_log(LogLevel::Error) << "[Receiver] Session " << ss.id << ": file digest mismatch in " << ss.path
+                                          << ": sender " << expected << ", received " << got << endl;
+            integrity = ", DIGEST MISMATCH";
+        }
+    }
+
+    double secs = max(1e-6, chrono::duration<double>(ss.ended - ss.started).count());
+    stringstream rate;
+    if (strcmp(how, "finished") == 0) rate << ", " << ss.header.file_size << " bytes (" << (double)ss.header.file_size * 8 / secs / 1e6 << " Mbps)";
+    if (complete) rate << ", complete" << integrity;
+    else rate << ", " << ss.total_records - held << " of " << ss.total_records << " records missing";
+    receiver_log << "[Receiver] Session " << ss.id << " from " << peer_str(ss.peer) << " " << how
+                 << " after " << secs << "s: " << ss.path << rate.str() << endl;
+}
+
+// Every write into a closed session's file has completed once nothing refers to it any more (an
+// io_uring buffer holds on to its session until its writes are in), so only now is its received
+// bitmap final
+Session::~Session() {
+    stop_signing = true;
+    for (auto &t : signers) t.join();
+    if (end) session_over(*this);
+    if (direct_fd >= 0) close(direct_fd);
+    if (out_fd >= 0) {
+        close(out_fd);
+        lock_guard<mutex> g(sessions_mtx);
+        open_paths.erase(path);
+    }
+}
+
+// Every few hundred milliseconds a receive thread drops the sessions that were closed elsewhere
+void sweep_sessions() {
+    thread_local int64_t next_sweep = 0;
+    if (loop_now < next_sweep) return;
+    next_sweep = loop_now + 250000000;
+    for (auto it = session_cache.begin(); it != session_cache.end();) {
+        if (!it->second->closed.load(memory_order_acquire)) { ++it; continue; }
+        forget_session(it->first);
+        it = session_cache.erase(it);
+    }
+}
+
+vector<shared_ptr<Session>> live_sessions() {
+    lock_guard<mutex> g(sessions_mtx);
+    vector<shared_ptr<Session>> v;
+    for (auto &kv : sessions) v.push_back(kv.second);
+    return v;
+}
+
+// Evicts the sessions whose sender has gone quiet (daemon mode)
+void reap_idle_sessions() {
+    int64_t cutoff = steady_ns() - chrono::duration_cast<chrono::nanoseconds>(idle_timeout).count();
+    vector<shared_ptr<Session>> idle;
+    {
+        lock_guard<mutex> g(sessions_mtx);
+        for (auto &kv : sessions)
+            if (kv.second->last_active.load(memory_order_relaxed) < cutoff) idle.push_back(kv.second);
+    }
+    for (auto &ss : idle) {
+        receiver_log(LogLevel::Warn) << "[Receiver] Session " << ss->id << " idle for " << idle_timeout.count() << "s, evicting" << endl;
+        close_session(*ss, "evicted");
+        sessions_evicted++;
+    }
+}
+
+// Hashes chunks of a delta session's copy until none are left. The session joins its signers before
+// it goes away, so they can use it without holding a reference.
+void sign_chunks(Session *ss) {
+    uint32_t rpb = ss->header.records_per_packet, rs = ss->header.record_size, blocks = ss->header.delta_blocks;
+    uint32_t chunks = (blocks + SIGNATURE_PER_REPLY - 1) / SIGNATURE_PER_REPLY;
+    vector<char> buf;
+    for (uint32_t c; !ss->stop_signing && (c = ss->next_chunk++) < chunks;) {
+        uint32_t first = c * SIGNATURE_PER_REPLY, last = min(blocks, first + SIGNATURE_PER_REPLY) - 1;
+        uint64_t start = delta_block_bytes(first, rpb, rs, ss->header.file_size).first;
+        uint64_t end = delta_block_bytes(last, rpb, rs, ss->header.file_size).second;
+        buf.resize(end - start);
+        size_t got = 0;
+        while (got < buf.size()) {
+            ssize_t r = pread(ss->out_fd, buf.data() + got, buf.size() - got, (off_t)(start + got));
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        bool ok = got == buf.size();
+        for (uint32_t b = first; ok && b <= last; ++b) {
+            auto range = delta_block_bytes(b, rpb, rs, ss->header.file_size);
+            ss->signature[b] = xxh64(buf.data() + (range.first - start), range.second - range.first);
+        }
+        ss->chunk_state[c].store(ok ? 1 : 2, memory_order_release);
+        if (ss->chunks_signed.fetch_add(1) + 1 == chunks)
+            receiver_log << "[Receiver] Session " << ss->id << ": signed " << blocks << " blocks of " << ss->path
+                         << " in " << chrono::duration<double>(chrono::steady_clock::now() - ss->started).count() << "s" << endl;
+    }
+}
+
+// Opens the output file of a new session; the caller holds sessions_mtx
+shared_ptr<Session> create_session(const FileHeader &proposal, const sockaddr_in &from) {
+    auto ss = make_shared<Session>();
+    while (next_session_id == 0 || sessions.count(next_session_id)) next_session_id++;
+    ss->id = next_session_id++;
+    ss->peer = from;
+    ss->proposal = proposal;
+    ss->header = proposal;
+    accept_file_header(ss->header, sessions.size() + 1);
+    ss->header.session_id = ss->id;
+    uint64_t records = ss->header.record_size ? (ss->header.file_size + ss->header.record_size - 1) / ss->header.record_size : 0;
+    if (!ss->header.record_size || records > UINT32_MAX) {
+        receiver_log(LogLevel::Error) << "[Receiver] FILE_HDR from " << peer_str(from) << " has " << records << " records of "
+                                      << ss->header.record_size << " bytes; at most " << UINT32_MAX << " are addressable" << endl;
+        return nullptr;
+    }
+    ss->total_records = (uint32_t)records;
+    ss->missing.resize(ss->total_records);
+    ss->received.resize(ss->total_records);
+    ss->checksums = ss->header.flags & HDR_CHECKSUMS;
+    if (ss->checksums) ss->digested.resize(ss->total_records);
+    if (num_writers) ss->write_failed.resize(ss->total_records);
+
+    // A resumable transfer gets a name that is the same every time that file comes from that host,
+    // unless another live session is writing it
+    bool resumable = proposal.file_id && checkpoint_interval.count();
+    if (daemon_mode) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+        char id_hex[17];
+        snprintf(id_hex, sizeof(id_hex), "%016llx", (unsigned long long)proposal.file_id);
+        ss->path = output_dir + "/recv_" + ip + "_" + id_hex + ".bin";
+        if (open_paths.count(ss->path)) resumable = false;
+        if (!resumable) ss->path = output_dir + "/recv_" + ip + "_" + to_string(ntohs(from.sin_port)) + "_" + to_string(ss->id) + ".bin";
+    } else {
+        ss->path = "recv_testfile.bin";
+    }
+    if (resumable) ss->checkpoint_path = ss->path + ".resume";
+
+    // A delta transfer starts from whatever copy is in place, including what an interrupted attempt
+    // left there, so it needs no checkpoint; one left from an earlier version would be stale
+    bool delta = ss->header.flags & HDR_DELTA;
+    uint64_t copy_size = 0;
+    if (delta) {
+        if (resumable) unlink(ss->checkpoint_path.c_str());
+        ss->checkpoint_path.clear();
+        ss->out_fd = open(ss->path.c_str(), O_RDWR);
+        struct stat st;
+        if (ss->out_fd >= 0 && fstat(ss->out_fd, &st) == 0) copy_size = (uint64_t)st.st_size;
+    } else if (resumable && access(ss->path.c_str(), F_OK) == 0 && load_checkpoint(*ss)) {
+        // Pick up where an earlier attempt left off if both its output and its checkpoint are still there
+        ss->out_fd = open(ss->path.c_str(), O_RDWR);
+        if (ss->out_fd < 0) ss->received.resize(ss->total_records);
+    } else if (resumable) {
+        unlink(ss->checkpoint_path.c_str());
+    }
+    if (ss->out_fd < 0) ss->out_fd = safe_open_recvfile(ss->path);
+    ss->header.records_held = (uint32_t)ss->received.count();
+    if (ss->out_fd < 0) {
+        receiver_log(LogLevel::Error) << "[Receiver] Cannot create/open " << ss->path << ": " << strerror(errno) << endl;
+        return nullptr;
+    }
+    // Pre-size the output so every record has its final offset from the start
+    if (ftruncate(ss->out_fd, ss->header.file_size) < 0)
+        receiver_log(LogLevel::Error) << "[Receiver] ftruncate failed: " << strerror(errno) << endl;
+    if (direct_io && num_writers) {
+        ss->direct_fd = open(ss->path.c_str(), O_WRONLY | O_DIRECT);
+        if (ss->direct_fd < 0)
+            receiver_log(LogLevel::Warn) << "[Receiver] Session " << ss->id << ": cannot open " << ss->path << " with O_DIRECT ("
+                                         << strerror(errno) << "), writing through the page cache" << endl;
+    }
+    ss->started = chrono::steady_clock::now();
+
+    // Sign every block the copy covers in full, in the background; the ACK can go out meanwhile
+    if (delta && copy_size) {
+        uint32_t rpb = ss->header.records_per_packet, blocks = delta_block_count(ss->total_records, rpb);
+        if (copy_size < ss->header.file_size) blocks = (uint32_t)(copy_size / ((uint64_t)rpb * ss->header.record_size));
+        ss->header.delta_blocks = blocks;
+        ss->signature.resize(blocks);
+        uint32_t chunks = (blocks + SIGNATURE_PER_REPLY - 1) / SIGNATURE_PER_REPLY;
+        ss->chunk_state.reset(new atomic<uint8_t>[chunks]);
+        for (uint32_t c = 0; c < chunks; ++c) ss->chunk_state[c].store(0);
+        uint32_t n = sign_threads ? sign_threads : max(1u, min(4u, thread::hardware_concurrency()));
+        for (uint32_t i = 0; i < min(n, chunks); ++i) ss->signers.emplace_back(sign_chunks, ss.get());
+    }
+    ss->last_active.store(steady_ns(), memory_order_relaxed);
+    sessions[ss->id] = ss;
+    session_by_peer[peer_key(from)] = ss->id;
+    open_paths.insert(ss->path);
+    return ss;
+}
+
+// FILE_HDR: a new session, or the one already opened for this sender if the FILE_HDR is a repeat
+// (its ACK was lost). Answered with the accepted header, or with session_id 0 if the receiver is full.
+void handle_file_header(const char *buf, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    FileHeader proposal;
+    memcpy(&proposal, buf, sizeof(proposal));
+    proposal.session_id = 0;
+    shared_ptr<Session> ss, replaced;
+    bool repeat = false;
+    {
+        lock_guard<mutex> g(sessions_mtx);
+        auto p = session_by_peer.find(peer_key(sender_addr));
+        if (p != session_by_peer.end()) {
+            shared_ptr<Session> &old = sessions[p->second];
+            if (memcmp(&old->proposal, &proposal, sizeof(proposal)) == 0) { ss = old; repeat = true; }
+            else replaced = old;
+        }
+    }
+    // The same address starting a different transfer means the old one is gone
+    if (replaced) close_session(*replaced, "replaced");
+    if (!ss) {
+        lock_guard<mutex> g(sessions_mtx);
+        if (sessions.size() < max_sessions) ss = create_session(proposal, sender_addr);
+        else receiver_log(LogLevel::Warn) << "[Receiver] " << max_sessions << " sessions already open" << endl;
+    }
+
+    FileHeader answer = ss ? ss->header : proposal;
+    if (!ss) {
+        sessions_refused++;
+        receiver_log(LogLevel::Warn) << "[Receiver] Refusing FILE_HDR from " << peer_str(sender_addr) << endl;
+    } else if (repeat) {
+        receiver_log << "[Receiver] Repeated FILE_HDR for session " << ss->id << ", sending FILE_HDR_ACK again" << endl;
+    } else {
+        const FileHeader &h = ss->header;
+        receiver_log << "[Receiver] Received FILE_HDR from " << peer_str(sender_addr) << " (record_size=" << h.record_size
+                     << ", records_per_packet=" << h.records_per_packet << ", M=" << h.M
+                     << ", max_datagram=" << h.max_datagram
+                     << (h.flags & HDR_FRAGMENTATION ? ", fragmentation allowed" : "")
+                     << (h.flags & HDR_COMPRESSION ? ", compression" : "") << "), session " << ss->id
+                     << " writing to " << ss->path << ", sending FILE_HDR_ACK" << endl;
+        if (h.records_held)
+            receiver_log << "[Receiver] Session " << ss->id << " resumes with " << h.records_held << " of "
+                         << ss->total_records << " records already in " << ss->path << endl;
+        if (h.flags & HDR_DELTA)
+            receiver_log << "[Receiver] Session " << ss->id << " is a delta transfer; signing " << h.delta_blocks
+                         << " blocks of the copy in " << ss->path << endl;
+    }
+    char ack[FILE_HDR_ACK_TAG_LEN + sizeof(FileHeader)];
+    memcpy(ack, FILE_HDR_ACK_TAG, FILE_HDR_ACK_TAG_LEN);
+    memcpy(ack + FILE_HDR_ACK_TAG_LEN, &answer, sizeof(FileHeader));
+    sendto(sockfd, ack, sizeof(ack), 0, (sockaddr*)&sender_addr, addrlen);
+}
+
+// RESUME request: the held records from `from` on, as far as one reply reaches
+void handle_resume_request(const char *buf, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    ResumeHeader req;
+    memcpy(&req, buf, sizeof(req));
+    Session *ss = find_session(req.session, sender_addr);
+    if (!ss || req.from >= ss->total_records) return;
+    vector<char> reply = encode_resume(ss->id, ss->received, req.from, ss->total_records - 1);
+    sendto(sockfd, reply.data(), reply.size(), 0, (sockaddr*)&sender_addr, addrlen);
+}
+
+// SIGNATURE request: the hashes of one chunk of blocks, once it has been signed
+void handle_signature_request(const char *buf, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    ResumeHeader req;
+    memcpy(&req, buf, sizeof(req));
+    Session *ss = find_session(req.session, sender_addr);
+    if (!ss || req.from >= ss->header.delta_blocks || req.from % SIGNATURE_PER_REPLY) return;
+    uint8_t state = ss->chunk_state[req.from / SIGNATURE_PER_REPLY].load(memory_order_acquire);
+    if (!state) return;     // still hashing; the sender asks again
+    uint32_t to = min(ss->header.delta_blocks, req.from + SIGNATURE_PER_REPLY) - 1;
+    uint16_t count = state == 1 ? (uint16_t)(to - req.from + 1) : 0;
+    ResumeHeader h = {SIGNATURE_MAGIC, ss->id, count, req.from, to};
+    vector<char> reply(sizeof(h) + (size_t)count * sizeof(uint64_t));
+    memcpy(reply.data(), &h, sizeof(h));
+    if (count) memcpy(reply.data() + sizeof(h), ss->signature.data() + req.from, (size_t)count * sizeof(uint64_t));
+    sendto(sockfd, reply.data(), reply.size(), 0, (sockaddr*)&sender_addr, addrlen);
+}
+
+// DELTA_HELD: records of the copy in place that the sender found unchanged and will not send; they
+// count as received. Acknowledged by echoing the header.
+void handle_delta_held(const char *buf, size_t n, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    ResumeHeader h;
+    vector<pair<uint32_t, uint32_t>> ranges;
+    if (!decode_resume(buf, n, h, ranges, DELTA_HELD_MAGIC)) return;
+    Session *ss = find_session(h.session, sender_addr);
+    if (!ss || !(ss->header.flags & HDR_DELTA) || h.to >= ss->total_records) return;
+    for (auto &r : ranges) ss->received.set_range(r.first, r.second - r.first + 1);
+    ResumeHeader ack = {DELTA_HELD_MAGIC, h.session, 0, h.from, h.to};
+    sendto(sockfd, &ack, sizeof(ack), 0, (sockaddr*)&sender_addr, addrlen);
+}
+
+// "DISCONNECT <stream>/<streams> <session> [<digest>]": the session is done once all its streams
+// have sent one. With checksums each carries, in hex, the digest of the records its stream sent.
+void handle_disconnect(const string &s, const sockaddr_in &sender_addr) {
+    uint32_t stream = 0, streams = 1, id = 0;
+    unsigned long long digest = 0;
+    int fields = sscanf(s.c_str() + 10, " %u/%u %u %llx", &stream, &streams, &id, &digest);
+    if (fields < 3 || id > UINT16_MAX) {
+        receiver_log(LogLevel::Warn) << "[Receiver] Malformed DISCONNECT: " << s << endl;
+        return;
+    }
+    Session *ss = find_session((uint16_t)id, sender_addr);
+    if (!ss) {
+        receiver_log(LogLevel::Debug) << "[Receiver] DISCONNECT for unknown session " << id << endl;
+        return;
+    }
+    bool all;
+    {
+        lock_guard<mutex> g(ss->disconnect_mtx);
+        ss->streams = streams;
+        if (ss->disconnected_streams.insert(stream).second && fields == 4) {
+            ss->sender_digest += digest;
+            ss->digests_reported++;
+        }
+        all = ss->disconnected_streams.size() >= streams;
+    }
+    if (streams > 1) receiver_log << "[Receiver] Session " << id << ": sender stream " << stream << "/" << streams << " disconnected" << endl;
+    else receiver_log << "[Receiver] Session " << id << ": sender disconnected" << endl;
+    if (!all) return;
+    close_session(*ss, "finished");
+    sessions_finished++;
+    if (!daemon_mode) done_receiving = true;
+}
+
+// With checksums, whether a blast datagram passes its header CRC: over the header, segment and CRC
+// tables of a data datagram (its records are checked one by one later), over all of a parity one
+bool datagram_intact(const Session &ss, const PacketHeader &ph, const char *buf, size_t n) {
+    if (!ss.checksums) return true;
+    size_t covered = n;
+    if (!(ph.flags & PKT_PARITY)) {
+        size_t segs_end = sizeof(PacketHeader) + (size_t)ph.num_segments * sizeof(Segment);
+        if (segs_end > n) return false;
+        uint64_t records = segment_records(buf + sizeof(PacketHeader), ph.num_segments);
+        if (records > (n - segs_end) / sizeof(uint32_t)) return false;
+        covered = segs_end + records * sizeof(uint32_t);
+    }
+    PacketHeader zeroed = ph;
+    zeroed.crc = 0;
+    return crc32c(crc32c(0, &zeroed, sizeof(zeroed)), buf + sizeof(zeroed), covered - sizeof(zeroed)) == ph.crc;
+}
+
+void handle_blast_datagram(const char *buf, size_t n, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    PacketHeader ph; memcpy(&ph, buf, sizeof(ph));
+    if (!ph.blast_id || !ph.total_chunks || (!ph.num_segments && !(ph.flags & PKT_PROBE))) return;
+    Session *ss = find_session(ph.session, sender_addr);
+    if (!ss) return;    // stray datagram of a session that is over, or never was
+    // The header sizes the round's reassembly state, so it is bounded first: a round has at most a
+    // blast's worth of data datagrams, and parity indices run to k per group of n of them
+    uint32_t rpp = ss->header.records_per_packet;
+    uint32_t max_chunks = (ss->header.M + rpp - 1) / rpp;
+    uint32_t chunk_limit = !(ph.flags & PKT_PARITY) ? ph.total_chunks
+                         : ph.fec_n ? (ph.total_chunks + ph.fec_n - 1) / ph.fec_n * ph.fec_k : 0;
+    if (ph.total_chunks > max_chunks || ph.chunk_no >= chunk_limit || !datagram_intact(*ss, ph, buf, n)) {
+        stats->corrupt_datagrams++;
+        return;
+    }
+    if (loop_now - ss->last_active.load(memory_order_relaxed) > 100000000) ss->last_active.store(loop_now, memory_order_relaxed);
+    if (ph.flags & PKT_PROBE) handle_probe(*ss, ph, sender_addr, addrlen);
+    else handle_fragment(*ss, ph, buf, n, sender_addr, addrlen);
+}
+
+void handle_datagram(const char *buf, int n, const sockaddr_in &sender_addr, socklen_t addrlen) {
+    stats->datagrams++;
+    if (stats->blasts == 0) stats->start = chrono::steady_clock::now();
+
+    // Handle file header, RESUME requests of a sender picking up an earlier attempt, and the
+    // signature exchange of a delta transfer
+    uint32_t magic = 0;
+    if (n >= 4) memcpy(&magic, buf, sizeof(magic));
+    if ((size_t)n == sizeof(FileHeader) && magic == FILE_HDR_MAGIC) {
+        handle_file_header(buf, sender_addr, addrlen);
+        return;
+    }
+    if ((size_t)n == sizeof(ResumeHeader) && magic == RESUME_MAGIC) {
+        handle_resume_request(buf, sender_addr, addrlen);
+        return;
+    }
+    if ((size_t)n == sizeof(ResumeHeader) && magic == SIGNATURE_MAGIC) {
+        handle_signature_request(buf, sender_addr, addrlen);
+        return;
+    }
+    if ((size_t)n >= sizeof(ResumeHeader) && magic == DELTA_HELD_MAGIC) {
+        handle_delta_held(buf, (size_t)n, sender_addr, addrlen);
+        return;
+    }
+
+    // Handle small ASCII messages
+    if (n <= 4096) {
+        bool is_ascii = all_of(buf, buf + n, [](unsigned char c){ return (c >= 9 && (c <= 13 || c >= 32)); });
+        if (is_ascii) {
+            string s(buf, n);
+            if (s.compare(0, 10, "DISCONNECT") == 0) {
+                handle_disconnect(s, sender_addr);
+                return;
+            }
+            receiver_log << "[Receiver] Received small ASCII message: " << s << endl;
+            return;
+        }
+    }
+
+    // Handle fragmented packet
+    if ((size_t)n >= sizeof(PacketHeader)) {
+        int copies = impairment.active() ? impairment.admit(buf, (size_t)n, sender_addr, addrlen) : 1;
+        for (int i = 0; i < copies; ++i) handle_blast_datagram(buf, (size_t)n, sender_addr, addrlen);
+    }
+}
+
+// How long a receive waits for a datagram before the loop goes round anyway: short enough for the
+// early REC_MISS timers, and for impairment delays to be released on time
+int64_t receive_timeout_ns() {
+    if (impairment_config.delays()) return 1000000;
+    return max<int64_t>(1000000, min<int64_t>(nack_delay_ns, 100000000));
+}
+
+// Runs after every receive: stamps the loop time, drops sessions closed by other threads, hands
+// over the impaired datagrams whose delay has run out, and answers rounds whose time is up.
+// `quiet` says the receive came back empty.
+void housekeeping(bool quiet = false) {
+    loop_now = steady_ns();
+    sweep_sessions();
+    Impairment::Delivery d;
+    while (!done_receiving && impairment.pop_due(d)) handle_blast_datagram(d.data.data(), d.data.size(), d.addr, d.addrlen);
+    nack_timers(quiet);
+    answer_deferred(quiet);
+    expire_reassembly();
+}
+
+// Hands one received buffer to handle_datagram. With GRO the kernel may have glued several
+// same-sized datagrams into it; the UDP_GRO cmsg gives the segment size.
+void handle_received(const char *buf, size_t len, msghdr &mh, const sockaddr_in &addr) {
+    size_t seg_size = len;
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&mh); use_gro && cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size; memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            if (gso_size > 0) seg_size = (size_t)gso_size;
+        }
+    }
+    for (size_t off = 0; off < len && !done_receiving; off += seg_size)
+        handle_datagram(buf + off, (int)min(seg_size, len - off), addr, mh.msg_namelen);
+}
+
+// Receives up to recv_batch datagrams with one recvmmsg call. With GRO the kernel may hand back
+// several same-sized datagrams glued into one buffer; the UDP_GRO cmsg gives the segment size.
+// Returns whether anything came in.
+bool receive_batch(vector<char> &bufs, vector<mmsghdr> &msgs, vector<iovec> &iovs,
+                   vector<sockaddr_in> &addrs, vector<char> &ctrl)
+{
+    const size_t BUF_SIZE = 65536, CTRL_SIZE = CMSG_SPACE(sizeof(int));
+    for (uint32_t i = 0; i < recv_batch; ++i) {
+        iovs[i] = {bufs.data() + i * BUF_SIZE, BUF_SIZE};
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (use_gro) {
+            msgs[i].msg_hdr.msg_control = ctrl.data() + i * CTRL_SIZE;
+            msgs[i].msg_hdr.msg_controllen = CTRL_SIZE;
+        }
+    }
+
+    int got = recvmmsg(sockfd, msgs.data(), recv_batch, deferred_answers.empty() ? MSG_WAITFORONE : MSG_DONTWAIT, nullptr);
+    if (got <= 0) return false;
+    stats->recv_calls++;
+
+    for (int i = 0; i < got && !done_receiving; ++i)
+        handle_received(bufs.data() + i * BUF_SIZE, msgs[i].msg_len, msgs[i].msg_hdr, addrs[i]);
+    return true;
+}
+
+void post_receive(uint32_t i) {
+    UringSlot &s = (*uring_slots)[i];
+    s.iov = {uring_mem + (size_t)i * URING_SLOT_SIZE, URING_SLOT_SIZE};
+    memset(&s.msg, 0, sizeof(s.msg));
+    s.msg.msg_name = &s.addr;
+    s.msg.msg_namelen = sizeof(s.addr);
+    s.msg.msg_iov = &s.iov;
+    s.msg.msg_iovlen = 1;
+    if (use_gro) {
+        s.msg.msg_control = s.ctrl;
+        s.msg.msg_controllen = sizeof(s.ctrl);
+    }
+    io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe) { ring->submit(); sqe = ring->get_sqe(); }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = 0;    // the thread's socket, fixed file 0
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)&s.msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)URING_RECV << 32 | i;
+    s.idle = false;
+}
+
+// Accounts one completed write from a receive buffer. Once the buffer's last write is in, the
+// records it carried count as received, unless one of its writes failed.
+void write_completed(UringSlot &s, int res) {
+    uring_pending_writes--;
+    if (res < 0) {
+        s.write_failed = true;
+        receiver_log(LogLevel::Error) << "[Receiver] io_uring write failed: " << strerror(-res) << endl;
+    }
+    if (--s.pending_writes) return;
+    // The records were taken off `missing` when they arrived; a failed buffer puts them all back,
+    // ahead of the answer that was held for it
+    for (auto &r : s.records) (s.write_failed ? s.session->missing : s.session->received).set_range(r.first, r.second);
+    s.records.clear();
+    s.write_failed = false;
+    s.session.reset();
+}
+
+// Receive loop of the io_uring path. Returns false, before receiving anything, if io_uring cannot
+// be set up, so the caller can fall back to the blocking loop.
+bool uring_receive_loop() {
+    IoUring r;
+    if (!r.init(uring_depth * 2)) {
+        receiver_log(LogLevel::Warn) << "[Receiver] io_uring unavailable (" << strerror(errno) << "), using blocking receive" << endl;
+        return false;
+    }
+    // The loop relies on the wait timeout to run NACK and idle timers on a quiet socket
+    if (!r.has_wait_timeout()) {
+        receiver_log(LogLevel::Warn) << "[Receiver] io_uring has no wait timeout on this kernel, using blocking receive" << endl;
+        return false;
+    }
+    if (!r.register_files(&sockfd, 1)) {
+        receiver_log(LogLevel::Warn) << "[Receiver] io_uring file registration failed (" << strerror(errno) << "), using blocking receive" << endl;
+        return false;
+    }
+    size_t mem_len = (size_t)uring_depth * URING_SLOT_SIZE;
+    void *mem = mmap(nullptr, mem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return false;
+    vector<UringSlot> slots(uring_depth);
+    vector<iovec> iovs(uring_depth);
+    for (uint32_t i = 0; i < uring_depth; ++i) iovs[i] = {(char *)mem + (size_t)i * URING_SLOT_SIZE, URING_SLOT_SIZE};
+    // Without registered buffers (e.g. a low memlock limit) writes go out as plain WRITEs
+    uring_fixed_buffers = r.register_buffers(iovs.data(), uring_depth);
+    if (!uring_fixed_buffers)
+        receiver_log(LogLevel::Warn) << "[Receiver] io_uring buffer registration failed (" << strerror(errno) << "), writing from unregistered buffers" << endl;
+
+    ring = &r;
+    uring_slots = &slots;
+    uring_mem = (char *)mem;
+    uring_pending_writes = 0;
+    for (uint32_t i = 0; i < uring_depth; ++i) post_receive(i);
+    receiver_log << "[Receiver] Thread " << stats->thread_no << " receiving through io_uring (" << uring_depth << " buffers"
+                 << (uring_fixed_buffers ? ", registered" : "") << ")" << endl;
+
+    timespec timeout = {0, (long)receive_timeout_ns()};
+    io_uring_cqe cqe;
+    while (!done_receiving) {
+        r.submit(deferred_answers.empty() ? 1 : 0, &timeout);
+        bool got = false;
+        while (r.pop_cqe(cqe)) {
+            uint32_t i = (uint32_t)cqe.user_data;
+            UringSlot &s = slots[i];
+            if (cqe.user_data >> 32 == URING_RECV) {
+                if (cqe.res > 0 && !done_receiving) {
+                    got = true;
+                    stats->recv_calls++;
+                    s.received = chrono::steady_clock::now();
+                    handle_received(uring_mem + (size_t)i * URING_SLOT_SIZE, (size_t)cqe.res, s.msg, s.addr);
+                } else if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR) {
+                    receiver_log(LogLevel::Debug) << "[Receiver] io_uring receive failed: " << strerror(-cqe.res) << endl;
                 }
+                s.idle = true;
+            } else {
+                stats->write_latency.observe(chrono::steady_clock::now() - s.received);
+                write_completed(s, cqe.res);
             }
+            if (s.idle && !s.pending_writes && !done_receiving) post_receive(i);
         }
+        housekeeping(!got);
     }
 
-    // Final stats
-    recv_end_time = chrono::steady_clock::now();
-    fout.close();
-    { std::ifstream a("testfile.bin", std::ios::binary); std::ofstream b("recv_testfile.bin", std::ios::binary | std::ios::trunc); b << a.rdbuf(); }
-    double secs = chrono::duration<double>(recv_end_time - recv_start_time).count();
+    // Every queued write has to be on disk before the file is closed
+    while (uring_pending_writes) {
+        r.submit(1, &timeout);
+        while (r.pop_cqe(cqe)) {
+            if (cqe.user_data >> 32 == URING_WRITE) write_completed(slots[(uint32_t)cqe.user_data], cqe.res);
+        }
+    }
+    ring = nullptr;
+    uring_slots = nullptr;
+    uring_mem = nullptr;
+    r.close();   // cancels the posted receives before their buffers go away
+    munmap(mem, mem_len);
+    return true;
+}
+
+// Receive loop on plain blocking sockets: recvmmsg batches (with or without GRO), or one recvfrom
+// per datagram
+void blocking_receive_loop() {
+    if (recv_batch > 1 || use_gro) {
+        const size_t BUF_SIZE = 65536, CTRL_SIZE = CMSG_SPACE(sizeof(int));
+        vector<char> bufs(recv_batch * BUF_SIZE), ctrl(recv_batch * CTRL_SIZE);
+        vector<mmsghdr> msgs(recv_batch);
+        vector<iovec> iovs(recv_batch);
+        vector<sockaddr_in> addrs(recv_batch);
+        while (!done_receiving) {
+            bool got = receive_batch(bufs, msgs, iovs, addrs, ctrl);
+            housekeeping(!got);
+        }
+    } else {
+        while (!done_receiving) {
+            char buf[65536];
+            sockaddr_in sender_addr{};
+            socklen_t addrlen = sizeof(sender_addr);
+            int n = recvfrom(sockfd, buf, sizeof(buf), deferred_answers.empty() ? 0 : MSG_DONTWAIT, (sockaddr*)&sender_addr, &addrlen);
+            if (n > 0) {
+                stats->recv_calls++;
+                handle_datagram(buf, n, sender_addr, addrlen);
+            }
+            housekeeping(n <= 0);
+        }
+    }
+}
+
+void network_receiver_thread(int fd, uint32_t thread_no) {
+    sockfd = fd;
+    stats = thread_stats[thread_no].get();
+    if (!write_rings.empty()) write_ring = write_rings[thread_no].get();
+    loop_now = steady_ns();
+    TraceLog::set_thread((uint16_t)thread_no);
+    impairment = impairment_config;
+    impairment.seed(seeded ? seed * 2 + 1 + thread_no : random_device{}());
+    if (seeded) rng.seed((uint32_t)(seed + thread_no));
+
+    if (!use_uring || !uring_receive_loop()) blocking_receive_loop();
+
+    // The end time is the completion of the thread's last blast, not the moment it noticed the end
+    if (!stats->blasts) stats->end = chrono::steady_clock::now();
+    stats->impair_dropped = impairment.dropped;
+    stats->impair_duplicated = impairment.duplicated;
+    stats->impair_delayed = impairment.delayed;
+    stats->impair_reordered = impairment.reordered;
+    stats->impair_corrupted = impairment.corrupted;
+    session_cache.clear();
+}
+
+// Rolls the per-thread counters up into the final summary, with one line per thread when there are several
+void log_summary() {
+    ThreadStats total;
+    bool any = false;
+    for (auto &tp : thread_stats) {
+        const ThreadStats &t = *tp;
+        if (num_threads > 1) {
+            double secs = max(1e-6, chrono::duration<double>(t.end - t.start).count());
+            receiver_log << "[Receiver] Thread " << t.thread_no << ": blasts=" << t.blasts << ", bytes=" << t.bytes
+                         << ", written=" << t.written << ", lost=" << t.lost << ", datagrams=" << t.datagrams
+                         << ", Throughput=" << (t.datagrams ? t.bytes * 8 / secs / 1e6 : 0.0) << " Mbps" << endl;
+        }
+        total.blasts += t.blasts; total.bytes += t.bytes; total.written += t.written; total.lost += t.lost;
+        total.nack_datagrams += t.nack_datagrams; total.parity_received += t.parity_received;
+        total.fec_recovered += t.fec_recovered; total.datagrams += t.datagrams; total.recv_calls += t.recv_calls;
+        total.corrupt_datagrams += t.corrupt_datagrams; total.corrupt_records += t.corrupt_records;
+        total.decompressed += t.decompressed;
+        total.early_nacks += t.early_nacks; total.lost_datagrams += t.lost_datagrams;
+        total.probes += t.probes; total.reassembly_expired += t.reassembly_expired;
+        total.write_queue_stalls += t.write_queue_stalls;
+        total.write_queue_peak.set(max(total.write_queue_peak.get(), t.write_queue_peak.get()));
+        total.impair_dropped += t.impair_dropped; total.impair_duplicated += t.impair_duplicated;
+        total.impair_delayed += t.impair_delayed; total.impair_reordered += t.impair_reordered;
+        total.impair_corrupted += t.impair_corrupted;
+        if (!t.datagrams) continue;
+        total.start = any ? min(total.start, t.start) : t.start;
+        total.end = any ? max(total.end, t.end) : t.end;
+        any = true;
+    }
+
+    double secs = chrono::duration<double>(total.end - total.start).count();
     if (secs < 1e-6) secs = 1e-6;
-    double throughput = total_bytes_received / secs;
+    double throughput = total.bytes / secs;
 
-    receiver_log << "[Receiver] Summary: blasts=" << total_blasts_received
-                 << ", bytes=" << total_bytes_received
-                 << ", written=" << total_records_written
-                 << ", lost=" << total_records_lost_sim << endl;
+    receiver_log << "[Receiver] Summary: blasts=" << total.blasts
+                 << ", bytes=" << total.bytes
+                 << ", written=" << total.written
+                 << ", lost=" << total.lost
+                 << ", nack_datagrams=" << total.nack_datagrams
+                 << ", parity_received=" << total.parity_received
+                 << ", fec_recovered=" << total.fec_recovered
+                 << ", corrupt_datagrams=" << total.corrupt_datagrams
+                 << ", corrupt_records=" << total.corrupt_records
+                 << ", decompressed=" << total.decompressed
+                 << ", early_nacks=" << total.early_nacks
+                 << ", lost_datagrams=" << total.lost_datagrams
+                 << ", probes=" << total.probes
+                 << ", reassembly_expired=" << total.reassembly_expired
+                 << ", threads=" << num_threads << endl;
+    receiver_log << "[Receiver] Syscalls: recv_calls=" << total.recv_calls
+                 << ", datagrams=" << total.datagrams
+                 << ", datagrams_per_call=" << (total.recv_calls ? (double)total.datagrams / total.recv_calls : 0.0)
+                 << " (batch=" << recv_batch << ", gro=" << (use_gro ? "on" : "off") << ")" << endl;
+    if (num_writers) {
+        WriterStats w;
+        for (auto &wp : writer_stats) {
+            w.calls += wp->calls; w.entries += wp->entries; w.bytes += wp->bytes;
+            w.direct_bytes += wp->direct_bytes; w.syncs += wp->syncs;
+        }
+        receiver_log << "[Receiver] Writers: writers=" << num_writers << ", pwritev_calls=" << w.calls
+                     << ", runs_per_call=" << (w.calls ? (double)w.entries / w.calls : 0.0)
+                     << ", bytes=" << w.bytes << ", direct_bytes=" << w.direct_bytes << ", syncs=" << w.syncs
+                     << ", queue_peak=" << (uint64_t)total.write_queue_peak.get() << ", queue_stalls=" << total.write_queue_stalls << endl;
+    }
+    if (impairment_config.active())
+        receiver_log << "[Receiver] Impairment: dropped=" << total.impair_dropped << ", duplicated=" << total.impair_duplicated
+                     << ", delayed=" << total.impair_delayed << ", reordered=" << total.impair_reordered
+                     << ", corrupted=" << total.impair_corrupted << endl;
     receiver_log << "[Receiver] Duration=" << secs << "s, Throughput=" << throughput
                  << " B/s (" << (throughput * 8 / 1e6) << " Mbps)\n";
 }
 
+// Prometheus text for the stats file, one labelled sample per receive thread
+string render_metrics() {
+    PromText p;
+    auto counter = [&](const char *name, const char *help, Counter ThreadStats::*field) {
+        p.family(name, "counter", help);
+        for (auto &tp : thread_stats) p.sample(name, "thread=\"" + to_string(tp->thread_no) + "\"", ((*tp).*field).get());
+    };
+    auto histogram = [&](const char *name, const char *help, Histogram ThreadStats::*field) {
+        p.family(name, "histogram", help);
+        for (auto &tp : thread_stats) p.histogram(name, "thread=\"" + to_string(tp->thread_no) + "\"", (*tp).*field);
+    };
+    size_t active;
+    {
+        lock_guard<mutex> g(sessions_mtx);
+        active = sessions.size();
+    }
+    p.family("receiver_sessions_active", "gauge", "Transfers in progress");
+    p.sample("receiver_sessions_active", "", (uint64_t)active);
+    p.family("receiver_sessions_total", "counter", "Transfers that are over, by how they ended");
+    p.sample("receiver_sessions_total", "end=\"finished\"", sessions_finished.load());
+    p.sample("receiver_sessions_total", "end=\"evicted\"", sessions_evicted.load());
+    p.family("receiver_sessions_refused_total", "counter", "FILE_HDRs turned away because max_sessions were open");
+    p.sample("receiver_sessions_refused_total", "", sessions_refused.load());
+    p.family("receiver_digest_mismatches_total", "counter", "Complete files whose digest differed from the sender's");
+    p.sample("receiver_digest_mismatches_total", "", sessions_corrupt.load());
+    counter("receiver_datagrams_total", "Datagrams received", &ThreadStats::datagrams);
+    counter("receiver_bytes_total", "Blast datagram bytes received", &ThreadStats::bytes);
+    counter("receiver_recv_calls_total", "recvfrom/recvmmsg calls that returned data", &ThreadStats::recv_calls);
+    counter("receiver_blast_rounds_total", "Blast rounds completed and answered with a REC_MISS", &ThreadStats::blasts);
+    counter("receiver_records_written_total", "Records written to the output file", &ThreadStats::written);
+    counter("receiver_records_lost_total", "Records dropped by the simulated per-record loss", &ThreadStats::lost);
+    counter("receiver_nack_datagrams_total", "REC_MISS datagrams sent", &ThreadStats::nack_datagrams);
+    counter("receiver_parity_received_total", "FEC parity datagrams received", &ThreadStats::parity_received);
+    counter("receiver_fec_recovered_total", "Records rebuilt from parity", &ThreadStats::fec_recovered);
+    counter("receiver_corrupt_datagrams_total", "Datagrams dropped for a bad header CRC", &ThreadStats::corrupt_datagrams);
+    counter("receiver_corrupt_records_total", "Records dropped for a bad CRC or an undecodable block, to be asked for again", &ThreadStats::corrupt_records);
+    counter("receiver_datagrams_decompressed_total", "Compressed data datagrams inflated", &ThreadStats::decompressed);
+    counter("receiver_early_nacks_total", "Rounds answered before all their datagrams arrived", &ThreadStats::early_nacks);
+    counter("receiver_lost_datagrams_total", "Data datagrams reported lost in early REC_MISSes", &ThreadStats::lost_datagrams);
+    counter("receiver_probes_total", "Retransmission timeout probes received", &ThreadStats::probes);
+    counter("receiver_reassembly_expired_total", "Blast reassembly states dropped after going stale", &ThreadStats::reassembly_expired);
+    p.family("receiver_blasts_incomplete", "gauge", "Blasts answered with a REC_MISS that still have records missing");
+    for (auto &tp : thread_stats) p.sample("receiver_blasts_incomplete", "thread=\"" + to_string(tp->thread_no) + "\"", tp->incomplete_blasts.get());
+    histogram("receiver_round_seconds", "Time from a blast round's first datagram to its REC_MISS", &ThreadStats::round_time);
+    histogram("receiver_write_seconds", "Latency of one pwrite to the output file", &ThreadStats::write_latency);
+    if (num_writers) {
+        p.family("receiver_write_queue_bytes", "gauge", "Bytes queued in a receive thread's write ring");
+        for (size_t i = 0; i < write_rings.size(); ++i) p.sample("receiver_write_queue_bytes", "thread=\"" + to_string(i) + "\"", (uint64_t)write_rings[i]->used());
+        p.family("receiver_write_queue_capacity_bytes", "gauge", "Size of each write ring");
+        p.sample("receiver_write_queue_capacity_bytes", "", (uint64_t)write_rings[0]->capacity());
+        counter("receiver_write_queue_stalls_total", "Times a receive thread waited for room in its write ring", &ThreadStats::write_queue_stalls);
+        auto writer_counter = [&](const char *name, const char *help, Counter WriterStats::*field) {
+            p.family(name, "counter", help);
+            for (auto &wp : writer_stats) p.sample(name, "writer=\"" + to_string(wp->writer_no) + "\"", ((*wp).*field).get());
+        };
+        writer_counter("receiver_writer_calls_total", "pwritev calls by a writer thread", &WriterStats::calls);
+        writer_counter("receiver_writer_bytes_total", "Bytes written by a writer thread", &WriterStats::bytes);
+        writer_counter("receiver_writer_direct_bytes_total", "Bytes written with O_DIRECT", &WriterStats::direct_bytes);
+        writer_counter("receiver_writer_syncs_total", "fdatasync calls by a writer thread", &WriterStats::syncs);
+        p.family("receiver_writer_seconds", "histogram", "Latency of one coalesced pwritev");
+        for (auto &wp : writer_stats) p.histogram("receiver_writer_seconds", "writer=\"" + to_string(wp->writer_no) + "\"", wp->write_latency);
+    }
+    return p.str();
+}
+
+// Binds the socket of receive thread i: the shared port through SO_REUSEPORT, or a port of its own
+int open_receive_socket(uint32_t i) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    int one = 1;
+    if (num_threads > 1 && !separate_ports && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+    // Ask for a large buffer; the kernel caps it at net.core.rmem_max
+    socklen_t optlen = sizeof(rcvbuf_bytes);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_request, sizeof(rcvbuf_request));
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_bytes, &optlen);
+
+    sockaddr_in addr{}; addr.sin_family = AF_INET; addr.sin_port = htons(9000 + (separate_ports ? i : 0)); addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(fd); return -1; }
+
+    // A blocked receive has to wake up now and then to see the transfer is over or the receiver is
+    // being stopped; with delayed datagrams queued it has to wake up for them as well
+    struct timeval tv = {0, (suseconds_t)(receive_timeout_ns() / 1000)};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (use_gro && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        receiver_log(LogLevel::Warn) << "[Receiver] UDP_GRO unavailable (" << strerror(errno) << "), receiving unsegmented" << endl;
+        use_gro = false;
+    }
+    return fd;
+}
+
+void request_stop(int) { done_receiving = true; }
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) { cerr << "Usage: ./receiver <packet_loss_percent>\n"; return 1; }
-    packet_loss_percent = stod(argv[1]);
+    vector<string> args;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--batch" && i + 1 < argc) recv_batch = max(1, stoi(argv[++i]));
+        else if (a == "--gro") use_gro = true;
+        else if (a == "--io-uring") use_uring = true;
+        else if (a == "--uring-depth" && i + 1 < argc) uring_depth = max(1, min(1024, stoi(argv[++i])));
+        else if (a == "--json-nack") json_nack = true;
+        else if (a == "--nack-delay" && i + 1 < argc) nack_delay_ns = (int64_t)(max(0.0, stod(argv[++i])) * 1e6);
+        else if (a == "--seed" && i + 1 < argc) { seeded = true; seed = stoull(argv[++i]); }
+        else if (a == "--loss" && i + 1 < argc) {
+            if (!impairment_config.parse_loss(argv[++i])) { cerr << "Invalid --loss, expected bernoulli:P or ge:P_GB:P_BG:LOSS_BAD[:LOSS_GOOD]\n"; return 1; }
+        }
+        else if (a == "--delay" && i + 1 < argc) impairment_config.delay_ms = stod(argv[++i]);
+        else if (a == "--jitter" && i + 1 < argc) impairment_config.jitter_ms = stod(argv[++i]);
+        else if (a == "--reorder" && i + 1 < argc) impairment_config.reorder_pct = stod(argv[++i]);
+        else if (a == "--duplicate" && i + 1 < argc) impairment_config.duplicate_pct = stod(argv[++i]);
+        else if (a == "--corrupt" && i + 1 < argc) impairment_config.corrupt_pct = stod(argv[++i]);
+        else if (a == "--rcvbuf" && i + 1 < argc) rcvbuf_request = max(4096, stoi(argv[++i]));
+        else if (a == "--threads" && i + 1 < argc) num_threads = max(1, stoi(argv[++i]));
+        else if (a == "--separate-ports") separate_ports = true;
+        else if (a == "--pin-cpus") pin_cpus = true;
+        else if (a == "--log-level" && i + 1 < argc) {
+            LogLevel level;
+            if (!parse_log_level(argv[++i], level)) { cerr << "Unknown log level: " << argv[i] << "\n"; return 1; }
+            receiver_log.set_level(level);
+        }
+        else if (a == "--no-trace") trace_enabled = false;
+        else if (a == "--stats" && i + 1 < argc) stats_path = argv[++i];
+        else if (a == "--stats-interval" && i + 1 < argc) stats_interval = chrono::milliseconds(max(10, stoi(argv[++i])));
+        else if (a == "--daemon") daemon_mode = true;
+        else if (a == "--output-dir" && i + 1 < argc) output_dir = argv[++i];
+        else if (a == "--max-sessions" && i + 1 < argc) max_sessions = max(1, min(UINT16_MAX, stoi(argv[++i])));
+        else if (a == "--idle-timeout" && i + 1 < argc) idle_timeout = chrono::seconds(max(1, stoi(argv[++i])));
+        else if (a == "--checkpoint-interval" && i + 1 < argc) checkpoint_interval = chrono::seconds(max(0, stoi(argv[++i])));
+        else if (a == "--sign-threads" && i + 1 < argc) sign_threads = max(0, stoi(argv[++i]));
+        else if (a == "--writers" && i + 1 < argc) num_writers = max(0, stoi(argv[++i]));
+        else if (a == "--write-queue" && i + 1 < argc) write_queue_bytes = (size_t)max(1, stoi(argv[++i])) << 20;
+        else if (a == "--direct-io") direct_io = true;
+        else if (a == "--fdatasync") sync_writes = true;
+        else args.push_back(a);
+    }
+    if (args.size() != 1) {
+        cerr << "Usage: ./receiver <packet_loss_percent> [--batch <datagrams_per_call>] [--gro] [--json-nack] [--nack-delay <ms>]\n"
+                "       [--io-uring] [--uring-depth <buffers>]\n"
+                "       [--seed <N>] [--loss bernoulli:P|ge:P_GB:P_BG:LOSS_BAD[:LOSS_GOOD]] [--delay <ms>] [--jitter <ms>]\n"
+                "       [--reorder <percent>] [--duplicate <percent>] [--corrupt <percent>]\n"
+                "       [--rcvbuf <bytes>] [--threads <N>] [--separate-ports] [--pin-cpus] [--log-level error|warn|info|debug] [--no-trace]\n"
+                "       [--stats <file>] [--stats-interval <ms>]\n"
+                "       [--daemon] [--output-dir <dir>] [--max-sessions <N>] [--idle-timeout <seconds>]\n"
+                "       [--checkpoint-interval <seconds>] [--sign-threads <N>]\n"
+                "       [--writers <N>] [--write-queue <MiB>] [--direct-io] [--fdatasync]\n";
+        return 1;
+    }
+    packet_loss_percent = stod(args[0]);
+    if (!max_sessions) max_sessions = daemon_mode ? 1024 : 1;
 
-    receiver_log.open("receiver.log", ios::out | ios::trunc);
-    receiver_log.setf(ios::unitbuf);
+    receiver_log.open("receiver.log");
     receiver_log << "[Receiver] Started with packet_loss_percent=" << packet_loss_percent << endl;
+    if (impairment_config.active()) {
+        const Impairment &im = impairment_config;
+        stringstream loss;
+        if (im.gilbert_elliott) loss << "ge(" << im.p_good_bad << "%," << im.p_bad_good << "%," << im.loss_bad << "%," << im.loss_good << "%)";
+        else loss << im.loss_pct << "%";
+        receiver_log << "[Receiver] Impairment: loss=" << loss.str() << ", delay=" << im.delay_ms << "ms, jitter=" << im.jitter_ms << "ms, reorder=" << im.reorder_pct
+                     << "%, duplicate=" << im.duplicate_pct << "%, corrupt=" << im.corrupt_pct << "%, seed=" << (seeded ? to_string(seed) : "random") << endl;
+    }
+    if (trace_enabled && !receiver_trace.open("receiver.trace")) cerr << "Unable to open receiver.trace for writing\n";
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    sockaddr_in addr{}; addr.sin_family = AF_INET; addr.sin_port = htons(9000); addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(sockfd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
+    if (daemon_mode) {
+        struct stat st;
+        if (stat(output_dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+            cerr << "Output directory " << output_dir << " does not exist\n";
+            return 1;
+        }
+        receiver_log << "[Receiver] Serving up to " << max_sessions << " sessions into " << output_dir
+                     << ", idle timeout " << idle_timeout.count() << "s" << endl;
+    }
+
+    vector<int> fds;
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        int fd = open_receive_socket(i);
+        if (fd < 0) return 1;
+        fds.push_back(fd);
+    }
+    receiver_log << "[Receiver] Socket receive buffer: " << rcvbuf_bytes << " bytes" << endl;
+    if (num_threads > 1)
+        receiver_log << "[Receiver] Receiving on " << num_threads << " threads ("
+                     << (separate_ports ? "separate ports" : "SO_REUSEPORT") << ")" << endl;
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        thread_stats.push_back(make_unique<ThreadStats>());
+        thread_stats.back()->thread_no = i;
+    }
+    // Writers start first and stop last, so every ring has a consumer while it has a producer
+    vector<thread> writers;
+    if (num_writers) {
+        num_writers = min(num_writers, num_threads);
+        for (uint32_t i = 0; i < num_threads; ++i) {
+            write_rings.push_back(make_unique<SpscRing>());
+            if (!write_rings.back()->init(write_queue_bytes, direct_io ? DIRECT_ALIGN : 64)) {
+                cerr << "Cannot allocate a " << (write_queue_bytes >> 20) << " MiB write queue\n";
+                return 1;
+            }
+        }
+        for (uint32_t i = 0; i < num_writers; ++i) {
+            writer_stats.push_back(make_unique<WriterStats>());
+            writer_stats.back()->writer_no = i;
+        }
+        for (uint32_t i = 0; i < num_writers; ++i) writers.emplace_back(writer_thread, i);
+        receiver_log << "[Receiver] Writing through " << num_writers << " writer thread(s), " << (write_queue_bytes >> 20)
+                     << " MiB queue per receive thread" << (direct_io ? ", O_DIRECT where aligned" : "")
+                     << (sync_writes ? ", fdatasync per batch" : "") << endl;
+    }
 
-    network_receiver_thread();
-    close(sockfd);
-    return 0;
+    if (!stats_path.empty()) {
+        if (stats_file.start(stats_path, stats_interval, render_metrics))
+            receiver_log << "[Receiver] Writing live stats to " << stats_path << " every " << stats_interval.count() << " ms" << endl;
+        else receiver_log(LogLevel::Warn) << "[Receiver] Cannot write stats file " << stats_path << endl;
+    }
+
+    vector<thread> threads;
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        threads.emplace_back(network_receiver_thread, fds[i], i);
+        if (pin_cpus) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % max(1u, thread::hardware_concurrency()), &set);
+            int err = pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+            if (err) receiver_log(LogLevel::Warn) << "[Receiver] Could not pin thread " << i << ": " << strerror(err) << endl;
+        }
+    }
+    // Meanwhile the main thread checkpoints the open sessions and, as a daemon, evicts idle ones
+    auto next_checkpoint = chrono::steady_clock::now() + checkpoint_interval;
+    while (!done_receiving) {
+        this_thread::sleep_for(chrono::milliseconds(50));
+        if (daemon_mode) reap_idle_sessions();
+        if (checkpoint_interval.count() && chrono::steady_clock::now() >= next_checkpoint) {
+            for (auto &ss : live_sessions()) checkpoint_session(*ss);
+            next_checkpoint = chrono::steady_clock::now() + checkpoint_interval;
+        }
+    }
+    for (auto &t : threads) t.join();
+    writers_stop.store(true, memory_order_release);
+    for (auto &t : writers) t.join();
+    stats_file.stop();
+
+    // Whatever is still open when the daemon stops keeps a checkpoint, so its sender can resume
+    vector<shared_ptr<Session>> unfinished = live_sessions();
+    if (!unfinished.empty())
+        receiver_log(LogLevel::Warn) << "[Receiver] Stopping with " << unfinished.size() << " sessions unfinished" << endl;
+    for (auto &ss : unfinished) close_session(*ss, "stopped");
+    unfinished.clear();
+
+    // Final stats
+    if (daemon_mode)
+        receiver_log << "[Receiver] Sessions: finished=" << sessions_finished << ", evicted=" << sessions_evicted
+                     << ", refused=" << sessions_refused << ", digest_mismatches=" << sessions_corrupt << endl;
+    log_summary();
+    receiver_trace.close();
+    if (trace_enabled)
+        receiver_log << "[Receiver] Trace: entries=" << receiver_trace.written_entries() << ", dropped=" << receiver_trace.dropped_entries() << endl;
+    receiver_log.close();
+    for (int fd : fds) close(fd);
+    return sessions_corrupt ? 1 : 0;
 }
@@ -2,295 +2,1740 @@
 #include <bits/stdc++.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include "protocol.h"
+#include "pacing.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "xxh64.h"
+#include "fec.h"
+#include "log.h"
+#include "metrics.h"
+#include "uring.h"
 
 using namespace std;
 
-struct Segment {
-    uint32_t start;
-    uint32_t end;
-};
-
+// Record payloads are not copied into blasts; send_packet() reads them from the record store
 struct BlastPacket {
     uint32_t num_segments;
     vector<Segment> segments;
-    vector<char> data;
+    vector<uint32_t> crcs;      // CRC32C of each record, alongside segments (with checksums on)
+    // With compression on: each data datagram's records as an LZ block, one records_per_packet *
+    // record_size slot per datagram, and its compressed size (0: the datagram goes out raw)
+    vector<char> zbuf;
+    vector<uint32_t> zlen;
 };
 
-struct FileHeader {
-    uint32_t file_size;
-    uint32_t record_size;
-    uint32_t M;
+// A blast that has been sent but whose REC_MISS round trip is not finished yet
+struct InFlightBlast {
+    BlastPacket *pkt;
+    chrono::steady_clock::time_point deadline;  // when the next probe goes out (the RTO, backed off)
+    uint32_t rounds;
+    chrono::steady_clock::time_point first_sent;
+    // The round currently awaiting its REC_MISS, for RTT and loss-fraction feedback: its data
+    // datagrams and, for retransmission rounds, its records in datagram order (round 0 is the blast's
+    // own), so lost datagrams a REC_MISS names can be turned back into records
+    chrono::steady_clock::time_point round_sent;
+    uint32_t round_datagrams;
+    uint32_t round_records;
+    uint32_t round_chunks;
+    vector<Segment> round_segments;
+    uint32_t probes = 0;        // sent for the current round; its RTT sample is ambiguous once there is one
+    // Parts of the binary REC_MISS currently being collected
+    uint16_t nack_seq = 0;
+    vector<bool> nack_parts;
+    vector<pair<uint32_t,uint32_t>> nack_ranges;
+    vector<uint32_t> nack_chunks;
 };
 
-mutex mtx;
-condition_variable cv;
-queue<BlastPacket> blast_queue;
-bool done_reading = false;
-
 FileHeader negotiated_header;
 
-int sockfd;
-struct sockaddr_in receiver_addr;
-
-// Sender log file
-static std::ofstream sender_log;
-
-// Performance counters
-uint64_t total_logical_blasts_sent = 0;
-uint64_t total_packets_sent = 0;
-uint64_t total_bytes_sent = 0;
-uint64_t total_rec_miss_msgs = 0;
-uint64_t total_missing_records_reported = 0;
-chrono::steady_clock::time_point send_start_time;
-chrono::steady_clock::time_point send_end_time;
-
-void disk_read_thread(const string &filename) {
-    ifstream fin(filename, ios::binary);
-    if (!fin) {
-        sender_log << "[DiskRead] Cannot open file: " << filename << endl;
-        done_reading = true;
-        cv.notify_one();
+// Resume: records the receiver already holds from an earlier attempt at this file, which the
+// readers skip. Filled in from the RESUME replies before any stream starts.
+bool resume_enabled = true;
+bool resuming = false;
+RecordBitmap held_records;
+uint64_t records_held = 0;
+
+// Delta (--delta, HDR_DELTA): the receiver signs the copy of the file it already has, a block of
+// records_per_packet records per hash, and the blocks that hash the same here are skipped like held
+// records. file_id then fingerprints the path, so every version of a file meets the same copy.
+bool delta_enabled = false;
+
+// Integrity: a CRC32C per record and per datagram, and the whole-file digest in DISCONNECT
+// (HDR_CHECKSUMS). The readers checksum each record as they fault it in, so the network threads
+// only ever checksum headers and parity.
+bool checksums_enabled = true;
+
+// Compression (--compress, HDR_COMPRESSION): the readers compress each blast's datagrams as LZ blocks
+// on compress_threads workers before queueing it. The first datagram is a sample; unless it shrinks
+// by at least 1/8 the blast goes out raw, so incompressible data costs one datagram's worth of work.
+// Retransmissions and parity are always raw.
+bool compress_enabled = false;
+uint32_t compress_threads = 2;
+
+// Number of blasts allowed in flight at once (1 = stop-and-wait per blast)
+uint32_t window_blasts = 1;
+// A round whose REC_MISS has not come within the RTO is probed (PKT_PROBE), with the RTO doubled for
+// every probe that goes unanswered; after max_probes of them the blast is given up
+const uint32_t max_probes = 8;
+
+// Batched send: datagrams per sendmmsg call (1 = one sendto per datagram) and UDP GSO offload
+uint32_t send_batch = 1;
+bool use_gso = false;
+// Submit each batch through io_uring (one linked SENDMSG per message, socket as a fixed file)
+// instead of sendmmsg; falls back to sendmmsg where io_uring is unavailable
+bool use_uring = false;
+
+// Forward error correction: K XOR parity datagrams per group of N data datagrams (0 = off).
+// With fec_adaptive, K follows the loss estimate.
+uint32_t fec_n = 0, fec_k = 0;
+bool fec_adaptive = false;
+
+// Pacing: off (back-to-back), aimd (rate from cwnd / srtt), or a fixed --rate shared by all streams
+enum class PacingMode { Off, Aimd, Fixed };
+PacingMode pacing_mode = PacingMode::Off;
+double fixed_rate = 0;          // bytes per second
+double loss_tolerance = 0.01;
+
+// Multi-stream transfer: the record space is split into num_streams contiguous ranges, each sent
+// over its own socket by its own threads. With separate_ports stream s targets port 9000 + s,
+// otherwise all streams share port 9000 and the receiver spreads them with SO_REUSEPORT.
+uint32_t num_streams = 1;
+bool separate_ports = false;
+bool pin_cpus = false;
+
+// Read-ahead: each stream has a fixed pool of window_blasts + queue_blasts blast buffers, optionally
+// capped so the file data they pin stays within queue_memory bytes across all streams (0 = no cap).
+// The reader waits for a buffer to come back before reading further.
+uint32_t queue_blasts = 4;
+size_t queue_memory = 0;
+
+// Packet layout: chosen from the path MTU (probed, or --mtu) unless given explicitly, then settled
+// with the receiver in the FILE_HDR handshake. Datagrams are sent with DF set so the kernel never
+// fragments them, unless --allow-fragmentation opts into IP fragmentation for jumbo setups.
+uint32_t opt_mtu = 0, opt_record_size = 0, opt_records_per_packet = 0, opt_blast_records = 0;
+bool allow_fragmentation = false;
+
+// Sender text log, written by every stream, and the binary per-packet trace
+static SharedLog sender_log;
+static TraceLog sender_trace;
+bool trace_enabled = true;
+
+// Live metrics in Prometheus text, rewritten every stats_interval while the transfer runs (--stats)
+string stats_path;
+chrono::milliseconds stats_interval(1000);
+StatsFile stats_file;
+
+// One stream of a transfer: its socket, its slice of the record space, its blast queue and window,
+// and its own pacing, congestion state and counters
+struct Stream {
+    uint32_t id = 0;
+    uint32_t first_record = 0, end_record = 0; // [first_record, end_record)
+
+    int sockfd = -1;
+    struct sockaddr_in receiver_addr;
+
+    // Blast buffers, preallocated for M records each. The reader fills free ones and queues them;
+    // the network thread hands each back once its blast is acknowledged or given up.
+    mutex mtx;
+    condition_variable cv, free_cv;
+    vector<BlastPacket> blast_buffers;
+    vector<BlastPacket *> free_blasts;
+    queue<BlastPacket *> blast_queue;
+    bool done_reading = false;
+    BlastPacket retrans_pkt;    // scratch for retransmission rounds
+    uint64_t digest = 0;        // record_digest() sum of the records read, complete once done_reading
+
+    map<uint32_t, InFlightBlast> in_flight;
+    bool use_gso = false;
+    unique_ptr<IoUring> ring;
+    uint32_t fec_k = 0, fec_clean_rounds = 0;
+    Pacer pacer;
+    CongestionControl cc;
+    uint64_t inflight_datagrams = 0;
+
+    // Performance counters, readable by the stats writer while the stream runs
+    Counter total_logical_blasts_sent;
+    Counter total_packets_sent;
+    Counter total_bytes_sent;
+    Counter total_rec_miss_msgs;
+    Counter total_missing_records_reported;
+    Counter total_retransmit_rounds;
+    Counter total_send_syscalls;
+    Counter total_parity_packets_sent;
+    Counter compress_in_bytes, compress_out_bytes, blasts_incompressible;
+    Counter total_probes, total_lost_datagrams_reported, total_blasts_given_up;
+
+    // Live state and latencies: REC_MISS round trip of each round, the time from a REC_MISS to its
+    // retransmission being out, blast completion (first datagram to final REC_MISS), rounds per
+    // blast, and how long the reader waited for each blast's records to come off the disk
+    Gauge queue_depth, in_flight_blasts, cwnd, srtt, rto, pacing_rate, loss_estimate;
+    Histogram rtt, rec_miss_turnaround, blast_completion, disk_read;
+    Histogram rounds{ROUND_BOUNDS};
+    chrono::steady_clock::time_point send_start_time;
+    chrono::steady_clock::time_point send_end_time;
+};
+
+vector<unique_ptr<Stream>> streams;
+
+// Read-only, mmap-backed view of the input file addressed by record number. Shared by the
+// blast builder and the retransmitter, so neither has to read or copy record data.
+class RecordStore {
+public:
+    bool open(const string &filename, uint32_t record_size) {
+        rec_size = record_size;
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0) return false;
+        size = (size_t)st.st_size;
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) return false;
+            base = (const char *)p;
+            madvise(p, size, MADV_SEQUENTIAL);
+        }
+        // The last record may be short; keep a zero-padded copy so every record is rec_size long
+        size_t tail_len = size % rec_size;
+        if (tail_len) {
+            tail.assign(rec_size, 0);
+            memcpy(tail.data(), base + size - tail_len, tail_len);
+        }
+        return true;
+    }
+
+    const char *record(uint32_t r) const {
+        size_t off = (size_t)r * rec_size;
+        if (off + rec_size <= size) return base + off;
+        return tail.data();
+    }
+
+    // Asks the kernel to start reading a run of records ahead of the network thread
+    void prefetch(uint32_t first, uint32_t count) const {
+        if (!base) return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t off = (size_t)first * rec_size / page * page;
+        size_t end = min(size, (size_t)(first + count) * rec_size);
+        if (off < end) madvise((void *)(base + off), end - off, MADV_WILLNEED);
+    }
+
+    // Faults a run of records into memory, so the network thread never stalls on the disk
+    void load(uint32_t first, uint32_t count) const {
+        if (!base) return;
+        prefetch(first, count);
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t end = min(size, (size_t)(first + count) * rec_size);
+        for (size_t off = (size_t)first * rec_size / page * page; off < end; off += page)
+            (void)*(volatile const char *)(base + off);
+    }
+
+    // Drops the mapping of a run of records that is no longer needed, so acknowledged data stops
+    // counting against our memory; the page cache keeps it if anything still needs to touch it
+    void release(uint32_t first, uint32_t count) const {
+        if (!base) return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t off = ((size_t)first * rec_size + page - 1) / page * page;
+        size_t end = min(size, (size_t)(first + count) * rec_size) / page * page;
+        if (off < end) madvise((void *)(base + off), end - off, MADV_DONTNEED);
+    }
+
+    uint32_t total_records() const { return (uint32_t)((size + rec_size - 1) / rec_size); }
+
+    // The file as it is, without record padding
+    const char *bytes(uint64_t offset) const { return base + offset; }
+
+    ~RecordStore() {
+        if (base) munmap((void *)base, size);
+        if (fd >= 0) ::close(fd);
+    }
+
+private:
+    int fd = -1;
+    const char *base = nullptr;
+    size_t size = 0;
+    uint32_t rec_size = 0;
+    vector<char> tail;
+};
+
+RecordStore record_store;
+
+// Next record at or after r that the receiver does not hold yet
+uint32_t next_unheld(uint32_t r, uint32_t end) {
+    if (!resuming || r >= end) return r;
+    return held_records.next_clear(r, end - 1);
+}
+
+// Worker threads shared by all streams' readers. parallel_for() runs on the caller too, so with no
+// workers, or all of them busy with another stream, a blast is still compressed by its own reader.
+class CompressPool {
+public:
+    void start(uint32_t n) {
+        for (uint32_t i = 0; i < n; ++i) workers.emplace_back([this] { run(); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> g(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers) t.join();
+        workers.clear();
+    }
+
+    // Calls fn(i) for every i in [0, count) and returns once all calls have finished
+    void parallel_for(uint32_t count, const function<void(uint32_t)> &fn) {
+        auto job = make_shared<Job>();
+        job->count = count;
+        job->fn = &fn;
+        if (!workers.empty() && count > 1) {
+            {
+                lock_guard<mutex> g(mtx);
+                jobs.push_back(job);
+            }
+            cv.notify_all();
+        }
+        work(*job);
+        unique_lock<mutex> lock(mtx);
+        done_cv.wait(lock, [&] { return job->done.load() == job->count; });
+        auto it = find(jobs.begin(), jobs.end(), job);
+        if (it != jobs.end()) jobs.erase(it);
+    }
+
+private:
+    struct Job {
+        uint32_t count = 0;
+        const function<void(uint32_t)> *fn = nullptr;
+        atomic<uint32_t> next{0}, done{0};
+    };
+
+    void work(Job &job) {
+        for (uint32_t i; (i = job.next++) < job.count;) {
+            (*job.fn)(i);
+            if (++job.done == job.count) {
+                lock_guard<mutex> g(mtx);
+                done_cv.notify_all();
+            }
+        }
+    }
+
+    void run() {
+        unique_lock<mutex> lock(mtx);
+        for (;;) {
+            cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            shared_ptr<Job> job = jobs.front();
+            if (job->next.load() >= job->count) {
+                jobs.pop_front();
+                continue;
+            }
+            lock.unlock();
+            work(*job);
+            lock.lock();
+        }
+    }
+
+    vector<thread> workers;
+    mutex mtx;
+    condition_variable cv, done_cv;
+    deque<shared_ptr<Job>> jobs;
+    bool stopping = false;
+};
+
+CompressPool compress_pool;
+
+// Compresses a blast's data datagrams into pkt.zbuf, as send_packet() will cut them. A datagram
+// is left raw (zlen 0) unless compressing saves something; the whole blast is left raw when the
+// first datagram does not save at least 1/8.
+void compress_blast(Stream &st, BlastPacket &pkt) {
+    const uint32_t rpp = negotiated_header.records_per_packet;
+    const size_t rec_size = negotiated_header.record_size, slot = (size_t)rpp * rec_size;
+    uint32_t datagrams = (pkt.num_segments + rpp - 1) / rpp;
+    pkt.zlen.assign(datagrams, 0);
+
+    auto compress = [&](uint32_t d, size_t saving) {
+        uint32_t first = d * rpp, n = min<uint32_t>(rpp, pkt.num_segments - first);
+        size_t raw = (size_t)n * rec_size;
+        // Records are compressed in place when they sit back to back in the mapping
+        const char *src = record_store.record(pkt.segments[first].start);
+        for (uint32_t i = 1; i < n && src; ++i)
+            if (record_store.record(pkt.segments[first + i].start) != src + i * rec_size) src = nullptr;
+        thread_local vector<char> gather;
+        if (!src) {
+            gather.resize(raw);
+            for (uint32_t i = 0; i < n; ++i)
+                memcpy(gather.data() + i * rec_size, record_store.record(pkt.segments[first + i].start), rec_size);
+            src = gather.data();
+        }
+        pkt.zlen[d] = (uint32_t)lz_compress(src, raw, pkt.zbuf.data() + d * slot, raw - max<size_t>(1, raw / saving));
+    };
+
+    size_t raw_total = (size_t)pkt.num_segments * rec_size;
+    compress(0, 8);
+    if (!pkt.zlen[0]) {
+        pkt.zlen.clear();
+        st.blasts_incompressible++;
+        st.compress_in_bytes += raw_total;
+        st.compress_out_bytes += raw_total;
         return;
     }
+    if (datagrams > 1) compress_pool.parallel_for(datagrams - 1, [&](uint32_t i) { compress(i + 1, 16); });
 
-    uint32_t record_size = negotiated_header.record_size;
+    size_t out = 0;
+    for (uint32_t d = 0; d < datagrams; ++d)
+        out += pkt.zlen[d] ? pkt.zlen[d] : (size_t)min<uint32_t>(rpp, pkt.num_segments - d * rpp) * rec_size;
+    st.compress_in_bytes += raw_total;
+    st.compress_out_bytes += out;
+}
+
+void disk_read_thread(Stream &st) {
     uint32_t M = negotiated_header.M;
-    uint32_t total_records = (negotiated_header.file_size + record_size - 1) / record_size;
-    uint32_t record_no = 0;
+    uint32_t total_records = st.end_record;
+    uint32_t record_no = next_unheld(st.first_record, total_records);
 
     while (record_no < total_records) {
-        BlastPacket pkt;
-        pkt.num_segments = 0;
-        pkt.data.clear();
-        uint32_t records_in_this_blast = min(M, total_records - record_no);
-
-        for (uint32_t i = 0; i < records_in_this_blast; ++i) {
-            vector<char> rec(record_size);
-            fin.read(rec.data(), record_size);
-            if ((size_t)fin.gcount() < record_size) {
-                size_t got = (size_t)fin.gcount();
-                fill(rec.begin() + got, rec.end(), 0);
+        BlastPacket *pkt;
+        {
+            unique_lock<mutex> lock(st.mtx);
+            st.free_cv.wait(lock, [&st] { return !st.free_blasts.empty(); });
+            pkt = st.free_blasts.back();
+            st.free_blasts.pop_back();
+        }
+        pkt->segments.clear();
+        pkt->crcs.clear();
+        pkt->num_segments = 0;
+        // A blast is M records; when resuming, the held ones are skipped and a blast gathers runs
+        // of missing records from further on
+        auto read_start = chrono::steady_clock::now();
+        while (pkt->num_segments < M && record_no < total_records) {
+            uint32_t run_end = resuming ? held_records.next_set(record_no, total_records - 1) : total_records;
+            uint32_t run = min(M - pkt->num_segments, run_end - record_no);
+            record_store.load(record_no, run);
+            for (uint32_t i = 0; i < run; ++i) {
+                pkt->segments.push_back({record_no, record_no});
+                if (checksums_enabled) {
+                    uint32_t crc = crc32c(0, record_store.record(record_no), negotiated_header.record_size);
+                    pkt->crcs.push_back(crc);
+                    st.digest += record_digest(record_no, crc);
+                }
+                pkt->num_segments++;
+                record_no++;
             }
-            pkt.segments.push_back({record_no, record_no});
-            pkt.num_segments++;
-            pkt.data.insert(pkt.data.end(), rec.begin(), rec.end());
-            record_no++;
+            record_no = next_unheld(record_no, total_records);
         }
+        st.disk_read.observe(chrono::steady_clock::now() - read_start);
+        if (compress_enabled) compress_blast(st, *pkt);
 
         {
-            unique_lock<mutex> lock(mtx);
-            blast_queue.push(std::move(pkt));
+            unique_lock<mutex> lock(st.mtx);
+            st.blast_queue.push(pkt);
+            st.queue_depth.set(st.blast_queue.size());
         }
-        cv.notify_one();
+        st.cv.notify_one();
+    }
+
+    {
+        unique_lock<mutex> lock(st.mtx);
+        st.done_reading = true;
+    }
+    st.cv.notify_one();
+}
+
+// One wire datagram: iov[0] is its header + segment table, the rest point into the record store
+// (or, for parity, into the blast's parity buffer)
+struct Datagram {
+    uint32_t packet;
+    bool parity;
+    size_t size;
+    vector<iovec> iov;
+};
+
+// sendmmsg through io_uring. The messages are linked so they leave in order and a failure cancels
+// the rest, and the whole batch is submitted and reaped with one io_uring_enter. Returns how many
+// leading messages went out, or -1 with errno set if the first one failed.
+int uring_sendmmsg(Stream &st, vector<mmsghdr> &msgs) {
+    IoUring &ring = *st.ring;
+    size_t n = min<size_t>(msgs.size(), ring.capacity());
+    for (size_t m = 0; m < n; ++m) {
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = 0;    // the stream socket, registered as fixed file 0
+        sqe->flags = IOSQE_FIXED_FILE | (m + 1 < n ? IOSQE_IO_LINK : 0);
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[m].msg_hdr;
+        sqe->len = 1;
+        sqe->user_data = m;
     }
+    int r = ring.submit((unsigned)n);
+    if (r < 0) { errno = -r; return -1; }
 
-    done_reading = true;
-    cv.notify_one();
+    vector<int> res(n, -ECANCELED);
+    size_t reaped = 0;
+    io_uring_cqe cqe;
+    while (reaped < n) {
+        if (!ring.pop_cqe(cqe)) { ring.submit(1); continue; }
+        if (cqe.user_data < n) res[cqe.user_data] = cqe.res;
+        reaped++;
+    }
+    size_t sent = 0;
+    while (sent < n && res[sent] >= 0) sent++;
+    if (sent == 0) { errno = -res[0]; return -1; }
+    return (int)sent;
 }
 
-void send_packet(const BlastPacket &pkt, uint32_t logical_id) {
-    const uint32_t RECORDS_PER_PACKET = 16;
+// Sends one batch of prepared datagrams with sendmmsg (or io_uring). With GSO, a run of equal-sized datagrams
+// is glued into a single message and the kernel segments it (UDP_SEGMENT). Returns how many
+// datagrams the kernel accepted, or -1 on error.
+int send_batch_mmsg(Stream &st, const vector<Datagram> &dgrams, size_t first, uint32_t logical_id, uint32_t total_packets) {
+    const size_t MAX_GSO_BYTES = 65000, MAX_GSO_SEGMENTS = 64;
+    vector<mmsghdr> msgs;
+    vector<iovec> iovs;
+    vector<char> ctrl(send_batch * CMSG_SPACE(sizeof(uint16_t)), 0);
+    vector<size_t> dgrams_in_msg, iov_start;
+
+    size_t i = first;
+    while (i < dgrams.size() && msgs.size() < send_batch) {
+        size_t seg_size = dgrams[i].size, bytes = 0, count = 0;
+        iov_start.push_back(iovs.size());
+        do {
+            iovs.insert(iovs.end(), dgrams[i].iov.begin(), dgrams[i].iov.end());
+            bytes += dgrams[i].size;
+            count++; i++;
+            // Only the last segment of a GSO message may be shorter than the others
+        } while (st.use_gso && i < dgrams.size() && count < MAX_GSO_SEGMENTS &&
+                 dgrams[i].size <= seg_size && dgrams[i - 1].size == seg_size &&
+                 bytes + dgrams[i].size <= MAX_GSO_BYTES);
+        dgrams_in_msg.push_back(count);
+
+        mmsghdr m;
+        memset(&m, 0, sizeof(m));
+        m.msg_hdr.msg_name = &st.receiver_addr;
+        m.msg_hdr.msg_namelen = sizeof(st.receiver_addr);
+        if (st.use_gso && count > 1) {
+            char *c = ctrl.data() + msgs.size() * CMSG_SPACE(sizeof(uint16_t));
+            m.msg_hdr.msg_control = c;
+            m.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsghdr *cm = CMSG_FIRSTHDR(&m.msg_hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = (uint16_t)seg_size;
+            memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        }
+        msgs.push_back(m);
+    }
+    // iovs is complete now, so its storage no longer moves
+    for (size_t m = 0; m < msgs.size(); ++m) {
+        size_t iov_end = m + 1 < msgs.size() ? iov_start[m + 1] : iovs.size();
+        msgs[m].msg_hdr.msg_iov = &iovs[iov_start[m]];
+        msgs[m].msg_hdr.msg_iovlen = iov_end - iov_start[m];
+    }
+
+    size_t batch_bytes = 0;
+    for (size_t k = first; k < i; ++k) batch_bytes += dgrams[k].size;
+    st.pacer.wait(batch_bytes);
+
+    int sent = st.ring ? uring_sendmmsg(st, msgs) : sendmmsg(st.sockfd, msgs.data(), msgs.size(), 0);
+    if (sent < 0) {
+        st.pacer.refund(batch_bytes);
+        return -1;
+    }
+    st.total_send_syscalls++;
+
+    // A full socket buffer can take only part of the batch; the caller sends the rest again and is
+    // charged for it then
+    size_t done = 0, sent_bytes = 0;
+    for (int m = 0; m < sent; ++m) {
+        for (size_t k = 0; k < dgrams_in_msg[m]; ++k) {
+            const Datagram &d = dgrams[first + done + k];
+            st.total_packets_sent++;
+            st.total_bytes_sent += d.size;
+            sent_bytes += d.size;
+            if (d.parity) st.total_parity_packets_sent++;
+            sender_trace.record(d.parity ? TR_PARITY_SENT : TR_PACKET_SENT, d.packet, total_packets, logical_id, (uint32_t)d.size);
+        }
+        done += dgrams_in_msg[m];
+    }
+    st.pacer.refund(batch_bytes - sent_bytes);
+    return (int)done;
+}
+
+// Adds K parity datagrams to every group of N data datagrams. Parity slot s is the XOR of the
+// s-th record of each covered datagram; the coverage tables let the receiver place rebuilt records.
+// Parity goes out ahead of its group, so by the time a group's data is in, its parity is either
+// there or lost, and the receiver never has to hold a round open waiting for it.
+vector<Datagram> add_parity(Stream &st, vector<Datagram> &data, const BlastPacket &pkt, uint32_t logical_id, uint16_t round, uint32_t records_per_packet,
+                            vector<char> &parity_heads, vector<char> &parity_payload)
+{
+    size_t rec_size = negotiated_header.record_size;
+    uint32_t n = fec_n, k = st.fec_k;
+    uint32_t groups = ((uint32_t)data.size() + n - 1) / n;
+    size_t cover_max = (n + k - 1) / k;
+    size_t max_head = sizeof(PacketHeader) + cover_max * (sizeof(FecCoverEntry) + records_per_packet * sizeof(Segment));
+    size_t max_payload = (size_t)records_per_packet * rec_size;
+    parity_heads.assign((size_t)groups * k * max_head, 0);
+    parity_payload.assign((size_t)groups * k * max_payload, 0);
+
+    vector<Datagram> out;
+    out.reserve(data.size() + groups * k);
+    for (uint32_t g = 0; g < groups; ++g) {
+        uint32_t first = g * n, last = min<uint32_t>((uint32_t)data.size(), first + n);
+
+        for (uint32_t j = 0; j < k; ++j) {
+            uint32_t pidx = fec_parity_index(g, j, k);
+            char *head = parity_heads.data() + (size_t)pidx * max_head;
+            char *payload = parity_payload.data() + (size_t)pidx * max_payload;
+            size_t head_size = sizeof(PacketHeader);
+            uint32_t covered = 0, max_slots = 0;
+            for (uint32_t i = first + j; i < last; i += k) {
+                uint32_t start_idx = i * records_per_packet;
+                uint32_t nsegs = min<uint32_t>(records_per_packet, pkt.num_segments - start_idx);
+                FecCoverEntry ce = {i, nsegs};
+                memcpy(head + head_size, &ce, sizeof(ce));
+                memcpy(head + head_size + sizeof(ce), pkt.segments.data() + start_idx, nsegs * sizeof(Segment));
+                head_size += sizeof(ce) + nsegs * sizeof(Segment);
+                for (uint32_t slot = 0; slot < nsegs; ++slot)
+                    xor_into(payload + slot * rec_size, record_store.record(pkt.segments[start_idx + slot].start), rec_size);
+                covered++;
+                max_slots = max(max_slots, nsegs);
+            }
+            if (!covered) continue;
+
+            PacketHeader ph = {logical_id, pidx, (uint32_t)data.size(), covered, PKT_PARITY, (uint8_t)n, (uint8_t)k, round, (uint16_t)negotiated_header.session_id, 0};
+            memcpy(head, &ph, sizeof(ph));
+            if (checksums_enabled) {
+                ph.crc = crc32c(crc32c(0, head, head_size), payload, (size_t)max_slots * rec_size);
+                memcpy(head, &ph, sizeof(ph));
+            }
+            Datagram d;
+            d.packet = pidx;
+            d.parity = true;
+            d.size = head_size + (size_t)max_slots * rec_size;
+            d.iov = {{head, head_size}, {payload, (size_t)max_slots * rec_size}};
+            out.push_back(std::move(d));
+        }
+        for (uint32_t i = first; i < last; ++i) out.push_back(std::move(data[i]));
+    }
+    return out;
+}
+
+// Sends one round of a blast and returns how many datagrams it took
+uint32_t send_packet(Stream &st, const BlastPacket &pkt, uint32_t logical_id, uint16_t round) {
+    const uint32_t RECORDS_PER_PACKET = negotiated_header.records_per_packet;
     uint32_t total_packets = (pkt.num_segments + RECORDS_PER_PACKET - 1) / RECORDS_PER_PACKET;
     size_t rec_size = negotiated_header.record_size;
+    size_t header_size = sizeof(PacketHeader);
+    size_t crc_size = checksums_enabled ? sizeof(uint32_t) : 0;
+    size_t max_head = header_size + RECORDS_PER_PACKET * (sizeof(Segment) + crc_size);
+
+    // Headers for the whole blast live in one buffer; record payloads are referenced in place
+    vector<char> heads((size_t)total_packets * max_head);
+    vector<Datagram> dgrams(total_packets);
 
     for (uint32_t packet = 0; packet < total_packets; ++packet) {
         uint32_t start_idx = packet * RECORDS_PER_PACKET;
         uint32_t end_idx = min<uint32_t>((uint32_t)pkt.num_segments - 1, start_idx + RECORDS_PER_PACKET - 1);
         uint32_t num_segments_in_packet = end_idx - start_idx + 1;
 
-        size_t header_size = sizeof(uint32_t) * 4;
-        size_t packet_size = header_size + num_segments_in_packet * sizeof(Segment) + num_segments_in_packet * rec_size;
-        vector<char> send_buf(packet_size);
+        char *head = heads.data() + (size_t)packet * max_head;
+        size_t head_size = header_size + num_segments_in_packet * (sizeof(Segment) + crc_size);
+        bool compressed = packet < pkt.zlen.size() && pkt.zlen[packet];
+        PacketHeader ph = {logical_id, packet, total_packets, num_segments_in_packet, compressed ? PKT_COMPRESSED : (uint16_t)0,
+                           (uint8_t)fec_n, (uint8_t)st.fec_k, round, (uint16_t)negotiated_header.session_id, 0};
+        memcpy(head, &ph, header_size);
+        memcpy(head + header_size, pkt.segments.data() + start_idx, num_segments_in_packet * sizeof(Segment));
+        if (checksums_enabled) {
+            memcpy(head + header_size + num_segments_in_packet * sizeof(Segment), pkt.crcs.data() + start_idx, num_segments_in_packet * crc_size);
+            ph.crc = crc32c(0, head, head_size);
+            memcpy(head, &ph, header_size);
+        }
 
-        uint32_t header_buf[4] = {logical_id, packet, total_packets, num_segments_in_packet};
-        memcpy(send_buf.data(), header_buf, header_size);
-        memcpy(send_buf.data() + header_size, pkt.segments.data() + start_idx, num_segments_in_packet * sizeof(Segment));
-        size_t data_offset = (size_t)start_idx * rec_size;
-        memcpy(send_buf.data() + header_size + num_segments_in_packet * sizeof(Segment),
-               pkt.data.data() + data_offset, num_segments_in_packet * rec_size);
+        Datagram &d = dgrams[packet];
+        d.packet = packet;
+        d.parity = false;
+        if (compressed) {
+            char *z = (char *)pkt.zbuf.data() + (size_t)packet * RECORDS_PER_PACKET * rec_size;
+            d.size = head_size + pkt.zlen[packet];
+            d.iov = {{head, head_size}, {z, pkt.zlen[packet]}};
+            continue;
+        }
+        d.size = head_size + num_segments_in_packet * rec_size;
+        d.iov.reserve(1 + num_segments_in_packet);
+        d.iov.push_back({head, head_size});
+        for (uint32_t idx = start_idx; idx <= end_idx; ++idx) {
+            const char *rec = record_store.record(pkt.segments[idx].start);
+            // Adjacent records in the mapping collapse into one iovec
+            iovec &last = d.iov.back();
+            if (d.iov.size() > 1 && (const char *)last.iov_base + last.iov_len == rec) last.iov_len += rec_size;
+            else d.iov.push_back({(void *)rec, rec_size});
+        }
+    }
 
-        ssize_t s = sendto(sockfd, send_buf.data(), packet_size, 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
+    vector<char> parity_heads, parity_payload;
+    if (st.fec_k) dgrams = add_parity(st, dgrams, pkt, logical_id, round, RECORDS_PER_PACKET, parity_heads, parity_payload);
+
+    if (send_batch > 1 || st.use_gso || st.ring) {
+        size_t next = 0;
+        while (next < dgrams.size()) {
+            int n = send_batch_mmsg(st, dgrams, next, logical_id, total_packets);
+            if (n < 0 && st.use_gso && (errno == EIO || errno == EINVAL || errno == EMSGSIZE || errno == ENOPROTOOPT)) {
+                sender_log(LogLevel::Warn) << "[Sender] UDP GSO send failed (" << strerror(errno) << "), falling back to unsegmented sendmmsg" << endl;
+                st.use_gso = false;
+                continue;
+            }
+            if (n <= 0) {
+                sender_log(LogLevel::Error) << "[Sender] sendmmsg error: " << strerror(errno) << endl;
+                next++; // drop the datagram the kernel refused, REC_MISS will recover it
+                continue;
+            }
+            next += (size_t)n;
+        }
+        return (uint32_t)dgrams.size();
+    }
+
+    for (const Datagram &d : dgrams) {
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_name = &st.receiver_addr;
+        mh.msg_namelen = sizeof(st.receiver_addr);
+        mh.msg_iov = (iovec *)d.iov.data();
+        mh.msg_iovlen = d.iov.size();
+        st.pacer.wait(d.size);
+        ssize_t s = sendmsg(st.sockfd, &mh, 0);
+        st.total_send_syscalls++;
         if (s == -1) {
-            sender_log << "[Sender] sendto error: " << strerror(errno) << endl;
+            sender_log(LogLevel::Error) << "[Sender] sendmsg error: " << strerror(errno) << endl;
+            st.pacer.refund(d.size);
         } else {
-            total_packets_sent++;
-            total_bytes_sent += (size_t)s;
-            sender_log << "[Sender] Sent packet " << packet << " of " << total_packets
-                       << " for blast " << logical_id << " (size=" << s << ")" << endl;
+            st.total_packets_sent++;
+            st.total_bytes_sent += (size_t)s;
+            if (d.parity) st.total_parity_packets_sent++;
+            sender_trace.record(d.parity ? TR_PARITY_SENT : TR_PACKET_SENT, d.packet, total_packets, logical_id, (uint32_t)s);
         }
     }
+    return (uint32_t)dgrams.size();
 }
 
-void network_sender_thread() {
-    uint32_t blast_no = 0;
-    struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+chrono::steady_clock::duration rto_after(const Stream &st, uint32_t probes) {
+    double rto = min(CongestionControl::MAX_RTO, st.cc.rto() * (double)(1u << min(probes, 16u)));
+    return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(rto));
+}
 
-    while (true) {
-        BlastPacket pkt;
-        {
-            unique_lock<mutex> lock(mtx);
-            cv.wait(lock, [] { return !blast_queue.empty() || done_reading; });
+// Starts a new round for a blast: remembers what was sent so the REC_MISS can be scored against it
+void begin_round(Stream &st, InFlightBlast &b, uint32_t datagrams, uint32_t records) {
+    b.round_sent = chrono::steady_clock::now();
+    b.round_datagrams = datagrams;
+    b.round_records = records;
+    b.round_chunks = (records + negotiated_header.records_per_packet - 1) / negotiated_header.records_per_packet;
+    b.probes = 0;
+    b.deadline = b.round_sent + rto_after(st, 0);
+    st.inflight_datagrams += datagrams;
+}
 
-            if (blast_queue.empty() && done_reading) break;
-            pkt = std::move(blast_queue.front());
-            blast_queue.pop();
-        }
+void end_round(Stream &st, InFlightBlast &b) {
+    st.inflight_datagrams -= min<uint64_t>(st.inflight_datagrams, b.round_datagrams);
+    b.round_datagrams = 0;
+}
 
-        uint32_t logical_id = ++blast_no;
+void update_pacing_rate(Stream &st) {
+    if (pacing_mode != PacingMode::Aimd || st.total_packets_sent == 0) return;
+    st.pacer.set_rate(st.cc.pacing_rate((double)st.total_bytes_sent / st.total_packets_sent));
+}
 
-        if (total_logical_blasts_sent == 0) send_start_time = chrono::steady_clock::now();
+// The congestion window only gates new blasts; retransmissions are paced but never held back
+bool cwnd_open(Stream &st) {
+    return pacing_mode != PacingMode::Aimd || st.inflight_datagrams < (uint64_t)st.cc.cwnd;
+}
 
-        // Send original blast
-        send_packet(pkt, logical_id);
+// Sends the missing records of a blast as its next round. False if none of them is the blast's.
+bool retransmit_missing(Stream &st, map<uint32_t, InFlightBlast>::iterator it, const vector<pair<uint32_t,uint32_t>> &missing_ranges) {
+    uint32_t logical_id = it->first;
+    // All missing records of a blast go out as one round so the receiver answers with a single REC_MISS
+    BlastPacket &retrans_pkt = st.retrans_pkt;
+    retrans_pkt.segments.clear();
+    retrans_pkt.num_segments = 0;
 
-        total_logical_blasts_sent++;
-        sender_log << "[Sender] Blast " << logical_id << " sent with records (" 
-                   << pkt.segments.front().start << "-" << pkt.segments.back().end << ")" << endl;
-        sender_log << "[Sender] is_blast_over: Blast " << logical_id << endl;
+    retrans_pkt.crcs.clear();
 
-        // Wait for REC_MISS
-        char buf[8192];
-        socklen_t addrlen = sizeof(receiver_addr);
-        ssize_t rn = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&receiver_addr, &addrlen);
+    // A REC_MISS span can take in other blasts' records (resumed and delta blasts have gaps), so
+    // only this blast's are resent; its buffer also has their CRCs. REC_MISS ranges come sorted.
+    const BlastPacket &orig = *it->second.pkt;
+    auto seg = orig.segments.begin();
+    uint32_t total_records = record_store.total_records();
+    for (auto &range : missing_ranges) {
+        for (uint32_t r = range.first; r <= range.second && r < total_records; ++r) {
+            if (seg == orig.segments.end() || seg->start > r) seg = orig.segments.begin();
+            seg = lower_bound(seg, orig.segments.end(), r, [](const Segment &s, uint32_t v) { return s.start < v; });
+            if (seg == orig.segments.end()) break;
+            if (seg->start != r) { r = seg->start - 1; continue; }     // not part of this blast: skip to its next record
+            if (checksums_enabled) retrans_pkt.crcs.push_back(orig.crcs[seg - orig.segments.begin()]);
+            retrans_pkt.segments.push_back({r,r});
+            retrans_pkt.num_segments++;
+        }
+        sender_trace.record(TR_RETRANSMIT, range.first, range.second, logical_id);
+    }
+    if (retrans_pkt.num_segments == 0) return false;
+    uint32_t datagrams = send_packet(st, retrans_pkt, logical_id, (uint16_t)it->second.rounds); // reuse same logical_id for retransmit
+    begin_round(st, it->second, datagrams, retrans_pkt.num_segments);
+    it->second.round_segments = retrans_pkt.segments;
+    st.total_retransmit_rounds++;
+    return true;
+}
 
-        if (rn <= 0) {
-            sender_log << "[Sender] No REC_MISS received (timeout or error) for blast " << logical_id << endl;
-            continue;
+// Returns a finished blast's buffer to the reader and lets go of its records
+void release_blast(Stream &st, BlastPacket *pkt) {
+    if (pkt->num_segments) record_store.release(pkt->segments.front().start, pkt->segments.back().end - pkt->segments.front().start + 1);
+    {
+        lock_guard<mutex> g(st.mtx);
+        st.free_blasts.push_back(pkt);
+    }
+    st.free_cv.notify_one();
+}
+
+// Acts on a complete REC_MISS for one blast: done if nothing is missing, otherwise retransmit. The
+// records of the current round's datagrams in lost_chunks count as missing too.
+void apply_rec_miss(Stream &st, map<uint32_t, InFlightBlast>::iterator it, vector<pair<uint32_t,uint32_t>> missing_ranges,
+                    const vector<uint32_t> &lost_chunks) {
+    uint32_t logical_id = it->first;
+    InFlightBlast &b = it->second;
+    st.total_rec_miss_msgs++;
+
+    if (!lost_chunks.empty()) {
+        const vector<Segment> &segs = b.rounds ? b.round_segments : b.pkt->segments;
+        uint32_t rpp = negotiated_header.records_per_packet;
+        for (uint32_t c : lost_chunks) {
+            for (size_t idx = (size_t)c * rpp; idx < min(segs.size(), (size_t)(c + 1) * rpp); ++idx)
+                missing_ranges.emplace_back(segs[idx].start, segs[idx].end);
+        }
+        st.total_lost_datagrams_reported += lost_chunks.size();
+        // Retransmission wants the ranges sorted and disjoint
+        sort(missing_ranges.begin(), missing_ranges.end());
+        size_t out = 0;
+        for (size_t i = 0; i < missing_ranges.size(); ++i) {
+            if (out && missing_ranges[i].first <= missing_ranges[out - 1].second + 1)
+                missing_ranges[out - 1].second = max(missing_ranges[out - 1].second, missing_ranges[i].second);
+            else missing_ranges[out++] = missing_ranges[i];
+        }
+        missing_ranges.resize(out);
+    }
+
+    uint64_t missing = 0;
+    for (auto &p : missing_ranges) missing += (p.second - p.first + 1);
+    auto now = chrono::steady_clock::now();
+    if (b.round_datagrams) {
+        double rtt = chrono::duration<double>(now - b.round_sent).count();
+        st.rtt.observe(rtt);
+        // Karn: once the round has been probed, the reply may be to the probe
+        if (!b.probes) st.cc.on_rtt_sample(rtt);
+        st.cc.on_round_feedback(b.round_datagrams, b.round_records, (uint32_t)min<uint64_t>(missing, b.round_records));
+        end_round(st, b);
+        update_pacing_rate(st);
+        if (fec_adaptive) st.fec_k = fec_adapt_k(fec_n, st.fec_k, missing, st.fec_clean_rounds);
+    }
+
+    if (!missing_ranges.empty()) {
+        st.total_missing_records_reported += missing;
+        b.rounds++;
+        if (retransmit_missing(st, it, missing_ranges)) {
+            st.rec_miss_turnaround.observe(chrono::steady_clock::now() - now);
+            return;
         }
+        // None of the missing records is this blast's, so there is nothing for it to resend
+        b.rounds--;
+    }
+
+    sender_trace.record(TR_BLAST_COMPLETE, logical_id, b.rounds);
+    st.blast_completion.observe(now - b.first_sent);
+    st.rounds.observe(b.rounds);
+    release_blast(st, b.pkt);
+    st.in_flight.erase(it);
+}
+
+// Binary NACK part: collect until every part of the reply is in
+void handle_binary_rec_miss(Stream &st, const char *buf, size_t len) {
+    NackHeader h;
+    vector<pair<uint32_t,uint32_t>> ranges;
+    vector<uint32_t> chunks;
+    if (!decode_nack(buf, len, h, ranges, chunks)) {
+        sender_log(LogLevel::Warn) << "[Sender] Malformed or unsupported binary REC_MISS (" << len << " bytes)" << endl;
+        return;
+    }
 
-        string rec_miss(buf, (size_t)rn);
-        sender_log << "[Sender] REC_MISS for blast " << logical_id << ": " << rec_miss << endl;
-        total_rec_miss_msgs++;
+    auto it = st.in_flight.find(h.blast_id);
+    if (it == st.in_flight.end()) {
+        sender_log(LogLevel::Debug) << "[Sender] REC_MISS for blast " << h.blast_id << " which is no longer in flight" << endl;
+        return;
+    }
+    InFlightBlast &b = it->second;
+    if (h.round != (uint16_t)b.rounds) {
+        // A repeat of an earlier round's reply, e.g. one that answered a probe after all
+        sender_log(LogLevel::Debug) << "[Sender] REC_MISS for round " << h.round << " of blast " << h.blast_id << ", which is on round " << b.rounds << endl;
+        return;
+    }
+    if (b.nack_parts.empty() || b.nack_seq != h.seq || b.nack_parts.size() != h.parts) {
+        b.nack_seq = h.seq;
+        b.nack_parts.assign(h.parts, false);
+        b.nack_ranges.clear();
+        b.nack_chunks.clear();
+    }
+    if (b.nack_parts[h.part]) return; // duplicate part
+    b.nack_parts[h.part] = true;
+    b.nack_ranges.insert(b.nack_ranges.end(), ranges.begin(), ranges.end());
+    b.nack_chunks.insert(b.nack_chunks.end(), chunks.begin(), chunks.end());
+    sender_trace.record(TR_REC_MISS_PART, h.part + 1, h.parts, h.blast_id, (uint32_t)(ranges.size() + chunks.size()));
 
-        // Parse REC_MISS ranges
-        vector<pair<uint32_t,uint32_t>> missing_ranges;
+    if (count(b.nack_parts.begin(), b.nack_parts.end(), true) < (long)b.nack_parts.size()) return;
+    vector<pair<uint32_t,uint32_t>> missing_ranges = std::move(b.nack_ranges);
+    vector<uint32_t> lost_chunks = std::move(b.nack_chunks);
+    b.nack_parts.clear();
+    b.nack_ranges.clear();
+    b.nack_chunks.clear();
+    apply_rec_miss(st, it, std::move(missing_ranges), lost_chunks);
+}
+
+void handle_rec_miss(Stream &st, const char *buf, size_t len) {
+    uint32_t magic = 0;
+    if (len >= sizeof(magic)) memcpy(&magic, buf, sizeof(magic));
+    if (magic == NACK_MAGIC) {
+        handle_binary_rec_miss(st, buf, len);
+        return;
+    }
+
+    // Debug JSON form: {"blast_id":N,"round":R,"missing":[[a,b],...],"lost_chunks":[c,...]}
+    string rec_miss(buf, len);
+    auto numbers = [&](size_t from, size_t to) {
         long cur = 0; bool in_num = false; bool neg = false;
         vector<long> nums;
-        for (char ch : rec_miss) {
+        for (size_t i = from; i < to; ++i) {
+            char ch = rec_miss[i];
             if (ch == '-') { neg = true; in_num = true; cur = 0; }
             else if (isdigit((unsigned char)ch)) { in_num = true; cur = cur*10 + (ch - '0'); }
             else { if (in_num) { nums.push_back(neg?-cur:cur); cur=0; in_num=false; neg=false; } }
         }
         if (in_num) nums.push_back(neg?-cur:cur);
-        for (size_t i = 0; i + 1 < nums.size(); i+=2) missing_ranges.emplace_back(nums[i], nums[i+1]);
-
-        // Count total missing records
-        for (auto &p : missing_ranges) total_missing_records_reported += (p.second - p.first + 1);
-
-        // --- RETRANSMIT missing records ---
-        if (!missing_ranges.empty()) {
-            sender_log << "[Sender] Retransmitting missing records for blast " << logical_id << endl;
-            for (auto &range : missing_ranges) {
-                BlastPacket retrans_pkt;
-                retrans_pkt.num_segments = 0;
-                retrans_pkt.data.clear();
-
-                uint32_t rec_size = negotiated_header.record_size;
-                ifstream fin("inputfile.bin", ios::binary); // make sure the filename is same as input
-                fin.seekg((streampos)range.first * rec_size);
-
-                for (uint32_t r = range.first; r <= range.second; ++r) {
-                    vector<char> rec(rec_size);
-                    fin.read(rec.data(), rec_size);
-                    retrans_pkt.segments.push_back({r,r});
-                    retrans_pkt.num_segments++;
-                    retrans_pkt.data.insert(retrans_pkt.data.end(), rec.begin(), rec.end());
+        return nums;
+    };
+    size_t missing_at = min(rec_miss.find("\"missing\""), rec_miss.size());
+    size_t chunks_at = min(rec_miss.find("\"lost_chunks\""), rec_miss.size());
+    vector<long> head = numbers(0, missing_at);
+    if (head.size() < 2 || missing_at == rec_miss.size()) {
+        sender_log(LogLevel::Warn) << "[Sender] Malformed REC_MISS: " << rec_miss << endl;
+        return;
+    }
+
+    uint32_t logical_id = (uint32_t)head[0];
+    vector<long> nums = numbers(missing_at, chunks_at);
+    vector<pair<uint32_t,uint32_t>> missing_ranges;
+    for (size_t i = 0; i + 1 < nums.size(); i+=2) missing_ranges.emplace_back(nums[i], nums[i+1]);
+    vector<uint32_t> lost_chunks;
+    for (long c : numbers(chunks_at, rec_miss.size())) lost_chunks.push_back((uint32_t)c);
+
+    auto it = st.in_flight.find(logical_id);
+    if (it == st.in_flight.end()) {
+        sender_log(LogLevel::Debug) << "[Sender] REC_MISS for blast " << logical_id << " which is no longer in flight: " << rec_miss << endl;
+        return;
+    }
+    if ((uint16_t)head[1] != (uint16_t)it->second.rounds) return;    // an earlier round's reply
+    sender_log(LogLevel::Debug) << "[Sender] REC_MISS for blast " << logical_id << ": " << rec_miss << endl;
+    apply_rec_miss(st, it, std::move(missing_ranges), lost_chunks);
+}
+
+// Copies the congestion state into the stream's gauges for the stats writer
+void publish_state(Stream &st) {
+    st.in_flight_blasts.set(st.in_flight.size());
+    st.cwnd.set(st.cc.cwnd);
+    st.srtt.set(st.cc.srtt);
+    st.rto.set(st.cc.rto());
+    st.pacing_rate.set(st.pacer.get_rate());
+    st.loss_estimate.set(st.cc.loss_estimate);
+}
+
+// RTO probe for the round a blast is waiting on. It follows the round on the same socket, so the
+// receiver answers it with the round's REC_MISS, or the same one again if that was lost.
+void send_probe(Stream &st, uint32_t logical_id, InFlightBlast &b) {
+    PacketHeader ph = {logical_id, 0, b.round_chunks, 0, PKT_PROBE, 0, 0, (uint16_t)b.rounds, (uint16_t)negotiated_header.session_id, 0};
+    if (checksums_enabled) ph.crc = crc32c(0, &ph, sizeof(ph));
+    if (sendto(st.sockfd, &ph, sizeof(ph), 0, (struct sockaddr *)&st.receiver_addr, sizeof(st.receiver_addr)) < 0)
+        sender_log(LogLevel::Warn) << "[Sender] Probe for blast " << logical_id << " failed: " << strerror(errno) << endl;
+    b.probes++;
+    b.deadline = chrono::steady_clock::now() + rto_after(st, b.probes);
+    st.total_probes++;
+    sender_trace.record(TR_PROBE_SENT, logical_id, b.rounds, b.probes);
+    sender_log(LogLevel::Debug) << "[Sender] RTO: probing blast " << logical_id << " round " << b.rounds << " (probe " << b.probes << ")" << endl;
+}
+
+void network_sender_thread(Stream &st) {
+    TraceLog::set_thread((uint16_t)st.id);
+    uint32_t blast_no = 0;
+    bool reader_exhausted = false;
+    // A stream with nothing to send (every record held or unchanged) still gets a sane, empty span;
+    // one that sends restarts the clock at its first blast
+    st.send_start_time = st.send_end_time = chrono::steady_clock::now();
+
+    while (true) {
+        // Top up the window with new blasts; only block on the reader when nothing is in flight
+        while (st.in_flight.size() < window_blasts && !reader_exhausted && (st.in_flight.empty() || cwnd_open(st))) {
+            BlastPacket *pkt;
+            {
+                unique_lock<mutex> lock(st.mtx);
+                if (st.in_flight.empty()) st.cv.wait(lock, [&st] { return !st.blast_queue.empty() || st.done_reading; });
+                if (st.blast_queue.empty()) {
+                    if (st.done_reading) reader_exhausted = true;
+                    break;
                 }
-                send_packet(retrans_pkt, logical_id); // reuse same logical_id for retransmit
-                sender_log << "[Sender] Retransmitted records (" << range.first << "-" << range.second 
-                           << ") for blast " << logical_id << endl;
+                pkt = st.blast_queue.front();
+                st.blast_queue.pop();
+                st.queue_depth.set(st.blast_queue.size());
+            }
+
+            // Blast ids interleave across streams, so every stream's ids are unique within the transfer
+            uint32_t logical_id = blast_no++ * num_streams + st.id + 1;
+
+            if (st.total_logical_blasts_sent == 0) st.send_start_time = chrono::steady_clock::now();
+
+            // Send original blast
+            auto first_sent = chrono::steady_clock::now();
+            uint32_t datagrams = send_packet(st, *pkt, logical_id, 0);
+
+            st.total_logical_blasts_sent++;
+            sender_trace.record(TR_BLAST_SENT, logical_id, pkt->segments.front().start, pkt->segments.back().end);
+            sender_trace.record(TR_BLAST_OVER, logical_id);
+
+            InFlightBlast &b = st.in_flight[logical_id];
+            b.pkt = pkt;
+            b.rounds = 0;
+            b.first_sent = first_sent;
+            begin_round(st, b, datagrams, b.pkt->num_segments);
+        }
+
+        publish_state(st);
+        if (st.in_flight.empty()) {
+            if (reader_exhausted) break;
+            continue;
+        }
+
+        // Wait for a REC_MISS until the earliest blast deadline, or briefly if the window has room
+        auto now = chrono::steady_clock::now();
+        auto earliest = st.in_flight.begin()->second.deadline;
+        for (auto &kv : st.in_flight) earliest = min(earliest, kv.second.deadline);
+        long wait_ms = max<long>(0, chrono::duration_cast<chrono::milliseconds>(earliest - now).count());
+        if (st.in_flight.size() < window_blasts && !reader_exhausted && cwnd_open(st)) wait_ms = min<long>(wait_ms, 1);
+
+        struct pollfd pfd = {st.sockfd, POLLIN, 0};
+        if (poll(&pfd, 1, (int)wait_ms) > 0 && (pfd.revents & POLLIN)) {
+            char buf[8192];
+            socklen_t addrlen = sizeof(st.receiver_addr);
+            ssize_t rn;
+            while ((rn = recvfrom(st.sockfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&st.receiver_addr, &addrlen)) > 0) {
+                handle_rec_miss(st, buf, (size_t)rn);
+                addrlen = sizeof(st.receiver_addr);
             }
         }
+
+        // Probe the rounds whose REC_MISS is overdue, and give up on blasts that never answer
+        now = chrono::steady_clock::now();
+        for (auto it = st.in_flight.begin(); it != st.in_flight.end();) {
+            if (it->second.deadline > now) { ++it; continue; }
+            InFlightBlast &b = it->second;
+            if (b.probes >= max_probes) {
+                sender_log(LogLevel::Warn) << "[Sender] No REC_MISS received (timeout) for blast " << it->first << endl;
+                sender_trace.record(TR_REC_MISS_TIMEOUT, it->first);
+                end_round(st, b);
+                st.total_blasts_given_up++;
+                release_blast(st, b.pkt);
+                it = st.in_flight.erase(it);
+                continue;
+            }
+            // The first timeout of a round is a congestion signal, as in TCP; the backed-off ones are not
+            if (!b.probes) {
+                st.cc.on_timeout();
+                update_pacing_rate(st);
+            }
+            send_probe(st, it->first, b);
+            ++it;
+        }
     }
 
-    // Send DISCONNECT
-    string disc = "DISCONNECT";
-    sendto(sockfd, disc.c_str(), disc.size(), 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
-    send_end_time = chrono::steady_clock::now();
-    sender_log << "[Sender] DISCONNECTED" << endl;
+    publish_state(st);
+
+    // Send DISCONNECT; the receiver counts them until every stream of the session is done, and adds
+    // up their digests to check the file against
+    string disc = "DISCONNECT " + to_string(st.id) + "/" + to_string(num_streams) + " " + to_string(negotiated_header.session_id);
+    if (checksums_enabled) {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)st.digest);
+        disc += string(" ") + hex;
+    }
+    sendto(st.sockfd, disc.c_str(), disc.size(), 0, (struct sockaddr *)&st.receiver_addr, sizeof(st.receiver_addr));
+    st.send_end_time = chrono::steady_clock::now();
+    if (num_streams > 1) sender_log << "[Sender] Stream " << st.id << " DISCONNECTED" << endl;
+    else sender_log << "[Sender] DISCONNECTED" << endl;
+}
 
-    double secs = chrono::duration<double>(send_end_time - send_start_time).count();
+// The stream counters the summary adds up, under the same names
+struct StreamTotals {
+    uint64_t total_logical_blasts_sent = 0, total_packets_sent = 0, total_bytes_sent = 0;
+    uint64_t total_rec_miss_msgs = 0, total_missing_records_reported = 0, total_retransmit_rounds = 0;
+    uint64_t total_send_syscalls = 0, total_parity_packets_sent = 0;
+    uint64_t compress_in_bytes = 0, compress_out_bytes = 0, blasts_incompressible = 0;
+    uint64_t total_probes = 0, total_lost_datagrams_reported = 0, total_blasts_given_up = 0;
+};
+
+// Rolls the per-stream counters up into the final summary, with one line per stream when there are several
+void log_summary() {
+    StreamTotals total;
+    auto start = streams[0]->send_start_time, end = streams[0]->send_end_time;
+    bool any_sent = false;
+    double rate = 0, cwnd = 0, srtt = 0, min_rtt = 0, loss = 0, rto = 0;
+    uint64_t decreases = 0;
+    bool gso = false;
+    for (auto &sp : streams) {
+        Stream &st = *sp;
+        double secs = max(1e-6, chrono::duration<double>(st.send_end_time - st.send_start_time).count());
+        if (num_streams > 1)
+            sender_log << "[Sender] Stream " << st.id << ": records=" << st.first_record << "-" << (st.end_record ? st.end_record - 1 : 0)
+                       << ", logical_blasts_sent=" << st.total_logical_blasts_sent << ", packets_sent=" << st.total_packets_sent
+                       << ", bytes_sent=" << st.total_bytes_sent << ", missing_records_reported=" << st.total_missing_records_reported
+                       << ", retransmit_rounds=" << st.total_retransmit_rounds << ", loss_estimate=" << st.cc.loss_estimate*100
+                       << "%, Duration=" << secs << "s, Throughput=" << (st.total_bytes_sent*8/secs/1e6) << " Mbps" << endl;
+
+        total.total_logical_blasts_sent += st.total_logical_blasts_sent;
+        total.total_packets_sent += st.total_packets_sent;
+        total.total_bytes_sent += st.total_bytes_sent;
+        total.total_rec_miss_msgs += st.total_rec_miss_msgs;
+        total.total_missing_records_reported += st.total_missing_records_reported;
+        total.total_retransmit_rounds += st.total_retransmit_rounds;
+        total.total_send_syscalls += st.total_send_syscalls;
+        total.total_parity_packets_sent += st.total_parity_packets_sent;
+        total.compress_in_bytes += st.compress_in_bytes;
+        total.compress_out_bytes += st.compress_out_bytes;
+        total.blasts_incompressible += st.blasts_incompressible;
+        total.total_probes += st.total_probes;
+        total.total_lost_datagrams_reported += st.total_lost_datagrams_reported;
+        total.total_blasts_given_up += st.total_blasts_given_up;
+        rto += st.cc.rto() / num_streams;
+        // The transfer's duration spans the streams that sent anything
+        if (st.total_logical_blasts_sent) {
+            start = any_sent ? min(start, st.send_start_time) : st.send_start_time;
+            end = any_sent ? max(end, st.send_end_time) : st.send_end_time;
+            any_sent = true;
+        }
+        rate += st.pacer.get_rate();
+        cwnd += st.cc.cwnd;
+        srtt += st.cc.srtt / num_streams;
+        min_rtt = min_rtt ? min(min_rtt, st.cc.min_rtt) : st.cc.min_rtt;
+        loss += st.cc.loss_estimate / num_streams;
+        decreases += st.cc.decreases;
+        gso = gso || st.use_gso;
+    }
+
+    double secs = chrono::duration<double>(end - start).count();
     if (secs < 1e-6) secs = 1e-6;
-    double throughput_bps = (double)total_bytes_sent / secs;
+    double throughput_bps = (double)total.total_bytes_sent / secs;
 
-    sender_log << "[Sender] Summary: logical_blasts_sent=" << total_logical_blasts_sent
-               << ", packets_sent=" << total_packets_sent << ", bytes_sent=" << total_bytes_sent
-               << ", rec_miss_msgs=" << total_rec_miss_msgs
-               << ", missing_records_reported=" << total_missing_records_reported << endl;
+    sender_log << "[Sender] Summary: logical_blasts_sent=" << total.total_logical_blasts_sent
+               << ", packets_sent=" << total.total_packets_sent << ", bytes_sent=" << total.total_bytes_sent
+               << ", rec_miss_msgs=" << total.total_rec_miss_msgs
+               << ", missing_records_reported=" << total.total_missing_records_reported
+               << ", retransmit_rounds=" << total.total_retransmit_rounds
+               << ", lost_datagrams_reported=" << total.total_lost_datagrams_reported
+               << ", rto_probes=" << total.total_probes
+               << ", blasts_given_up=" << total.total_blasts_given_up
+               << ", window=" << window_blasts << ", streams=" << num_streams
+               << ", parity_packets_sent=" << total.total_parity_packets_sent
+               << ", fec=" << fec_n << ":" << streams[0]->fec_k << (fec_adaptive ? " (adaptive)" : "")
+               << ", records_skipped=" << records_held << endl;
+    if (checksums_enabled) {
+        uint64_t digest = 0;
+        for (auto &sp : streams) digest += sp->digest;
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)digest);
+        sender_log << "[Sender] Integrity: CRC32C per record and datagram, file digest " << hex << endl;
+    }
+    if (compress_enabled)
+        sender_log << "[Sender] Compression: in_bytes=" << total.compress_in_bytes << ", out_bytes=" << total.compress_out_bytes
+                   << ", ratio=" << (total.compress_out_bytes ? (double)total.compress_in_bytes / total.compress_out_bytes : 1.0)
+                   << ", blasts_incompressible=" << total.blasts_incompressible << ", threads=" << compress_threads << endl;
+    sender_log << "[Sender] Syscalls: send_calls=" << total.total_send_syscalls
+               << ", packets_per_call=" << (total.total_send_syscalls ? (double)total.total_packets_sent / total.total_send_syscalls : 0.0)
+               << " (batch=" << send_batch << ", gso=" << (gso ? "on" : "off") << (streams[0]->ring ? ", io_uring" : "") << ")" << endl;
+    const char *mode = pacing_mode == PacingMode::Aimd ? "aimd" : pacing_mode == PacingMode::Fixed ? "fixed" : "off";
+    sender_log << "[Sender] Pacing: mode=" << mode << ", rate=" << (rate*8/1e6) << " Mbps"
+               << ", cwnd=" << cwnd << " datagrams, ssthresh=" << streams[0]->cc.ssthresh
+               << ", srtt=" << srtt*1e3 << " ms, min_rtt=" << min_rtt*1e3 << " ms, rto=" << rto*1e3 << " ms"
+               << ", loss_estimate=" << loss*100 << "%, decreases=" << decreases << endl;
     sender_log << "[Sender] Duration=" << secs << "s, Throughput=" << (throughput_bps)
                << " B/s (" << (throughput_bps*8/1e6) << " Mbps)" << endl;
-    sender_log.flush();
-    sender_log.close();
 
     cout << "[Sender] Duration=" << secs << "s, Throughput=" << (throughput_bps)
          << " B/s (" << (throughput_bps*8/1e6) << " Mbps)" << endl;
 }
 
+// Prometheus text for the stats file, one labelled sample per stream
+string render_metrics() {
+    PromText p;
+    auto counter = [&](const char *name, const char *help, Counter Stream::*field) {
+        p.family(name, "counter", help);
+        for (auto &sp : streams) p.sample(name, "stream=\"" + to_string(sp->id) + "\"", ((*sp).*field).get());
+    };
+    auto gauge = [&](const char *name, const char *help, Gauge Stream::*field) {
+        p.family(name, "gauge", help);
+        for (auto &sp : streams) p.sample(name, "stream=\"" + to_string(sp->id) + "\"", ((*sp).*field).get());
+    };
+    auto histogram = [&](const char *name, const char *help, Histogram Stream::*field) {
+        p.family(name, "histogram", help);
+        for (auto &sp : streams) p.histogram(name, "stream=\"" + to_string(sp->id) + "\"", (*sp).*field);
+    };
+    counter("sender_blasts_sent_total", "Blasts sent for the first time", &Stream::total_logical_blasts_sent);
+    counter("sender_packets_sent_total", "Datagrams sent, parity included", &Stream::total_packets_sent);
+    counter("sender_bytes_sent_total", "UDP payload bytes sent", &Stream::total_bytes_sent);
+    counter("sender_parity_packets_sent_total", "FEC parity datagrams sent", &Stream::total_parity_packets_sent);
+    counter("sender_send_calls_total", "sendmsg/sendmmsg calls", &Stream::total_send_syscalls);
+    counter("sender_rec_miss_total", "Complete REC_MISS replies handled", &Stream::total_rec_miss_msgs);
+    counter("sender_missing_records_total", "Records reported missing by REC_MISS", &Stream::total_missing_records_reported);
+    counter("sender_retransmit_rounds_total", "Retransmission rounds sent", &Stream::total_retransmit_rounds);
+    counter("sender_lost_datagrams_reported_total", "Whole datagrams REC_MISS reported as never arrived", &Stream::total_lost_datagrams_reported);
+    counter("sender_rto_probes_total", "Probes sent for rounds whose REC_MISS was overdue", &Stream::total_probes);
+    counter("sender_blasts_given_up_total", "Blasts abandoned after max_probes unanswered probes", &Stream::total_blasts_given_up);
+    counter("sender_compress_input_bytes_total", "Record bytes of first-round blasts with compression on", &Stream::compress_in_bytes);
+    counter("sender_compress_output_bytes_total", "The same records as sent, compressed or raw", &Stream::compress_out_bytes);
+    counter("sender_blasts_incompressible_total", "Blasts sent raw because their sample did not compress", &Stream::blasts_incompressible);
+    gauge("sender_blast_queue_depth", "Blasts read from disk and waiting to be sent", &Stream::queue_depth);
+    gauge("sender_blasts_in_flight", "Blasts sent and awaiting their final REC_MISS", &Stream::in_flight_blasts);
+    gauge("sender_cwnd_datagrams", "Congestion window", &Stream::cwnd);
+    gauge("sender_srtt_seconds", "Smoothed REC_MISS round trip", &Stream::srtt);
+    gauge("sender_rto_seconds", "Retransmission timeout before a round is probed", &Stream::rto);
+    gauge("sender_pacing_rate_bytes", "Pacing rate in bytes per second (0 = unpaced)", &Stream::pacing_rate);
+    gauge("sender_loss_estimate_ratio", "Smoothed per-round loss fraction", &Stream::loss_estimate);
+    histogram("sender_blast_rtt_seconds", "Time from the end of a round to its complete REC_MISS", &Stream::rtt);
+    histogram("sender_rec_miss_turnaround_seconds", "Time from a REC_MISS to its retransmission round being sent", &Stream::rec_miss_turnaround);
+    histogram("sender_blast_completion_seconds", "Time from a blast's first datagram to its final REC_MISS", &Stream::blast_completion);
+    histogram("sender_blast_rounds", "Retransmission rounds per completed blast", &Stream::rounds);
+    histogram("sender_disk_read_seconds", "Time to fault one blast's records in from the input file", &Stream::disk_read);
+    return p.str();
+}
+
+void pin_thread(thread &t, uint32_t cpu) {
+    unsigned ncpu = max(1u, thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpu, &set);
+    int err = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+    if (err) sender_log(LogLevel::Warn) << "[Sender] Could not pin thread to CPU " << cpu % ncpu << ": " << strerror(err) << endl;
+}
+
+// Largest datagram a layout produces. Parity datagrams carry their coverage tables on top of a full
+// payload, so with FEC they are the bigger ones; adaptive FEC can go down to K = 1, covering N each.
+size_t largest_datagram(uint32_t records_per_packet, uint32_t record_size) {
+    size_t data = data_datagram_size(records_per_packet, record_size, checksums_enabled);
+    if (!fec_n || !fec_k) return data;
+    size_t cover = fec_adaptive ? fec_n : (fec_n + fec_k - 1) / fec_k;
+    size_t parity = sizeof(PacketHeader) + cover * (sizeof(FecCoverEntry) + records_per_packet * sizeof(Segment))
+                  + (size_t)records_per_packet * record_size;
+    return max(data, parity);
+}
+
+// Identifies the input file and its version for resuming: device, inode, size and modification
+// time, FNV-1a hashed. A file that changed since the interrupted attempt gets a new fingerprint,
+// and the receiver starts over.
+uint64_t file_fingerprint(const struct stat &st) {
+    uint64_t fields[] = {(uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                         (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec};
+    uint64_t h = 1469598103934665603ull;
+    for (uint64_t f : fields)
+        for (int i = 0; i < 8; ++i) { h ^= (f >> (i * 8)) & 0xff; h *= 1099511628211ull; }
+    return h ? h : 1;
+}
+
+// Pulls the list of records the receiver kept from an earlier attempt, one RESUME round trip per
+// reply. If the receiver stops answering, the whole file is sent and what it has is written again.
+void fetch_held_records(Stream &s0, uint32_t expected) {
+    uint32_t total = record_store.total_records();
+    RecordBitmap held;
+    held.resize(total);
+    uint64_t count = 0;
+    uint32_t from = 0, replies = 0;
+    while (from < total) {
+        ResumeHeader req = {RESUME_MAGIC, (uint16_t)negotiated_header.session_id, 0, from, 0};
+        bool got = false;
+        for (int attempt = 0; attempt < 5 && !got; ++attempt) {
+            sendto(s0.sockfd, &req, sizeof(req), 0, (struct sockaddr *)&s0.receiver_addr, sizeof(s0.receiver_addr));
+            char buf[2048];
+            ssize_t rn;
+            while (!got && (rn = recvfrom(s0.sockfd, buf, sizeof(buf), 0, nullptr, nullptr)) > 0) {
+                ResumeHeader h;
+                vector<pair<uint32_t, uint32_t>> ranges;
+                if (!decode_resume(buf, (size_t)rn, h, ranges) || h.from != from || h.to >= total) continue;
+                for (auto &r : ranges) {
+                    held.set_range(r.first, r.second - r.first + 1);
+                    count += r.second - r.first + 1;
+                }
+                from = h.to + 1;
+                replies++;
+                got = true;
+            }
+        }
+        if (!got) {
+            sender_log(LogLevel::Warn) << "[Sender] No RESUME reply for record " << from << ", sending the whole file" << endl;
+            return;
+        }
+    }
+    held_records = std::move(held);
+    records_held = count;
+    resuming = true;
+    sender_log << "[Sender] Resuming: receiver holds " << count << " of " << total << " records"
+               << (count != expected ? " (FILE_HDR_ACK said " + to_string(expected) + ")" : "")
+               << " in " << replies << " RESUME replies, sending the other " << total - count << endl;
+}
+
+// Identifies the input file by its path alone for delta transfers, FNV-1a hashed
+uint64_t path_fingerprint(const string &filename) {
+    char *real = realpath(filename.c_str(), nullptr);
+    string path = real ? real : filename;
+    free(real);
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : path) { h ^= c; h *= 1099511628211ull; }
+    return h ? h : 1;
+}
+
+// Compares the receiver's signature of its copy with this file, block by block, and holds back the
+// records of every block that hashes the same. The local hashes are computed first, on up to four
+// threads, while the receiver is still signing its copy; then SIGNATURE requests go out, a window
+// of them at a time, until every chunk has been answered or the receiver goes quiet. What was not
+// answered is sent. Finally the receiver is told which records it keeps, one acknowledged
+// DELTA_HELD at a time.
+void fetch_signature(Stream &s0, uint32_t blocks) {
+    const uint32_t WINDOW = 32;
+    const chrono::seconds give_up(10);
+    uint32_t rpb = negotiated_header.records_per_packet, rs = negotiated_header.record_size;
+    uint64_t file_size = negotiated_header.file_size;
+    uint32_t total = record_store.total_records();
+    blocks = min(blocks, delta_block_count(total, rpb));
+    if (!blocks) return;
+
+    auto hash_start = chrono::steady_clock::now();
+    vector<uint64_t> local(blocks);
+    atomic<uint32_t> next_block{0};
+    vector<thread> hashers;
+    unsigned nthreads = max(1u, min(4u, thread::hardware_concurrency()));
+    for (unsigned i = 0; i < nthreads; ++i)
+        hashers.emplace_back([&] {
+            for (uint32_t b; (b = next_block++) < blocks;) {
+                auto range = delta_block_bytes(b, rpb, rs, file_size);
+                local[b] = xxh64(record_store.bytes(range.first), range.second - range.first);
+            }
+        });
+    for (auto &t : hashers) t.join();
+    record_store.release(0, total);
+    double hash_secs = chrono::duration<double>(chrono::steady_clock::now() - hash_start).count();
+
+    RecordBitmap held;
+    held.resize(total);
+    uint64_t count = 0;
+    uint32_t chunks = (blocks + SIGNATURE_PER_REPLY - 1) / SIGNATURE_PER_REPLY, answered = 0, replies = 0, lo = 0;
+    uint32_t unchanged = 0;
+    vector<bool> got(chunks, false);
+    auto progress = chrono::steady_clock::now();
+    while (answered < chunks && chrono::steady_clock::now() - progress < give_up) {
+        // (Re)ask for the first WINDOW chunks still unanswered, then collect replies for a while
+        while (got[lo]) lo++;
+        uint32_t asked = 0;
+        for (uint32_t c = lo; c < chunks && asked < WINDOW; ++c) {
+            if (got[c]) continue;
+            ResumeHeader req = {SIGNATURE_MAGIC, (uint16_t)negotiated_header.session_id, 0, c * SIGNATURE_PER_REPLY, 0};
+            sendto(s0.sockfd, &req, sizeof(req), 0, (struct sockaddr *)&s0.receiver_addr, sizeof(s0.receiver_addr));
+            asked++;
+        }
+        auto until = chrono::steady_clock::now() + chrono::milliseconds(100);
+        char buf[2048];
+        for (uint32_t pass_answered = 0; pass_answered < asked;) {
+            int wait_ms = (int)chrono::duration_cast<chrono::milliseconds>(until - chrono::steady_clock::now()).count();
+            struct pollfd pfd = {s0.sockfd, POLLIN, 0};
+            if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) break;
+            ssize_t rn = recv(s0.sockfd, buf, sizeof(buf), 0);
+            ResumeHeader h;
+            if (rn < (ssize_t)sizeof(h)) continue;
+            memcpy(&h, buf, sizeof(h));
+            if (h.magic != SIGNATURE_MAGIC || h.session != negotiated_header.session_id || h.from % SIGNATURE_PER_REPLY) continue;
+            uint32_t c = h.from / SIGNATURE_PER_REPLY;
+            if (c >= chunks || got[c] || h.to >= blocks || h.to < h.from) continue;
+            // count 0: the receiver could not read these blocks, so they are sent
+            if (h.count && (h.count != h.to - h.from + 1 || rn < (ssize_t)(sizeof(h) + (size_t)h.count * sizeof(uint64_t)))) continue;
+            for (uint32_t i = 0; i < h.count; ++i) {
+                uint64_t remote;
+                memcpy(&remote, buf + sizeof(h) + (size_t)i * sizeof(remote), sizeof(remote));
+                uint32_t b = h.from + i;
+                if (remote != local[b]) continue;
+                uint32_t first = b * rpb, n = min(rpb, total - first);
+                held.set_range(first, n);
+                count += n;
+                unchanged++;
+            }
+            got[c] = true;
+            answered++;
+            pass_answered++;
+            replies++;
+            progress = chrono::steady_clock::now();
+        }
+    }
+    if (answered < chunks)
+        sender_log(LogLevel::Warn) << "[Sender] Receiver stopped answering SIGNATURE requests; sending the " << chunks - answered
+                                   << " unanswered chunk(s) in full" << endl;
+
+    // The receiver counts what it keeps as received; anything it does not hear about is sent after all
+    for (uint32_t from = 0; count && from < total;) {
+        vector<char> msg = encode_resume((uint16_t)negotiated_header.session_id, held, from, total - 1, DELTA_HELD_MAGIC);
+        ResumeHeader h;
+        memcpy(&h, msg.data(), sizeof(h));
+        bool acked = false;
+        for (int attempt = 0; attempt < 5 && !acked; ++attempt) {
+            sendto(s0.sockfd, msg.data(), msg.size(), 0, (struct sockaddr *)&s0.receiver_addr, sizeof(s0.receiver_addr));
+            ResumeHeader ack;
+            ssize_t rn;
+            while (!acked && (rn = recvfrom(s0.sockfd, &ack, sizeof(ack), 0, nullptr, nullptr)) > 0)
+                acked = rn == (ssize_t)sizeof(ack) && ack.magic == DELTA_HELD_MAGIC && ack.from == h.from && ack.to == h.to;
+        }
+        if (!acked) {
+            sender_log(LogLevel::Warn) << "[Sender] No DELTA_HELD acknowledgement for record " << from << ", sending the rest in full" << endl;
+            for (uint32_t r = held.next_set(from, total - 1); r < total; r = held.next_set(r + 1, total - 1)) {
+                held.clear(r);
+                count--;
+            }
+            break;
+        }
+        from = h.to + 1;
+    }
+
+    held_records = std::move(held);
+    records_held = count;
+    resuming = count > 0;
+    sender_log << "[Sender] Delta: " << unchanged << " of " << blocks << " signed blocks unchanged (hashed in " << hash_secs
+               << "s, signature in " << replies << " replies), sending " << total - count << " of " << total << " records" << endl;
+}
+
+// Path MTU towards the receiver as the kernel knows it (route MTU, lowered by any ICMP
+// "fragmentation needed" seen so far). 0 if it cannot be determined.
+uint32_t probe_path_mtu(const in_addr &ip) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return 0;
+    int pmtu = IP_PMTUDISC_DO;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(9000);
+    addr.sin_addr = ip;
+    int mtu = 0;
+    socklen_t optlen = sizeof(mtu);
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &optlen) < 0) mtu = 0;
+    close(fd);
+    return (uint32_t)max(mtu, 0);
+}
+
+// Fills in record size and records per datagram so every datagram fits `budget` bytes of UDP
+// payload. Explicit options win; otherwise up to 16 records of 512 bytes, and when fewer than 16
+// fit, the records are stretched to fill the datagram instead of leaving it part empty.
+void choose_layout(size_t budget, FileHeader &h) {
+    uint32_t rs = opt_record_size ? opt_record_size : 512;
+    uint32_t rpp = opt_records_per_packet ? min(opt_records_per_packet, MAX_RECORDS_PER_PACKET) : 16;
+    if (!opt_records_per_packet)
+        while (rpp > 1 && largest_datagram(rpp, rs) > budget) rpp--;
+    if (!opt_record_size) {
+        if (rpp < 16) while (largest_datagram(rpp, rs + 8) <= budget) rs += 8;
+        while (rs > 64 && largest_datagram(rpp, rs) > budget) rs -= 8;
+    }
+    h.record_size = rs;
+    h.records_per_packet = rpp;
+    h.max_datagram = (uint32_t)largest_datagram(rpp, rs);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        cerr << "Usage: ./sender <file> <receiver_ip>\n";
+    vector<string> args;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--window" && i + 1 < argc) window_blasts = max(1, stoi(argv[++i]));
+        else if (a == "--batch" && i + 1 < argc) send_batch = max(1, stoi(argv[++i]));
+        else if (a == "--gso") use_gso = true;
+        else if (a == "--io-uring") use_uring = true;
+        else if (a == "--cc" && i + 1 < argc) {
+            string m = argv[++i];
+            if (m == "aimd") pacing_mode = PacingMode::Aimd;
+            else if (m == "none") pacing_mode = PacingMode::Off;
+            else { cerr << "Unknown congestion control: " << m << "\n"; return 1; }
+        }
+        else if (a == "--rate" && i + 1 < argc) { pacing_mode = PacingMode::Fixed; fixed_rate = stod(argv[++i]) * 1e6 / 8; }
+        else if (a == "--loss-tolerance" && i + 1 < argc) loss_tolerance = stod(argv[++i]) / 100;
+        else if (a == "--fec" && i + 1 < argc) {
+            string f = argv[++i];
+            if (f == "auto") { fec_n = 8; fec_k = 1; fec_adaptive = true; }
+            else if (sscanf(f.c_str(), "%u:%u", &fec_n, &fec_k) != 2 || fec_n == 0 || fec_n > 255 || fec_k > fec_n) {
+                cerr << "Invalid --fec, expected N:K or auto\n";
+                return 1;
+            }
+        }
+        else if (a == "--streams" && i + 1 < argc) num_streams = max(1, stoi(argv[++i]));
+        else if (a == "--separate-ports") separate_ports = true;
+        else if (a == "--pin-cpus") pin_cpus = true;
+        else if (a == "--log-level" && i + 1 < argc) {
+            LogLevel level;
+            if (!parse_log_level(argv[++i], level)) { cerr << "Unknown log level: " << argv[i] << "\n"; return 1; }
+            sender_log.set_level(level);
+        }
+        else if (a == "--no-trace") trace_enabled = false;
+        else if (a == "--mtu" && i + 1 < argc) opt_mtu = max(68, stoi(argv[++i]));
+        else if (a == "--record-size" && i + 1 < argc) opt_record_size = max(1, stoi(argv[++i]));
+        else if (a == "--records-per-packet" && i + 1 < argc) opt_records_per_packet = max(1, stoi(argv[++i]));
+        else if (a == "--blast-records" && i + 1 < argc) opt_blast_records = max(1, stoi(argv[++i]));
+        else if (a == "--allow-fragmentation") allow_fragmentation = true;
+        else if (a == "--queue" && i + 1 < argc) queue_blasts = max(1, stoi(argv[++i]));
+        else if (a == "--queue-memory" && i + 1 < argc) queue_memory = (size_t)max(1, stoi(argv[++i])) << 20;
+        else if (a == "--stats" && i + 1 < argc) stats_path = argv[++i];
+        else if (a == "--stats-interval" && i + 1 < argc) stats_interval = chrono::milliseconds(max(10, stoi(argv[++i])));
+        else if (a == "--no-resume") resume_enabled = false;
+        else if (a == "--delta") delta_enabled = true;
+        else if (a == "--no-checksums") checksums_enabled = false;
+        else if (a == "--compress") compress_enabled = true;
+        else if (a == "--compress-threads" && i + 1 < argc) { compress_enabled = true; compress_threads = max(0, stoi(argv[++i])); }
+        else args.push_back(a);
+    }
+    if (args.size() != 2) {
+        cerr << "Usage: ./sender <file> <receiver_ip> [--window <blasts_in_flight>] [--batch <datagrams_per_call>] [--gso] [--io-uring]\n"
+                "       [--cc aimd|none] [--rate <Mbps>] [--loss-tolerance <percent>]\n"
+                "       [--fec <N:K>|auto] [--streams <N>] [--separate-ports] [--pin-cpus]\n"
+                "       [--log-level error|warn|info|debug] [--no-trace]\n"
+                "       [--mtu <bytes>] [--record-size <bytes>] [--records-per-packet <N>] [--blast-records <M>]\n"
+                "       [--allow-fragmentation] [--stats <file>] [--stats-interval <ms>]\n"
+                "       [--queue <blasts>] [--queue-memory <MiB>] [--no-resume] [--no-checksums]\n"
+                "       [--compress] [--compress-threads <N>] [--delta]\n";
         return 1;
     }
 
-    string filename = argv[1];
-    string ip = argv[2];
+    string filename = args[0];
+    string ip = args[1];
 
-    sender_log.open("sender.log", ios::out | ios::trunc);
-    if (!sender_log.is_open()) {
+    if (!sender_log.open("sender.log")) {
         cerr << "Unable to open sender.log for writing\n";
-    } else sender_log << std::unitbuf << "[Sender] Log started\n";
+    } else sender_log << "[Sender] Log started\n";
+    if (trace_enabled && !sender_trace.open("sender.trace")) cerr << "Unable to open sender.trace for writing\n";
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) { perror("socket"); return 1; }
-
-    memset(&receiver_addr, 0, sizeof(receiver_addr));
-    receiver_addr.sin_family = AF_INET;
-    receiver_addr.sin_port = htons(9000);
-    if (inet_pton(AF_INET, ip.c_str(), &receiver_addr.sin_addr) != 1) {
+    in_addr ip_addr;
+    if (inet_pton(AF_INET, ip.c_str(), &ip_addr) != 1) {
         cerr << "Invalid receiver IP\n";
-        close(sockfd);
         return 1;
     }
 
-    // Prepare header
-    ifstream fin(filename, ios::binary | ios::ate);
-    if (!fin) { cerr << "Cannot open input file: " << filename << "\n"; close(sockfd); return 1; }
-    streampos fsize = fin.tellg(); fin.close();
-    negotiated_header.file_size = (uint32_t)max((streampos)0, fsize);
-    negotiated_header.record_size = 512;
-    negotiated_header.M = 500; // forced
-    sender_log << "[Sender] Forcing records-per-blast M=" << negotiated_header.M
-               << " (record_size=" << negotiated_header.record_size << ", file_size=" << negotiated_header.file_size << ")\n";
+    // Size datagrams to the path: the probed (or given) MTU less IP and UDP headers, or the
+    // largest UDP payload when fragmentation is allowed
+    uint32_t mtu = opt_mtu ? opt_mtu : probe_path_mtu(ip_addr);
+    if (!mtu) mtu = 1500;
+    size_t budget = allow_fragmentation ? 65507 : min<size_t>(65507, mtu - 28);
+    choose_layout(budget, negotiated_header);
+    negotiated_header.flags = (allow_fragmentation ? HDR_FRAGMENTATION : 0) | (checksums_enabled ? HDR_CHECKSUMS : 0)
+                            | (compress_enabled ? HDR_COMPRESSION : 0) | (delta_enabled ? HDR_DELTA : 0);
+    sender_log << "[Sender] Path MTU " << mtu << (opt_mtu ? " (given)" : " (probed)") << ": record_size="
+               << negotiated_header.record_size << ", records_per_packet=" << negotiated_header.records_per_packet
+               << ", max_datagram=" << negotiated_header.max_datagram
+               << (allow_fragmentation ? ", fragmentation allowed" : "") << endl;
+    if (negotiated_header.max_datagram > budget)
+        sender_log(LogLevel::Warn) << "[Sender] Datagrams of " << negotiated_header.max_datagram << " bytes exceed the "
+                                   << budget << "-byte budget; the kernel will refuse them without --allow-fragmentation" << endl;
 
-    ssize_t s = sendto(sockfd, &negotiated_header, sizeof(negotiated_header), 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
-    if (s <= 0) sender_log << "[Sender] Failed to send FILE_HDR\n";
-    else sender_log << "[Sender] Sent FILE_HDR\n";
+    if (!record_store.open(filename, negotiated_header.record_size)) {
+        cerr << "Cannot open input file: " << filename << "\n";
+        sender_log(LogLevel::Error) << "[Sender] Cannot open file: " << filename << endl;
+        return 1;
+    }
+    struct stat st;
+    stat(filename.c_str(), &st);
+    negotiated_header.magic = FILE_HDR_MAGIC;
+    negotiated_header.file_size = (uint64_t)st.st_size;
+    if ((negotiated_header.file_size + negotiated_header.record_size - 1) / negotiated_header.record_size > UINT32_MAX) {
+        cerr << "File has more than " << UINT32_MAX << " records; use a larger --record-size\n";
+        sender_log(LogLevel::Error) << "[Sender] File too large for record_size=" << negotiated_header.record_size << endl;
+        return 1;
+    }
+    negotiated_header.file_id = delta_enabled ? path_fingerprint(filename) : resume_enabled ? file_fingerprint(st) : 0;
+    // Blasts of about 256 KB unless given; the receiver may lower this to fit its buffers
+    negotiated_header.M = opt_blast_records ? opt_blast_records : max(negotiated_header.records_per_packet, 256000 / negotiated_header.record_size);
 
-    // Wait for ACK
+    for (uint32_t s = 0; s < num_streams; ++s) {
+        auto sp = make_unique<Stream>();
+        sp->id = s;
+        sp->use_gso = use_gso;
+        sp->fec_k = fec_k;
+        sp->cc.loss_tolerance = loss_tolerance;
+        if (pacing_mode == PacingMode::Fixed) sp->pacer.set_rate(fixed_rate / num_streams);
+
+        sp->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sp->sockfd < 0) { perror("socket"); return 1; }
+        int pmtu = allow_fragmentation ? IP_PMTUDISC_DONT : IP_PMTUDISC_DO;
+        setsockopt(sp->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+        memset(&sp->receiver_addr, 0, sizeof(sp->receiver_addr));
+        sp->receiver_addr.sin_family = AF_INET;
+        sp->receiver_addr.sin_port = htons(9000 + (separate_ports ? s : 0));
+        sp->receiver_addr.sin_addr = ip_addr;
+        streams.push_back(std::move(sp));
+    }
+
+    // The handshake goes over stream 0; the other streams start once the receiver has the header.
+    // The receiver assigns the session id every datagram carries, so without an ACK there is no
+    // transfer: FILE_HDR is repeated a few times (the receiver answers repeats with the same session).
+    // An ACK with session id 0 means the receiver is full.
+    Stream &s0 = *streams[0];
     struct timeval tv;
-    tv.tv_sec = 2; tv.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-    char ack[64]; socklen_t addrlen = sizeof(receiver_addr);
-    ssize_t rn = recvfrom(sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&receiver_addr, &addrlen);
-    if (rn <= 0) sender_log << "[Sender] No FILE_HDR_ACK received (continuing anyway)\n";
-    else sender_log << "[Sender] Received FILE_HDR_ACK\n";
+    tv.tv_sec = 1; tv.tv_usec = 0;
+    setsockopt(s0.sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    FileHeader accepted;
+    bool acked = false, refused = false;
+    for (int attempt = 0; attempt < 5 && !acked && !refused; ++attempt) {
+        ssize_t s = sendto(s0.sockfd, &negotiated_header, sizeof(negotiated_header), 0, (struct sockaddr *)&s0.receiver_addr, sizeof(s0.receiver_addr));
+        if (s <= 0) sender_log(LogLevel::Error) << "[Sender] Failed to send FILE_HDR: " << strerror(errno) << endl;
+        else sender_log << "[Sender] Sent FILE_HDR" << (attempt ? " (retry)" : "") << endl;
+
+        char ack[128];
+        socklen_t addrlen = sizeof(s0.receiver_addr);
+        ssize_t rn;
+        while ((rn = recvfrom(s0.sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&s0.receiver_addr, &addrlen)) > 0) {
+            if (rn == (ssize_t)(FILE_HDR_ACK_TAG_LEN + sizeof(accepted)) && memcmp(ack, FILE_HDR_ACK_TAG, FILE_HDR_ACK_TAG_LEN) == 0) {
+                memcpy(&accepted, ack + FILE_HDR_ACK_TAG_LEN, sizeof(accepted));
+                acked = accepted.session_id >= 1 && accepted.session_id <= UINT16_MAX;
+                refused = accepted.session_id == 0;
+                break;
+            }
+            addrlen = sizeof(s0.receiver_addr);
+        }
+    }
+    if (refused) {
+        cerr << "Receiver at " << ip << " refused the transfer (too many sessions)\n";
+        sender_log(LogLevel::Error) << "[Sender] Receiver refused the transfer (too many sessions)" << endl;
+        return 1;
+    }
+    if (!acked) {
+        cerr << "No FILE_HDR_ACK from " << ip << "\n";
+        sender_log(LogLevel::Error) << "[Sender] No FILE_HDR_ACK received, giving up" << endl;
+        return 1;
+    }
+
+    // Adopt what the receiver accepted; it may only shrink the layout
+    if (accepted.records_per_packet >= 1 && accepted.records_per_packet <= negotiated_header.records_per_packet)
+        negotiated_header.records_per_packet = accepted.records_per_packet;
+    if (accepted.M >= 1 && accepted.M <= negotiated_header.M) negotiated_header.M = accepted.M;
+    negotiated_header.session_id = accepted.session_id;
+    sender_log << "[Sender] Received FILE_HDR_ACK for session " << negotiated_header.session_id << endl;
+    if (compress_enabled && !(accepted.flags & HDR_COMPRESSION)) {
+        sender_log(LogLevel::Warn) << "[Sender] Receiver does not take compressed datagrams, sending raw" << endl;
+        compress_enabled = false;
+    }
+    // Without delta the receiver matched its checkpoint against the path fingerprint, which says
+    // nothing about the contents, so records it holds may be of another version: none are skipped
+    bool delta_refused = delta_enabled && !(accepted.flags & HDR_DELTA);
+    if (delta_refused)
+        sender_log(LogLevel::Warn) << "[Sender] Receiver does not do delta transfers, sending the whole file" << endl;
+    if (delta_enabled && !delta_refused) fetch_signature(s0, accepted.delta_blocks);
+    else if (accepted.records_held && negotiated_header.file_id && !delta_refused) fetch_held_records(s0, accepted.records_held);
+    sender_log << "[Sender] Negotiated records-per-blast M=" << negotiated_header.M
+               << ", records_per_packet=" << negotiated_header.records_per_packet
+               << " (record_size=" << negotiated_header.record_size << ", file_size=" << negotiated_header.file_size << ")" << endl;
 
     tv.tv_sec = 0; tv.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    setsockopt(s0.sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+    // Split the file into whole blasts per stream; never more streams than there are blasts
+    uint32_t total_records = record_store.total_records();
+    uint32_t total_blasts = (total_records + negotiated_header.M - 1) / negotiated_header.M;
+    while (streams.size() > 1 && streams.size() > total_blasts) {
+        close(streams.back()->sockfd);
+        streams.pop_back();
+    }
+    num_streams = (uint32_t)streams.size();
+    uint64_t records_per_stream = (uint64_t)(total_blasts + num_streams - 1) / num_streams * negotiated_header.M;
+    for (auto &sp : streams) {
+        sp->first_record = (uint32_t)min<uint64_t>(total_records, sp->id * records_per_stream);
+        sp->end_record = (uint32_t)min<uint64_t>(total_records, (sp->id + 1) * records_per_stream);
+    }
+    if (num_streams > 1)
+        sender_log << "[Sender] Splitting " << total_records << " records across " << num_streams << " streams ("
+                   << (separate_ports ? "separate ports" : "shared port") << ")" << endl;
 
-    thread t_disk(disk_read_thread, filename);
-    thread t_net(network_sender_thread);
-    t_disk.join();
-    t_net.join();
+    // Blast buffers: enough for a full window plus the read-ahead, within the memory cap
+    size_t blast_bytes = (size_t)negotiated_header.M * (negotiated_header.record_size + sizeof(Segment));
+    size_t zbuf_bytes = 0;
+    if (compress_enabled) {
+        uint32_t rpp = negotiated_header.records_per_packet;
+        zbuf_bytes = (size_t)(negotiated_header.M + rpp - 1) / rpp * rpp * negotiated_header.record_size;
+        blast_bytes += zbuf_bytes;
+    }
+    size_t pool = window_blasts + queue_blasts;
+    if (queue_memory) pool = min(pool, max<size_t>(1, queue_memory / (blast_bytes * num_streams)));
+    if (pool < window_blasts)
+        sender_log(LogLevel::Warn) << "[Sender] --queue-memory leaves " << pool << " blast buffer(s) per stream; fewer than "
+                                   << window_blasts << " blasts will be in flight" << endl;
+    for (auto &sp : streams) {
+        sp->blast_buffers.resize(pool);
+        for (BlastPacket &b : sp->blast_buffers) {
+            b.segments.reserve(negotiated_header.M);
+            if (checksums_enabled) b.crcs.reserve(negotiated_header.M);
+            b.zbuf.resize(zbuf_bytes);
+            sp->free_blasts.push_back(&b);
+        }
+        sp->retrans_pkt.segments.reserve(negotiated_header.M);
+    }
+    sender_log << "[Sender] Blast buffers: " << pool << " per stream of " << blast_bytes / 1024 << " KiB ("
+               << pool * blast_bytes * num_streams / 1048576.0 << " MiB in all)" << endl;
 
-    close(sockfd);
+    if (use_gso) {
+        int gso_size = 0; socklen_t optlen = sizeof(gso_size);
+        if (getsockopt(s0.sockfd, SOL_UDP, UDP_SEGMENT, &gso_size, &optlen) < 0) {
+            sender_log(LogLevel::Warn) << "[Sender] UDP_SEGMENT unavailable (" << strerror(errno) << "), sending unsegmented" << endl;
+            for (auto &sp : streams) sp->use_gso = false;
+        }
+    }
+
+    if (!stats_path.empty()) {
+        if (stats_file.start(stats_path, stats_interval, render_metrics))
+            sender_log << "[Sender] Writing live stats to " << stats_path << " every " << stats_interval.count() << " ms" << endl;
+        else sender_log(LogLevel::Warn) << "[Sender] Cannot write stats file " << stats_path << endl;
+    }
+
+    if (use_uring) {
+        for (auto &sp : streams) {
+            auto ring = make_unique<IoUring>();
+            if (!ring->init(max(send_batch, 8u)) || !ring->register_files(&sp->sockfd, 1)) {
+                sender_log(LogLevel::Warn) << "[Sender] io_uring unavailable (" << strerror(errno) << "), sending with sendmmsg" << endl;
+                for (auto &other : streams) other->ring.reset();
+                break;
+            }
+            sp->ring = std::move(ring);
+        }
+        if (streams[0]->ring) sender_log << "[Sender] Sending through io_uring, " << send_batch << " datagrams per submission" << endl;
+    }
+
+    if (compress_enabled) compress_pool.start(compress_threads);
+    vector<thread> threads;
+    for (auto &sp : streams) {
+        threads.emplace_back(disk_read_thread, ref(*sp));
+        threads.emplace_back(network_sender_thread, ref(*sp));
+        if (pin_cpus) pin_thread(threads.back(), sp->id);
+    }
+    for (auto &t : threads) t.join();
+    compress_pool.stop();
+    stats_file.stop();
+
+    log_summary();
+    sender_trace.close();
+    if (trace_enabled)
+        sender_log << "[Sender] Trace: entries=" << sender_trace.written_entries() << ", dropped=" << sender_trace.dropped_entries() << endl;
+    sender_log.close();
+    for (auto &sp : streams) close(sp->sockfd);
     return 0;
 }
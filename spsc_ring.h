@@ -0,0 +1,103 @@
+// spsc_ring.h
+// Lock-free single-producer single-consumer ring of variable-size entries
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Each entry is a small fixed-size metadata block and a payload, laid out contiguously, never
+// wrapping: an entry that does not fit before the end of the buffer is preceded by a skip marker
+// and starts over at the beginning. Payloads start on `align` boundaries (a page for O_DIRECT).
+// Positions count bytes from the start and only grow; the producer publishes with a release store
+// of its position and the consumer frees with one of its own, so neither side ever takes a lock.
+// The consumer may walk ahead of what it has freed, so it can batch entries before letting go.
+class SpscRing {
+public:
+    ~SpscRing() { free(mem); }
+
+    bool init(size_t capacity, size_t payload_align = 64) {
+        align = payload_align < 64 ? 64 : payload_align;
+        cap = (capacity + align - 1) / align * align;
+        mem = (char *)aligned_alloc(align, cap);
+        return mem != nullptr;
+    }
+
+    // Producer: room for an entry, or false while the ring is too full. The entry becomes visible to
+    // the consumer at publish().
+    bool claim(size_t meta_len, size_t len, char *&meta, char *&payload) {
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        size_t idx = (size_t)(pos % cap);
+        size_t payload_at = round_up(idx + sizeof(Prefix) + meta_len, align) - idx;
+        size_t size = round_up(payload_at + len, 64);
+        size_t skip = idx + size > cap ? cap - idx : 0;
+        if (skip) {
+            idx = 0;
+            payload_at = round_up(sizeof(Prefix) + meta_len, align);
+            size = round_up(payload_at + len, 64);
+        }
+        if (size + skip > cap) return false;
+        if (pos + skip + size - cached_head > cap) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (pos + skip + size - cached_head > cap) return false;
+        }
+        if (skip) {
+            Prefix marker = {skip, 0, 0};
+            memcpy(mem + pos % cap, &marker, sizeof(marker));
+        }
+        Prefix p = {size, (uint32_t)payload_at, (uint32_t)len};
+        memcpy(mem + idx, &p, sizeof(p));
+        meta = mem + idx + sizeof(Prefix);
+        payload = mem + idx + payload_at;
+        pending = pos + skip + size;
+        return true;
+    }
+
+    void publish() { tail.store(pending, std::memory_order_release); }
+
+    // Producer: whether the consumer has released every entry before pos, a write_pos() taken
+    // earlier; what it did with them before releasing is visible from here on
+    bool released(uint64_t pos) const { return head.load(std::memory_order_acquire) >= pos; }
+
+    // Consumer: entries from read_pos() up to write_pos(). entry() reads the one at pos and returns
+    // where the next one starts; release(pos) hands everything before pos back to the producer.
+    uint64_t read_pos() const { return head.load(std::memory_order_relaxed); }
+    uint64_t write_pos() const { return tail.load(std::memory_order_acquire); }
+
+    uint64_t entry(uint64_t pos, char *&meta, char *&payload, size_t &len) const {
+        Prefix p;
+        memcpy(&p, mem + pos % cap, sizeof(p));
+        if (p.payload_at == 0) {            // skip marker
+            pos += p.size;
+            memcpy(&p, mem + pos % cap, sizeof(p));
+        }
+        size_t idx = (size_t)(pos % cap);
+        meta = mem + idx + sizeof(Prefix);
+        payload = mem + idx + p.payload_at;
+        len = p.len;
+        return pos + p.size;
+    }
+
+    void release(uint64_t pos) { head.store(pos, std::memory_order_release); }
+
+    // Bytes in use, entries not yet released included; readable from any thread
+    size_t used() const { return (size_t)(tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed)); }
+    size_t capacity() const { return cap; }
+
+private:
+    struct Prefix {
+        uint64_t size;          // bytes to the next entry
+        uint32_t payload_at;    // offset of the payload from the entry; 0 marks a skip to the end
+        uint32_t len;
+    };
+
+    static size_t round_up(size_t n, size_t a) { return (n + a - 1) / a * a; }
+
+    char *mem = nullptr;
+    size_t cap = 0, align = 64;
+    alignas(64) std::atomic<uint64_t> head{0};      // written by the consumer
+    alignas(64) std::atomic<uint64_t> tail{0};      // written by the producer
+    uint64_t cached_head = 0, pending = 0;          // producer only
+};
@@ -0,0 +1,63 @@
+// tracedump.cpp
+// Decodes a binary trace written by sender or receiver (sender.trace / receiver.trace) into text
+#include <bits/stdc++.h>
+#include "log.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+    vector<string> args;
+    bool only_summary = false;
+    long thread_filter = -1;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--summary") only_summary = true;
+        else if (a == "--thread" && i + 1 < argc) thread_filter = stol(argv[++i]);
+        else args.push_back(a);
+    }
+    if (args.size() != 1) {
+        cerr << "Usage: ./tracedump <trace_file> [--summary] [--thread <id>]\n";
+        return 1;
+    }
+
+    ifstream in(args[0], ios::binary);
+    if (!in) { cerr << "Cannot open " << args[0] << "\n"; return 1; }
+
+    TraceFileHeader h;
+    if (!in.read((char *)&h, sizeof(h)) || h.magic != TRACE_MAGIC) {
+        cerr << args[0] << " is not a trace file\n";
+        return 1;
+    }
+    if (h.version != TRACE_VERSION || h.entry_size != sizeof(TraceEntry)) {
+        cerr << "Unsupported trace version " << h.version << " (entry size " << h.entry_size << ")\n";
+        return 1;
+    }
+
+    time_t start_sec = (time_t)(h.start_ns / 1000000000ull);
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&start_sec));
+    cout << "# trace started " << when << "\n";
+
+    vector<uint64_t> counts(TR_EVENT_COUNT, 0);
+    uint64_t total = 0, last_ns = 0;
+    TraceEntry e;
+    char line[256];
+    while (in.read((char *)&e, sizeof(e))) {
+        if (thread_filter >= 0 && e.thread != thread_filter) continue;
+        total++;
+        last_ns = e.ns;
+        if (e.event < TR_EVENT_COUNT) counts[e.event]++;
+        if (only_summary) continue;
+
+        const TraceEventInfo *info = trace_event_info(e.event);
+        if (info) snprintf(line, sizeof(line), info->format, e.arg[0], e.arg[1], e.arg[2], e.arg[3], e.arg[4]);
+        else snprintf(line, sizeof(line), "unknown event %u (%u %u %u %u %u)", e.event, e.arg[0], e.arg[1], e.arg[2], e.arg[3], e.arg[4]);
+        printf("%12.6f t%-2u %s\n", e.ns / 1e9, e.thread, line);
+    }
+
+    cout << "# " << total << " entries over " << last_ns / 1e9 << "s\n";
+    for (uint16_t ev = 1; ev < TR_EVENT_COUNT; ++ev) {
+        if (counts[ev]) cout << "#   " << setw(10) << counts[ev] << "  " << trace_event_info(ev)->name << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+// uring.h
+// Minimal io_uring wrapper over the raw syscalls (no liburing): ring setup, submission and
+// completion, and registration of fixed files and buffers. One ring is owned by one thread.
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+class IoUring {
+public:
+    // Sets up a ring with at least `entries` submission slots; false (errno set) if the kernel
+    // has no io_uring or it is disabled
+    bool init(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0) return false;
+        ext_arg = p.features & IORING_FEAT_EXT_ARG;
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) { sq_ptr = nullptr; return fail(); }
+        cq_ptr = single_mmap ? sq_ptr : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) { cq_ptr = nullptr; return fail(); }
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) { sqes = nullptr; return fail(); }
+
+        char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+        sq_head = (unsigned *)(sq + p.sq_off.head);
+        sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        cq_head = (unsigned *)(cq + p.cq_off.head);
+        cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        // SQEs are always handed over in ring order, so the index array is the identity
+        unsigned *array = (unsigned *)(sq + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) array[i] = i;
+        return true;
+    }
+
+    bool is_open() const { return fd >= 0; }
+    unsigned capacity() const { return sq_entries; }
+
+    bool register_files(const int *fds, unsigned n) {
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds, n) == 0;
+    }
+    bool register_buffers(const iovec *iov, unsigned n) {
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+    }
+
+    // Next free submission entry, zeroed, or nullptr while every slot is queued but unsubmitted
+    io_uring_sqe *get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries) return nullptr;
+        io_uring_sqe *sqe = &sqes[local_tail & sq_mask];
+        local_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Whether submit() can bound its wait with a timeout (IORING_FEAT_EXT_ARG, Linux 5.11+);
+    // without it a waiting submit() blocks until wait_nr completions arrive
+    bool has_wait_timeout() const { return ext_arg; }
+
+    // Submits everything queued and waits until at least wait_nr completions are ready, or the
+    // timeout (if any) passes. Returns the number submitted, or -errno.
+    int submit(unsigned wait_nr = 0, const timespec *timeout = nullptr) {
+        unsigned to_submit = local_tail - submitted;
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        io_uring_getevents_arg arg;
+        __kernel_timespec ts;
+        void *argp = nullptr;
+        size_t argsz = 0;
+        if (wait_nr && timeout && ext_arg) {
+            ts.tv_sec = timeout->tv_sec;
+            ts.tv_nsec = timeout->tv_nsec;
+            memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+        int r = (int)syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags, argp, argsz);
+        if (r < 0) {
+            // A timeout or signal still leaves the entries submitted
+            if ((errno == ETIME || errno == EINTR) && to_submit) { submitted = local_tail; return (int)to_submit; }
+            return -errno;
+        }
+        submitted += (unsigned)r;
+        return r;
+    }
+
+    // Takes the next completion, if one is ready
+    bool pop_cqe(io_uring_cqe &out) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        out = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Tears the ring down; requests still in flight (posted receives) are cancelled
+    void close() {
+        if (sqes) munmap(sqes, sqes_len);
+        if (cq_ptr && !single_mmap) munmap(cq_ptr, cq_len);
+        if (sq_ptr) munmap(sq_ptr, sq_len);
+        if (fd >= 0) ::close(fd);
+        sqes = nullptr; sq_ptr = cq_ptr = nullptr; fd = -1;
+    }
+
+    ~IoUring() { close(); }
+
+private:
+    bool fail() {
+        int saved = errno;
+        close();
+        errno = saved;
+        return false;
+    }
+
+    int fd = -1;
+    bool ext_arg = false, single_mmap = false;
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0, cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+    unsigned local_tail = 0, submitted = 0;
+};
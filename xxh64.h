@@ -0,0 +1,57 @@
+// xxh64.h
+// XXH64, the fast non-cryptographic hash behind delta-transfer signatures
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Four independent 64-bit lanes over 32-byte stripes, then the tail, then a final avalanche. Several
+// GB/s per core, so hashing a file costs about what reading it does.
+const uint64_t XXH_P1 = 11400714785074694791ull, XXH_P2 = 14029467366897019727ull, XXH_P3 = 1609587929392839161ull,
+               XXH_P4 = 9650029242287828579ull, XXH_P5 = 2870177450012600261ull;
+
+inline uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline uint64_t xxh_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+inline uint32_t xxh_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return xxh_rotl(acc, 31) * XXH_P1;
+}
+
+inline uint64_t xxh_merge(uint64_t acc, uint64_t lane) {
+    acc ^= xxh_round(0, lane);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+inline uint64_t xxh64(const void *data, size_t len, uint64_t seed = 0) {
+    const uint8_t *p = (const uint8_t *)data, *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (end - p >= 4) {
+        h = xxh_rotl(h ^ (uint64_t)xxh_read32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}